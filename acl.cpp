@@ -0,0 +1,61 @@
+//===- acl.cpp - Client access control --------------------------*- C++ -*-===//
+//
+/// \file
+/// Allow and deny lists of client prefixes, checked on accept.
+//
+// Author:  zxh
+// Date:    2026/10/17 16:52:37
+//===----------------------------------------------------------------------===//
+
+#include "acl.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+void AccessList::add(const std::string &rule) {
+  std::istringstream in(rule);
+  std::string verb, cidr, extra;
+  in >> verb >> cidr >> extra;
+
+  CidrPrefix prefix;
+  if ((verb != "allow" && verb != "deny") || !extra.empty() ||
+      !parse_cidr(cidr, prefix))
+    throw std::runtime_error("invalid acl rule '" + rule + "'");
+
+  Action action = verb == "allow" ? kAllow : kDeny;
+  trie_.insert(prefix, action);
+  has_allow_ = has_allow_ || action == kAllow;
+  size_++;
+}
+
+void AccessList::add_file(const std::string &path) {
+  std::ifstream in(path);
+  if (!in)
+    throw std::runtime_error("can't open acl file '" + path + "'");
+
+  std::string line;
+  for (int no = 1; std::getline(in, line); no++) {
+    line = line.substr(0, line.find('#'));
+    if (line.find_first_not_of(" \t\r") == std::string::npos)
+      continue;
+    try {
+      add(line);
+    } catch (const std::runtime_error &e) {
+      throw std::runtime_error(path + ":" + std::to_string(no) + ": " +
+                               e.what());
+    }
+  }
+}
+
+size_t AccessControl::reload() {
+  auto list = std::make_shared<AccessList>();
+  for (const auto &r : rules_)
+    list->add(r);
+  if (!file_.empty())
+    list->add_file(file_);
+
+  size_t size = list->size();
+  std::atomic_store(&list_, std::shared_ptr<const AccessList>(list));
+  return size;
+}
@@ -0,0 +1,74 @@
+//===- acl.h - Client access control ----------------------------*- C++ -*-===//
+//
+/// \file
+/// Allow and deny lists of client prefixes, checked on accept.
+//
+// Author:  zxh
+// Date:    2026/10/17 16:40:12
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "cidr.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/// Rules of one tuple. The longest prefix containing the client decides,
+/// a client matching none is denied if there is any allow rule.
+class AccessList {
+public:
+  enum Action : int32_t {
+    kDeny = 0,
+    kAllow = 1,
+  };
+
+  /// Add "allow cidr" or "deny cidr", throw std::runtime_error if invalid.
+  void add(const std::string &rule);
+
+  /// Add the rules of \p path, one per line, '#' starts a comment.
+  void add_file(const std::string &path);
+
+  bool allowed(const asio::ip::address &addr) const noexcept {
+    int32_t action = trie_.longest_match(addr);
+    if (action == CidrTrie::kNoValue)
+      return !has_allow_;
+    return action == kAllow;
+  }
+
+  size_t size() const { return size_; }
+
+private:
+  CidrTrie trie_;
+  bool has_allow_ = false;
+  size_t size_ = 0;
+};
+
+/// The current AccessList of a tuple. Reload builds a new list and swaps the
+/// pointer, checks in flight keep the list they loaded, so accepts never
+/// wait for a reload.
+class AccessControl {
+public:
+  AccessControl() : list_(std::make_shared<AccessList>()) {}
+
+  /// Inline rule, applied before those of the file.
+  void add_rule(const std::string &rule) { rules_.push_back(rule); }
+
+  void set_file(const std::string &file) { file_ = file; }
+
+  const std::string &file() const { return file_; }
+
+  bool allowed(const asio::ip::address &addr) const noexcept {
+    return std::atomic_load(&list_)->allowed(addr);
+  }
+
+  /// Rebuild from the rules and file and return the rule count. Throw
+  /// std::runtime_error on error, the current list stays then.
+  size_t reload();
+
+private:
+  std::vector<std::string> rules_;
+  std::string file_;
+  std::shared_ptr<const AccessList> list_;
+};
@@ -0,0 +1,78 @@
+//===- endpoint_bench.cpp - Endpoint formatting cost ------------*- C++ -*-===//
+//
+/// \file
+/// Nanoseconds and heap allocations per endpoint formatted by the
+/// std::stringstream to_string() relays used before, by to_string() and by
+/// EndpointText, for IPv4, IPv6 and unix endpoints.
+//
+// Author:  zxh
+// Date:    2026/10/17 23:38:52
+//===----------------------------------------------------------------------===//
+
+#include "netutil.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+
+static thread_local size_t allocs = 0;
+
+void *operator new(size_t n) {
+  allocs++;
+  if (void *p = std::malloc(n))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+using asio::generic::stream_protocol;
+using asio::ip::tcp;
+
+static std::string legacy_to_string(const tcp::endpoint &endpoint) {
+  std::stringstream ss;
+  ss << endpoint;
+  return ss.str();
+}
+
+// Keeps the compiler from dropping the work.
+static size_t sink = 0;
+
+template <typename F> static void run(const char *name, size_t n, F f) {
+  for (size_t i = 0; i < n / 10; i++)
+    f();
+
+  size_t before = allocs;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++)
+    f();
+  std::chrono::duration<double, std::nano> took =
+      std::chrono::steady_clock::now() - start;
+
+  printf("%-14s %8.1f ns %6.2f allocs\n", name, took.count() / n,
+         double(allocs - before) / n);
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+
+  tcp::endpoint v4(asio::ip::make_address("192.168.100.23"), 51234);
+  tcp::endpoint v6(asio::ip::make_address("2001:db8:85a3::8a2e:370:7334"),
+                   8443);
+  stream_protocol::endpoint generic(v4.data(), v4.size());
+  std::error_code ec;
+  stream_protocol::endpoint local = make_unix_endpoint("/run/mux.sock", ec);
+
+  run("legacy v4", n, [&] { sink += legacy_to_string(v4).size(); });
+  run("to_string v4", n, [&] { sink += to_string(v4).size(); });
+  run("text v4", n, [&] { sink += EndpointText(v4).view().size(); });
+  run("legacy v6", n, [&] { sink += legacy_to_string(v6).size(); });
+  run("to_string v6", n, [&] { sink += to_string(v6).size(); });
+  run("text v6", n, [&] { sink += EndpointText(v6).view().size(); });
+  run("text generic", n, [&] { sink += EndpointText(generic).view().size(); });
+  run("text unix", n, [&] { sink += EndpointText(local).view().size(); });
+  return sink == 0;
+}
@@ -0,0 +1,127 @@
+//===- log_bench.cpp - logrus line cost -------------------------*- C++ -*-===//
+//
+/// \file
+/// Nanoseconds and heap allocations per "Forward done" line, for LOG_INFO
+/// as text, JSON and binary records, the Entry API and the per-field
+/// fmt::format encoder LOG_INFO used before.
+/// Lines go through the file writer to /dev/null, so the numbers are what a
+/// relay thread pays.
+//
+// Author:  zxh
+// Date:    2026/10/17 21:48:05
+//===----------------------------------------------------------------------===//
+
+#include "logrus.h"
+
+#define FMT_HEADER_ONLY
+#include <spdlog/fmt/fmt.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+static thread_local size_t allocs = 0;
+
+void *operator new(size_t n) {
+  allocs++;
+  if (void *p = std::malloc(n))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// The encoder before fields were written in place, one std::string per
+// field and one more for the line.
+static void legacy_log_to(logrus::Logger *logger, logrus::Level level,
+                          std::string_view msg,
+                          std::vector<logrus::FieldType> &&fields) {
+  fmt::basic_memory_buffer<char, 256> buf;
+  fmt::format_to(std::back_inserter(buf), "{}{}{}{}{}", logrus::kFieldMsgKey,
+                 logrus::kFieldDelim, logrus::kFieldValueQuoted, msg,
+                 logrus::kFieldValueQuoted);
+  for (const auto &pair : fields) {
+    std::visit(
+        [&](const auto &value) {
+          std::string s = fmt::format(" {}={}{}{}", pair.first,
+                                      logrus::kFieldValueQuoted, value,
+                                      logrus::kFieldValueQuoted);
+          std::copy_n(s.begin(), s.size(), std::back_inserter(buf));
+        },
+        pair.second);
+  }
+  logger->log("", 0, "", level, std::string(buf.data(), buf.size()));
+}
+
+static const std::string from = "192.168.100.23:51234";
+static const std::string via = "10.0.0.1:443";
+static const std::string to = "10.0.8.17:8443";
+
+template <typename F> static void run(const char *name, size_t lines, F f) {
+  for (size_t i = 0; i < lines / 10; i++)
+    f(i);
+
+  size_t before = allocs;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < lines; i++)
+    f(i);
+  std::chrono::duration<double, std::nano> took =
+      std::chrono::steady_clock::now() - start;
+
+  printf("%-8s %8.1f ns/line %6.2f allocs/line\n", name,
+         took.count() / lines, double(allocs - before) / lines);
+}
+
+int main(int argc, char *argv[]) {
+  size_t lines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 500000;
+
+  logrus::set_rotating("/dev/null", SIZE_MAX, 0);
+  logrus::set_overflow(logrus::kOverflowBlock);
+  logrus::set_pattern("%^%l%$ %Y%m%d %H:%M:%S %t %v");
+
+  run("legacy", lines, [](size_t i) {
+    legacy_log_to(&logrus::sl(), logrus::kInfo, "Forward done",
+                  {{"from", from},
+                   {"via", via},
+                   {"to", to},
+                   {"in_bytes", i},
+                   {"out_bytes", i * 3},
+                   {"dur", 1200}});
+  });
+  run("entry", lines, [](size_t i) {
+    logrus::with_fields({{"from", from},
+                         {"via", via},
+                         {"to", to},
+                         {"in_bytes", i},
+                         {"out_bytes", i * 3},
+                         {"dur", 1200}})
+        .info("Forward done");
+  });
+  run("LOG_INFO", lines, [](size_t i) {
+    LOG_INFO("Forward done", KV("from", from), KV("via", via), KV("to", to),
+             KV("in_bytes", i), KV("out_bytes", i * 3), KV("dur", 1200));
+  });
+
+  logrus::Logger json;
+  json.set_rotating("json", "/dev/null", SIZE_MAX, 0);
+  json.set_overflow(logrus::kOverflowBlock);
+  json.set_format(logrus::kFormatJson);
+  run("json", lines, [&json](size_t i) {
+    LOG_INFO_(json, "Forward done", KV("from", from), KV("via", via),
+              KV("to", to), KV("in_bytes", i), KV("out_bytes", i * 3),
+              KV("dur", 1200));
+  });
+
+  logrus::Logger binary;
+  binary.set_rotating("binary", "/dev/null", SIZE_MAX, 0);
+  binary.set_overflow(logrus::kOverflowBlock);
+  binary.set_format(logrus::kFormatBinary);
+  run("binary", lines, [&binary](size_t i) {
+    LOG_INFO_(binary, "Forward done", KV("from", from), KV("via", via),
+              KV("to", to), KV("in_bytes", i), KV("out_bytes", i * 3),
+              KV("dur", 1200));
+  });
+  return 0;
+}
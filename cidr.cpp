@@ -0,0 +1,160 @@
+//===- cidr.cpp - CIDR prefix matching --------------------------*- C++ -*-===//
+//
+/// \file
+/// Path compressed radix tree over IPv4 and IPv6 prefixes.
+//
+// Author:  zxh
+// Date:    2026/10/17 14:15:40
+//===----------------------------------------------------------------------===//
+
+#include "cidr.h"
+
+#include <algorithm>
+
+static uint64_t load_be64(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static uint64_t mask64(int len) {
+  if (len <= 0)
+    return 0;
+  if (len >= 64)
+    return ~uint64_t(0);
+  return ~uint64_t(0) << (64 - len);
+}
+
+static CidrPrefix masked(CidrPrefix p, int len) {
+  p.hi &= mask64(len);
+  p.lo &= mask64(len - 64);
+  p.len = len;
+  return p;
+}
+
+// Length of the common leading bits of \p a and \p b, at most \p limit.
+static int common_len(const CidrPrefix &a, const CidrPrefix &b, int limit) {
+  int n;
+  if (a.hi != b.hi)
+    n = __builtin_clzll(a.hi ^ b.hi);
+  else if (a.lo != b.lo)
+    n = 64 + __builtin_clzll(a.lo ^ b.lo);
+  else
+    n = 128;
+  return std::min(n, limit);
+}
+
+CidrPrefix CidrPrefix::from_address(const asio::ip::address &addr) {
+  CidrPrefix p;
+  p.len = 128;
+  if (addr.is_v4()) { // ::ffff:a.b.c.d
+    p.lo = (uint64_t(0xFFFF) << 32) | addr.to_v4().to_uint();
+    return p;
+  }
+  auto b = addr.to_v6().to_bytes();
+  p.hi = load_be64(b.data());
+  p.lo = load_be64(b.data() + 8);
+  return p;
+}
+
+bool parse_cidr(const std::string &s, CidrPrefix &prefix) {
+  size_t slash = s.find('/');
+  std::error_code ec;
+  asio::ip::address addr = asio::ip::make_address(s.substr(0, slash), ec);
+  if (ec)
+    return false;
+
+  int max_len = addr.is_v4() ? 32 : 128;
+  int len = max_len;
+  if (slash != std::string::npos) {
+    std::string l = s.substr(slash + 1);
+    if (l.empty() || l.size() > 3 ||
+        l.find_first_not_of("0123456789") != std::string::npos)
+      return false;
+    len = std::stoi(l);
+    if (len > max_len)
+      return false;
+  }
+  if (addr.is_v4())
+    len += 96;
+  prefix = masked(CidrPrefix::from_address(addr), len);
+  return true;
+}
+
+CidrTrie::CidrTrie() : root_(-1) {}
+
+bool CidrTrie::covers(const CidrPrefix &p, const CidrPrefix &key) noexcept {
+  return ((p.hi ^ key.hi) & mask64(p.len)) == 0 &&
+         ((p.lo ^ key.lo) & mask64(p.len - 64)) == 0;
+}
+
+int CidrTrie::bit(const CidrPrefix &key, int pos) noexcept {
+  if (pos < 64)
+    return (key.hi >> (63 - pos)) & 1;
+  return (key.lo >> (127 - pos)) & 1;
+}
+
+int32_t CidrTrie::new_node(const CidrPrefix &prefix, int32_t value) {
+  nodes_.emplace_back();
+  nodes_.back().prefix = prefix;
+  nodes_.back().value = value;
+  return nodes_.size() - 1;
+}
+
+void CidrTrie::insert(const CidrPrefix &prefix, int32_t value) {
+  CidrPrefix p = masked(prefix, prefix.len);
+
+  // The link to the current node is kept as parent and side, new_node may
+  // move nodes_.
+  int32_t parent = -1;
+  int side = 0;
+  auto link = [&]() -> int32_t & {
+    return parent < 0 ? root_ : nodes_[parent].child[side];
+  };
+
+  while (true) {
+    int32_t cur = link();
+    if (cur < 0) {
+      int32_t n = new_node(p, value);
+      link() = n;
+      return;
+    }
+
+    CidrPrefix cp = nodes_[cur].prefix;
+    int common = common_len(cp, p, std::min(cp.len, p.len));
+    if (common == cp.len && common == p.len) { // same prefix
+      nodes_[cur].value = value;
+      return;
+    }
+    if (common == cp.len) { // p is below cur
+      parent = cur;
+      side = bit(p, cp.len);
+      continue;
+    }
+
+    // cur and p diverge at common, or p is above cur. Either way a node for
+    // the shorter of the two takes cur's place.
+    int32_t n;
+    if (common == p.len) {
+      n = new_node(p, value);
+      nodes_[n].child[bit(cp, p.len)] = cur;
+    } else {
+      n = new_node(masked(p, common), kNoValue);
+      int32_t leaf = new_node(p, value);
+      nodes_[n].child[bit(cp, common)] = cur;
+      nodes_[n].child[bit(p, common)] = leaf;
+    }
+    link() = n;
+    return;
+  }
+}
+
+int32_t CidrTrie::longest_match(const asio::ip::address &addr) const noexcept {
+  int32_t best = kNoValue;
+  any_match(addr, [&best](int32_t v) {
+    best = v;
+    return false;
+  });
+  return best;
+}
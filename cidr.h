@@ -0,0 +1,80 @@
+//===- cidr.h - CIDR prefix matching ----------------------------*- C++ -*-===//
+//
+/// \file
+/// Path compressed radix tree over IPv4 and IPv6 prefixes.
+//
+// Author:  zxh
+// Date:    2026/10/17 14:02:18
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <asio/ip/address.hpp>
+
+/// An IPv4 or IPv6 prefix. IPv4 is kept as v4-mapped IPv6 so one tree holds
+/// both families.
+struct CidrPrefix {
+  uint64_t hi = 0;
+  uint64_t lo = 0;
+  int len = 0; // 0..128
+
+  static CidrPrefix from_address(const asio::ip::address &addr);
+};
+
+/// Parse "10.0.0.0/8", "fd00::/8" or a bare address as a host prefix.
+bool parse_cidr(const std::string &s, CidrPrefix &prefix);
+
+/// Prefixes with a value each. Chains of single children are collapsed, so
+/// a lookup visits at most one node per distinct prefix length on its path
+/// and every visit is two masked 64-bit compares.
+class CidrTrie {
+public:
+  static const int32_t kNoValue = -1;
+
+  CidrTrie();
+
+  /// Insert \p prefix, replacing the value of an equal prefix.
+  void insert(const CidrPrefix &prefix, int32_t value);
+
+  /// Value of the longest prefix containing \p addr, or kNoValue.
+  int32_t longest_match(const asio::ip::address &addr) const noexcept;
+
+  /// Call \p visit with the value of every prefix containing \p addr,
+  /// shortest first, until it returns true. Return whether it did.
+  template <typename Visit>
+  bool any_match(const asio::ip::address &addr, Visit visit) const {
+    CidrPrefix key = CidrPrefix::from_address(addr);
+    for (int32_t n = root_; n >= 0;) {
+      const Node &node = nodes_[n];
+      if (!covers(node.prefix, key))
+        break;
+      if (node.value != kNoValue && visit(node.value))
+        return true;
+      if (node.prefix.len == 128)
+        break;
+      n = node.child[bit(key, node.prefix.len)];
+    }
+    return false;
+  }
+
+  bool empty() const { return root_ < 0; }
+
+private:
+  struct Node {
+    CidrPrefix prefix;
+    int32_t value = kNoValue;
+    int32_t child[2] = {-1, -1};
+  };
+
+  static bool covers(const CidrPrefix &p, const CidrPrefix &key) noexcept;
+  static int bit(const CidrPrefix &key, int pos) noexcept;
+
+  int32_t new_node(const CidrPrefix &prefix, int32_t value);
+
+  std::vector<Node> nodes_;
+  int32_t root_;
+};
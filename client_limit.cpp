@@ -0,0 +1,129 @@
+//===- client_limit.cpp - Per client admission control ----------*- C++ -*-===//
+//
+/// \file
+/// Limits on concurrent and new connections of every client address.
+//
+// Author:  zxh
+// Date:    2026/10/17 17:48:26
+//===----------------------------------------------------------------------===//
+
+#include "client_limit.h"
+#include "cidr.h"
+
+#include <chrono>
+
+// splitmix64 finalizer
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+CountMinSketch::CountMinSketch() {
+  for (auto &row : cells_)
+    for (auto &c : row)
+      c.store(0, std::memory_order_relaxed);
+}
+
+size_t CountMinSketch::index(uint64_t hash, int row) noexcept {
+  // Rows take different 16 bit slices of one 64 bit hash.
+  return (hash >> (row * 16)) % kWidth;
+}
+
+void CountMinSketch::add(uint64_t hash, int32_t delta) noexcept {
+  for (int r = 0; r < kDepth; r++)
+    cells_[r][index(hash, r)].fetch_add(uint64_t(int64_t(delta)),
+                                        std::memory_order_relaxed);
+}
+
+uint32_t CountMinSketch::estimate(uint64_t hash) const noexcept {
+  uint64_t v = ~uint64_t(0);
+  for (int r = 0; r < kDepth; r++)
+    v = std::min(v, cells_[r][index(hash, r)].load(std::memory_order_relaxed));
+  return uint32_t(v);
+}
+
+uint32_t CountMinSketch::hit(uint64_t hash, uint32_t window) noexcept {
+  uint32_t est = UINT32_MAX;
+  for (int r = 0; r < kDepth; r++) {
+    std::atomic<uint64_t> &c = cells_[r][index(hash, r)];
+    uint64_t old = c.load(std::memory_order_relaxed);
+    uint64_t now;
+    do {
+      now = uint32_t(old >> 32) == window ? old + 1
+                                          : (uint64_t(window) << 32) | 1;
+    } while (!c.compare_exchange_weak(old, now, std::memory_order_relaxed));
+    est = std::min(est, uint32_t(now));
+  }
+  return est;
+}
+
+size_t ClientTable::KeyHash::operator()(const Key &k) const noexcept {
+  return mix(k.hi ^ mix(k.lo));
+}
+
+void ClientTable::release(const Key &key) noexcept {
+  auto it = active_.find(key);
+  if (it != active_.end() && --it->second == 0)
+    active_.erase(it);
+}
+
+ClientLease &ClientLease::operator=(ClientLease &&o) noexcept {
+  if (this != &o) {
+    reset();
+    limiter_ = o.limiter_;
+    table_ = o.table_;
+    key_ = o.key_;
+    hash_ = o.hash_;
+    o.limiter_ = nullptr;
+  }
+  return *this;
+}
+
+void ClientLease::reset() noexcept {
+  if (!limiter_)
+    return;
+  table_->release(key_);
+  limiter_->active_.add(hash_, -1);
+  limiter_ = nullptr;
+}
+
+ClientLimiter::Verdict ClientLimiter::admit(ClientTable &table,
+                                            const asio::ip::address &addr,
+                                            ClientLease &lease) noexcept {
+  CidrPrefix p = CidrPrefix::from_address(addr);
+  ClientTable::Key key{p.hi, p.lo};
+  uint64_t hash = mix(p.hi ^ mix(p.lo));
+
+  // The exact local count is checked first, a client over the limit in this
+  // context alone is refused without touching shared cells.
+  if (max_conns_ > 0 && (table.count(key) >= max_conns_ ||
+                          active_.estimate(hash) >= max_conns_))
+    return kTooManyConns;
+
+  if (max_rate_ > 0) {
+    auto sec = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch());
+    if (rate_.hit(hash, uint32_t(sec.count())) > max_rate_)
+      return kTooFast;
+  }
+
+  table.acquire(key);
+  active_.add(hash, 1);
+  lease = ClientLease(this, &table, key, hash);
+  return kAdmit;
+}
+
+const char *to_string(ClientLimiter::Verdict verdict) {
+  switch (verdict) {
+  case ClientLimiter::kTooManyConns:
+    return "too many connections";
+  case ClientLimiter::kTooFast:
+    return "too many new connections";
+  default:
+    return "admit";
+  }
+}
@@ -0,0 +1,126 @@
+//===- client_limit.h - Per client admission control ------------*- C++ -*-===//
+//
+/// \file
+/// Limits on concurrent and new connections of every client address.
+//
+// Author:  zxh
+// Date:    2026/10/17 17:35:04
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <asio/ip/address.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+
+/// Counters of many keys in a fixed table. Every key maps to one cell per
+/// row and reads the smallest, so collisions only overestimate. Cells are
+/// atomic and shared by all contexts.
+class CountMinSketch {
+public:
+  static const int kDepth = 4;
+  static const size_t kWidth = 4096;
+
+  CountMinSketch();
+
+  /// Gauge use, add \p delta to the count of \p hash.
+  void add(uint64_t hash, int32_t delta) noexcept;
+
+  uint32_t estimate(uint64_t hash) const noexcept;
+
+  /// Window use, count one event of \p hash in \p window and return the
+  /// estimate for that window. Cells of older windows start over.
+  uint32_t hit(uint64_t hash, uint32_t window) noexcept;
+
+private:
+  static size_t index(uint64_t hash, int row) noexcept;
+
+  std::atomic<uint64_t> cells_[kDepth][kWidth]; // count, or window << 32 |
+                                                // count for hit()
+};
+
+class ClientLimiter;
+
+/// Live connections of one context by client. A context only touches its own
+/// table, so it needs no locking.
+class ClientTable {
+public:
+  struct Key {
+    uint64_t hi;
+    uint64_t lo;
+
+    bool operator==(const Key &o) const { return hi == o.hi && lo == o.lo; }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &k) const noexcept;
+  };
+
+  uint32_t count(const Key &key) const noexcept {
+    auto it = active_.find(key);
+    return it == active_.end() ? 0 : it->second;
+  }
+
+  void acquire(const Key &key) { active_[key]++; }
+
+  void release(const Key &key) noexcept;
+
+private:
+  std::unordered_map<Key, uint32_t, KeyHash> active_;
+};
+
+/// A connection admitted by ClientLimiter, the slot is given back when the
+/// lease is destroyed. Must die on the context owning \p table.
+class ClientLease {
+public:
+  ClientLease() = default;
+  ClientLease(ClientLimiter *limiter, ClientTable *table,
+              const ClientTable::Key &key, uint64_t hash)
+      : limiter_(limiter), table_(table), key_(key), hash_(hash) {}
+  ClientLease(ClientLease &&o) noexcept { *this = std::move(o); }
+  ClientLease &operator=(ClientLease &&o) noexcept;
+  ~ClientLease() { reset(); }
+
+  void reset() noexcept;
+
+private:
+  ClientLimiter *limiter_ = nullptr;
+  ClientTable *table_ = nullptr;
+  ClientTable::Key key_{};
+  uint64_t hash_ = 0;
+};
+
+/// Connection limits of one tuple per client address, 0 is unlimited.
+/// Contexts count their own clients exactly, the sketches add them up over
+/// all contexts.
+class ClientLimiter {
+public:
+  ClientLimiter(uint32_t max_conns, uint32_t max_rate)
+      : max_conns_(max_conns), max_rate_(max_rate) {}
+
+  enum Verdict {
+    kAdmit = 0,
+    kTooManyConns = 1,
+    kTooFast = 2,
+  };
+
+  /// Admit a new connection of \p addr counted in \p table. On kAdmit
+  /// \p lease holds its slot.
+  Verdict admit(ClientTable &table, const asio::ip::address &addr,
+                ClientLease &lease) noexcept;
+
+  uint32_t max_conns() const { return max_conns_; }
+  uint32_t max_rate() const { return max_rate_; }
+
+private:
+  friend class ClientLease;
+
+  uint32_t max_conns_;
+  uint32_t max_rate_; // new connections per second
+  CountMinSketch active_;
+  CountMinSketch rate_;
+};
+
+const char *to_string(ClientLimiter::Verdict verdict);
@@ -12,4 +12,29 @@
 const std::error_category &address_category() {
   static AddressCategory c;
   return c;
-}
\ No newline at end of file
+}
+
+const std::error_category &proxy_protocol_category() {
+  static ProxyProtocolCategory c;
+  return c;
+}
+
+const std::error_category &tunnel_category() {
+  static TunnelCategory c;
+  return c;
+}
+
+const std::error_category &tls_category() {
+  static TlsCategory c;
+  return c;
+}
+
+const std::error_category &http_category() {
+  static HttpCategory c;
+  return c;
+}
+
+const std::error_category &frontend_category() {
+  static FrontendCategory c;
+  return c;
+}
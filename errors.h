@@ -20,6 +20,7 @@ enum AddressErrors {
   AddrErrMissingClosedBrackets,
   AddrErrUnexpectedOpenBrackets,
   AddrPortErrUnexpectedClosedBrackets,
+  AddrErrInvalidUnixPath,
 };
 
 class AddressCategory : public std::error_category {
@@ -46,10 +47,188 @@ public:
       return "unexpected '[' in address";
     case AddrPortErrUnexpectedClosedBrackets:
       return "unexpected ']' in address";
+    case AddrErrInvalidUnixPath:
+      return "invalid unix socket path";
     default:
       return "unknown error";
     }
   }
 };
 
-const std::error_category &address_category();
\ No newline at end of file
+const std::error_category &address_category();
+
+enum ProxyProtocolErrors {
+  ProxyErrNone,
+  ProxyErrIncomplete,
+  ProxyErrBadSignature,
+  ProxyErrBadVersion,
+  ProxyErrBadAddress,
+  ProxyErrHeaderTooLong,
+  ProxyErrVersionNotAllowed,
+};
+
+class ProxyProtocolCategory : public std::error_category {
+public:
+  const char *name() const noexcept override {
+    return "ProxyProtocolErrorCategory";
+  }
+
+  std::string message(int err_code) const override {
+    switch (err_code) {
+    case ProxyErrNone:
+      return "success";
+    case ProxyErrIncomplete:
+      return "incomplete PROXY header";
+    case ProxyErrBadSignature:
+      return "missing PROXY signature";
+    case ProxyErrBadVersion:
+      return "unsupported PROXY version or command";
+    case ProxyErrBadAddress:
+      return "malformed PROXY address";
+    case ProxyErrHeaderTooLong:
+      return "PROXY header too long";
+    case ProxyErrVersionNotAllowed:
+      return "PROXY version not allowed";
+    default:
+      return "unknown error";
+    }
+  }
+};
+
+const std::error_category &proxy_protocol_category();
+
+enum TunnelErrors {
+  TunnelErrNone,
+  TunnelErrBadFrame,
+  TunnelErrWindowExceeded,
+};
+
+class TunnelCategory : public std::error_category {
+public:
+  const char *name() const noexcept override { return "TunnelErrorCategory"; }
+
+  std::string message(int err_code) const override {
+    switch (err_code) {
+    case TunnelErrNone:
+      return "success";
+    case TunnelErrBadFrame:
+      return "malformed tunnel frame";
+    case TunnelErrWindowExceeded:
+      return "tunnel stream window exceeded";
+    default:
+      return "unknown error";
+    }
+  }
+};
+
+const std::error_category &tunnel_category();
+
+enum TlsErrors {
+  TlsErrNone,
+  TlsErrIncomplete,
+  TlsErrNotHandshake,
+  TlsErrMalformed,
+  TlsErrNoServerName,
+};
+
+class TlsCategory : public std::error_category {
+public:
+  const char *name() const noexcept override { return "TlsErrorCategory"; }
+
+  std::string message(int err_code) const override {
+    switch (err_code) {
+    case TlsErrNone:
+      return "success";
+    case TlsErrIncomplete:
+      return "incomplete TLS ClientHello";
+    case TlsErrNotHandshake:
+      return "not a TLS ClientHello";
+    case TlsErrMalformed:
+      return "malformed TLS ClientHello";
+    case TlsErrNoServerName:
+      return "missing TLS server name";
+    default:
+      return "unknown error";
+    }
+  }
+};
+
+const std::error_category &tls_category();
+
+enum HttpErrors {
+  HttpErrNone,
+  HttpErrIncomplete,
+  HttpErrNotRequest,
+  HttpErrMalformed,
+  HttpErrHeaderTooLong,
+  HttpErrNoHost,
+};
+
+class HttpCategory : public std::error_category {
+public:
+  const char *name() const noexcept override { return "HttpErrorCategory"; }
+
+  std::string message(int err_code) const override {
+    switch (err_code) {
+    case HttpErrNone:
+      return "success";
+    case HttpErrIncomplete:
+      return "incomplete HTTP header";
+    case HttpErrNotRequest:
+      return "not an HTTP request";
+    case HttpErrMalformed:
+      return "malformed HTTP header";
+    case HttpErrHeaderTooLong:
+      return "HTTP header too long";
+    case HttpErrNoHost:
+      return "missing HTTP Host header";
+    default:
+      return "unknown error";
+    }
+  }
+};
+
+const std::error_category &http_category();
+
+enum FrontendErrors {
+  FrontendErrNone,
+  FrontendErrIncomplete,
+  FrontendErrMalformed,
+  FrontendErrBadMethod,
+  FrontendErrBadCommand,
+  FrontendErrBadAddressType,
+  FrontendErrNoAuthMethod,
+  FrontendErrNotAllowed,
+};
+
+class FrontendCategory : public std::error_category {
+public:
+  const char *name() const noexcept override {
+    return "FrontendErrorCategory";
+  }
+
+  std::string message(int err_code) const override {
+    switch (err_code) {
+    case FrontendErrNone:
+      return "success";
+    case FrontendErrIncomplete:
+      return "incomplete proxy request";
+    case FrontendErrMalformed:
+      return "malformed proxy request";
+    case FrontendErrBadMethod:
+      return "HTTP method not CONNECT";
+    case FrontendErrBadCommand:
+      return "SOCKS command not supported";
+    case FrontendErrBadAddressType:
+      return "SOCKS address type not supported";
+    case FrontendErrNoAuthMethod:
+      return "no acceptable SOCKS auth method";
+    case FrontendErrNotAllowed:
+      return "destination not allowed";
+    default:
+      return "unknown error";
+    }
+  }
+};
+
+const std::error_category &frontend_category();
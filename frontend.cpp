@@ -0,0 +1,336 @@
+//===- frontend.cpp - HTTP CONNECT and SOCKS5 front-ends --------*- C++ -*-===//
+//
+/// \file
+/// Request parsing, replies and destination policy for tuples whose client
+/// names the destination.
+//
+// Author:  zxh
+// Date:    2026/10/17 15:34:51
+//===----------------------------------------------------------------------===//
+
+#include "frontend.h"
+#include "errors.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+
+const std::chrono::seconds ConnectCache::kTtl(60);
+
+const char *to_string(FrontendProtocol proto) {
+  switch (proto) {
+  case kFrontendConnect:
+    return "connect";
+  case kFrontendSocks5:
+    return "socks5";
+  default:
+    return "none";
+  }
+}
+
+static size_t fail(std::error_code &ec, FrontendErrors err) {
+  ec = std::error_code(err, frontend_category());
+  return 0;
+}
+
+// "host:port" or "[v6]:port" with a decimal port in 1..65535.
+static bool split_authority(std::string_view s, ConnectTarget &target) {
+  size_t colon = s.rfind(':');
+  if (colon == std::string_view::npos || colon == 0 || colon + 1 == s.size() ||
+      s.size() - colon > 6)
+    return false;
+
+  unsigned port = 0;
+  for (char c : s.substr(colon + 1)) {
+    if (c < '0' || c > '9')
+      return false;
+    port = port * 10 + (c - '0');
+  }
+  if (port == 0 || port > 65535)
+    return false;
+
+  std::string_view host = s.substr(0, colon);
+  if (host.front() == '[') {
+    if (host.size() < 3 || host.back() != ']')
+      return false;
+    host = host.substr(1, host.size() - 2);
+  } else if (host.find(':') != std::string_view::npos) {
+    return false; // bare IPv6
+  }
+  target.host.assign(host.data(), host.size());
+  target.port = port;
+  return true;
+}
+
+size_t parse_http_connect(const char *data, size_t n, ConnectTarget &target,
+                          std::error_code &ec) {
+  ec = std::error_code();
+  static const char kMethod[] = "CONNECT ";
+  size_t m = std::min(n, sizeof(kMethod) - 1);
+  if (std::memcmp(data, kMethod, m) != 0)
+    return fail(ec, FrontendErrBadMethod);
+
+  std::string_view s(data, std::min(n, kFrontendMaxRequestSize));
+  size_t end = s.find("\r\n\r\n");
+  if (end == std::string_view::npos)
+    return fail(ec, n >= kFrontendMaxRequestSize ? FrontendErrMalformed
+                                                 : FrontendErrIncomplete);
+
+  // CONNECT authority HTTP/1.x
+  std::string_view line = s.substr(0, s.find("\r\n"));
+  line.remove_prefix(sizeof(kMethod) - 1);
+  size_t sp = line.find(' ');
+  if (sp == std::string_view::npos ||
+      line.substr(sp + 1, 7) != "HTTP/1." || line.size() != sp + 9 ||
+      !split_authority(line.substr(0, sp), target))
+    return fail(ec, FrontendErrMalformed);
+  return end + 4;
+}
+
+size_t parse_socks5_greeting(const char *data, size_t n, std::error_code &ec) {
+  ec = std::error_code();
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+  if (n >= 1 && p[0] != 0x05)
+    return fail(ec, FrontendErrMalformed);
+  if (n < 2)
+    return fail(ec, FrontendErrIncomplete);
+  size_t len = 2 + p[1];
+  if (p[1] == 0)
+    return fail(ec, FrontendErrMalformed);
+  if (n < len)
+    return fail(ec, FrontendErrIncomplete);
+  if (!std::memchr(p + 2, 0x00, p[1]))
+    return fail(ec, FrontendErrNoAuthMethod);
+  return len;
+}
+
+size_t parse_socks5_request(const char *data, size_t n, ConnectTarget &target,
+                            std::error_code &ec) {
+  ec = std::error_code();
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+  // VER CMD RSV ATYP DST.ADDR DST.PORT
+  if (n < 5)
+    return fail(ec, FrontendErrIncomplete);
+  if (p[0] != 0x05 || p[2] != 0x00)
+    return fail(ec, FrontendErrMalformed);
+
+  size_t addr_len;
+  switch (p[3]) {
+  case 0x01:
+    addr_len = 4;
+    break;
+  case 0x03:
+    addr_len = 1 + p[4];
+    if (p[4] == 0)
+      return fail(ec, FrontendErrMalformed);
+    break;
+  case 0x04:
+    addr_len = 16;
+    break;
+  default:
+    return fail(ec, FrontendErrBadAddressType);
+  }
+  size_t len = 4 + addr_len + 2;
+  if (n < len)
+    return fail(ec, FrontendErrIncomplete);
+  if (p[1] != 0x01) // CONNECT only, checked once the whole request is read
+    return fail(ec, FrontendErrBadCommand);
+
+  const uint8_t *a = p + 4;
+  if (p[3] == 0x01) {
+    asio::ip::address_v4::bytes_type b;
+    std::memcpy(b.data(), a, b.size());
+    target.host = asio::ip::address_v4(b).to_string();
+  } else if (p[3] == 0x04) {
+    asio::ip::address_v6::bytes_type b;
+    std::memcpy(b.data(), a, b.size());
+    target.host = asio::ip::address_v6(b).to_string();
+  } else {
+    target.host.assign(reinterpret_cast<const char *>(a) + 1, a[0]);
+  }
+  target.port = (p[len - 2] << 8) | p[len - 1];
+  if (target.port == 0)
+    return fail(ec, FrontendErrMalformed);
+  return len;
+}
+
+// RFC 1928 section 6.
+static uint8_t socks5_reply_code(const std::error_code &ec) {
+  if (!ec)
+    return 0x00;
+  if (ec.category() == frontend_category()) {
+    switch (ec.value()) {
+    case FrontendErrNotAllowed:
+      return 0x02;
+    case FrontendErrBadCommand:
+      return 0x07;
+    case FrontendErrBadAddressType:
+      return 0x08;
+    default:
+      return 0x01;
+    }
+  }
+  if (ec == asio::error::network_unreachable)
+    return 0x03;
+  if (ec == asio::error::host_unreachable ||
+      ec == asio::error::host_not_found ||
+      ec == asio::error::host_not_found_try_again)
+    return 0x04;
+  if (ec == asio::error::connection_refused)
+    return 0x05;
+  if (ec == asio::error::timed_out)
+    return 0x06;
+  return 0x01;
+}
+
+static const char *http_reply_status(const std::error_code &ec) {
+  if (!ec)
+    return "200 Connection Established";
+  if (ec.category() == frontend_category()) {
+    switch (ec.value()) {
+    case FrontendErrNotAllowed:
+      return "403 Forbidden";
+    case FrontendErrBadMethod:
+      return "405 Method Not Allowed";
+    default:
+      return "400 Bad Request";
+    }
+  }
+  if (ec == asio::error::timed_out)
+    return "504 Gateway Timeout";
+  return "502 Bad Gateway";
+}
+
+std::string frontend_reply(FrontendProtocol proto, bool greeted,
+                           const std::error_code &ec,
+                           const asio::ip::tcp::endpoint &bound) {
+  if (proto == kFrontendConnect) {
+    std::string r = "HTTP/1.1 ";
+    r += http_reply_status(ec);
+    r += ec ? "\r\nConnection: close\r\n\r\n" : "\r\n\r\n";
+    return r;
+  }
+
+  if (!greeted) // method selection, nothing acceptable
+    return std::string("\x05\xFF", 2);
+
+  // VER REP RSV ATYP BND.ADDR BND.PORT, zeros unless connected
+  std::string r = {0x05, char(socks5_reply_code(ec)), 0x00};
+  asio::ip::address addr = bound.address();
+  if (!ec && addr.is_v6()) {
+    auto b = addr.to_v6().to_bytes();
+    r += char(0x04);
+    r.append(reinterpret_cast<const char *>(b.data()), b.size());
+  } else {
+    asio::ip::address_v4::bytes_type b{};
+    if (!ec && addr.is_v4())
+      b = addr.to_v4().to_bytes();
+    r += char(0x01);
+    r.append(reinterpret_cast<const char *>(b.data()), b.size());
+  }
+  uint16_t port = ec ? 0 : bound.port();
+  r += char(port >> 8);
+  r += char(port & 0xFF);
+  return r;
+}
+
+static bool parse_port(const std::string &s, uint16_t &port) {
+  if (s.empty() || s.size() > 5 ||
+      s.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  int v = std::stoi(s);
+  if (v == 0 || v > 65535)
+    return false;
+  port = v;
+  return true;
+}
+
+bool ConnectAllowlist::add(const std::string &rule) {
+  // 10.0.0.0/8, 10.0.0.0/8:443, [fd00::/8]:8000-8999 or fd00::/8
+  std::string cidr = rule, ports;
+  if (!rule.empty() && rule[0] == '[') {
+    size_t close = rule.find(']');
+    if (close == std::string::npos)
+      return false;
+    cidr = rule.substr(1, close - 1);
+    if (close + 1 < rule.size()) {
+      if (rule[close + 1] != ':')
+        return false;
+      ports = rule.substr(close + 2);
+    }
+  } else if (std::count(rule.begin(), rule.end(), ':') == 1) {
+    size_t colon = rule.find(':');
+    cidr = rule.substr(0, colon);
+    ports = rule.substr(colon + 1);
+  }
+
+  CidrPrefix prefix;
+  if (!parse_cidr(cidr, prefix))
+    return false;
+
+  PortRange range{1, 65535};
+  if (!ports.empty() || cidr.size() != rule.size()) {
+    size_t dash = ports.find('-');
+    if (!parse_port(ports.substr(0, dash), range.lo))
+      return false;
+    range.hi = range.lo;
+    if (dash != std::string::npos &&
+        (!parse_port(ports.substr(dash + 1), range.hi) || range.hi < range.lo))
+      return false;
+  }
+
+  // Rules of one prefix share a trie value.
+  size_t i = 0;
+  while (i < prefixes_.size() &&
+         (prefixes_[i].hi != prefix.hi || prefixes_[i].lo != prefix.lo ||
+          prefixes_[i].len != prefix.len))
+    i++;
+  if (i == prefixes_.size()) {
+    prefixes_.push_back(prefix);
+    ports_.emplace_back();
+    trie_.insert(prefix, i);
+  }
+  ports_[i].push_back(range);
+  rules_.push_back(rule);
+  return true;
+}
+
+bool ConnectAllowlist::allowed(
+    const asio::ip::tcp::endpoint &dst) const noexcept {
+  if (trie_.empty())
+    return false;
+  uint16_t port = dst.port();
+  return trie_.any_match(dst.address(), [&](int32_t v) {
+    for (const PortRange &r : ports_[v])
+      if (port >= r.lo && port <= r.hi)
+        return true;
+    return false;
+  });
+}
+
+const ConnectCache::Entry *ConnectCache::find(const std::string &key,
+                                              TimePoint now) const {
+  auto it = entries_.find(key);
+  if (it == entries_.end() || it->second.expiry <= now)
+    return nullptr;
+  return &it->second;
+}
+
+void ConnectCache::insert(const std::string &key, const Endpoint &dst,
+                          bool allowed, TimePoint now) {
+  if (entries_.size() >= kMaxEntries && !entries_.count(key)) {
+    expire(now);
+    if (entries_.size() >= kMaxEntries)
+      entries_.erase(entries_.begin());
+  }
+  entries_[key] = Entry{dst, allowed, now + kTtl};
+}
+
+void ConnectCache::expire(TimePoint now) {
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->second.expiry <= now)
+      it = entries_.erase(it);
+    else
+      ++it;
+  }
+}
@@ -0,0 +1,114 @@
+//===- frontend.h - HTTP CONNECT and SOCKS5 front-ends ----------*- C++ -*-===//
+//
+/// \file
+/// Request parsing, replies and destination policy for tuples whose client
+/// names the destination.
+//
+// Author:  zxh
+// Date:    2026/10/17 15:20:07
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "cidr.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <asio/generic/stream_protocol.hpp>
+#include <asio/ip/tcp.hpp>
+
+enum FrontendProtocol : int {
+  kFrontendNone = 0,
+  kFrontendConnect = 1, // HTTP CONNECT
+  kFrontendSocks5 = 2,  // SOCKS5 CONNECT without authentication
+};
+
+const char *to_string(FrontendProtocol proto);
+
+// Requests beyond this are refused.
+const size_t kFrontendMaxRequestSize = 1024 * 4;
+
+/// Destination named by a client.
+struct ConnectTarget {
+  std::string host; // domain name or address literal
+  uint16_t port = 0;
+};
+
+/// Parse "CONNECT host:port HTTP/1.x" and its header at the start of
+/// \p data. Return the request length, or 0 with \p ec set.
+/// FrontendErrIncomplete means more bytes are needed.
+size_t parse_http_connect(const char *data, size_t n, ConnectTarget &target,
+                          std::error_code &ec);
+
+/// Parse the SOCKS5 method selection, which must offer "no
+/// authentication". Return its length, or 0 with \p ec set.
+size_t parse_socks5_greeting(const char *data, size_t n, std::error_code &ec);
+
+/// Parse the SOCKS5 request following the greeting. Return its length, or 0
+/// with \p ec set.
+size_t parse_socks5_request(const char *data, size_t n, ConnectTarget &target,
+                            std::error_code &ec);
+
+// SOCKS5 method selection reply.
+const char kSocks5NoAuth[2] = {0x05, 0x00};
+
+/// Reply telling the client how its request went, \p ec is empty on success
+/// and \p bound is then the upstream local address.
+std::string frontend_reply(FrontendProtocol proto, bool greeted,
+                           const std::error_code &ec,
+                           const asio::ip::tcp::endpoint &bound);
+
+/// Destinations a front-end may dial, as cidr[:port[-port]] rules, IPv6
+/// prefixes in brackets when a port follows. The list must name every
+/// allowed destination, an empty one denies all.
+class ConnectAllowlist {
+public:
+  bool add(const std::string &rule);
+
+  bool allowed(const asio::ip::tcp::endpoint &dst) const noexcept;
+
+  const std::vector<std::string> &rules() const { return rules_; }
+
+private:
+  struct PortRange {
+    uint16_t lo;
+    uint16_t hi;
+  };
+
+  CidrTrie trie_; // value indexes ports_
+  std::vector<std::vector<PortRange>> ports_;
+  std::vector<CidrPrefix> prefixes_; // prefix of every ports_ entry
+  std::vector<std::string> rules_;
+};
+
+/// Resolved and checked destinations of one RelayIOContext, so repeated
+/// requests skip DNS and the allowlist.
+class ConnectCache {
+public:
+  using Endpoint = asio::generic::stream_protocol::endpoint;
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  static const size_t kMaxEntries = 4096;
+  static const std::chrono::seconds kTtl;
+
+  struct Entry {
+    Endpoint dst;
+    bool allowed;
+    TimePoint expiry;
+  };
+
+  const Entry *find(const std::string &key, TimePoint now) const;
+
+  void insert(const std::string &key, const Endpoint &dst, bool allowed,
+              TimePoint now);
+
+  void expire(TimePoint now);
+
+private:
+  std::unordered_map<std::string, Entry> entries_;
+};
@@ -0,0 +1,105 @@
+//===- http_host.cpp - HTTP Host header scanner -----------------*- C++ -*-===//
+//
+/// \file
+/// Find the Host of an HTTP/1.x request without parsing the whole header.
+//
+// Author:  zxh
+// Date:    2026/10/17 11:12:30
+//===----------------------------------------------------------------------===//
+
+#include "http_host.h"
+#include "errors.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+static bool fail(std::error_code &ec, HttpErrors err) {
+  ec = std::error_code(err, http_category());
+  return false;
+}
+
+// Line ends are found 16 bytes per compare, header lines are short so most
+// of the work is this scan.
+static const char *find_lf(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i lf = _mm_set1_epi8('\n');
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  return static_cast<const char *>(std::memchr(p, '\n', end - p));
+}
+
+// Case insensitive "host:", or-ing 0x20 lowers letters and keeps ':'.
+static bool is_host_line(const char *p, const char *end) {
+  static const char kName[] = "host:";
+  if (end - p < 5)
+    return false;
+  for (int i = 0; i < 5; i++)
+    if ((p[i] | 0x20) != kName[i])
+      return false;
+  return true;
+}
+
+static std::string_view trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+    s.remove_prefix(1);
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t' ||
+                        s.back() == '\r'))
+    s.remove_suffix(1);
+  return s;
+}
+
+bool parse_http_host(const char *data, size_t n, std::string_view &host,
+                     std::error_code &ec) noexcept {
+  ec = std::error_code();
+  bool truncated = n >= kHttpMaxHeaderSize;
+  n = std::min(n, kHttpMaxHeaderSize);
+
+  // Request line starts with an upper case method and a space, anything
+  // else is rejected before waiting for a line end.
+  size_t i = 0;
+  while (i < n && i < 16 && data[i] >= 'A' && data[i] <= 'Z')
+    i++;
+  if (i == n && i < 16)
+    return fail(ec, HttpErrIncomplete);
+  if (i == 0 || i == n || data[i] != ' ')
+    return fail(ec, HttpErrNotRequest);
+
+  const char *end = data + n;
+  const char *line = find_lf(data, end);
+  while (line) {
+    line++; // start of a header line
+    const char *lf = find_lf(line, end);
+    if (!lf)
+      break;
+    if (lf == line || (lf == line + 1 && line[0] == '\r'))
+      return fail(ec, HttpErrNoHost); // end of header
+
+    if (is_host_line(line, lf)) {
+      std::string_view v = trim(std::string_view(line + 5, lf - line - 5));
+      if (!v.empty() && v.front() == '[') { // [v6]:port
+        size_t close = v.find(']');
+        if (close == std::string_view::npos)
+          return fail(ec, HttpErrMalformed);
+        v = v.substr(1, close - 1);
+      } else {
+        v = v.substr(0, v.find(':'));
+      }
+      if (v.empty())
+        return fail(ec, HttpErrMalformed);
+      host = v;
+      return true;
+    }
+    line = lf;
+  }
+  return fail(ec, truncated ? HttpErrHeaderTooLong : HttpErrIncomplete);
+}
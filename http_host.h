@@ -0,0 +1,24 @@
+//===- http_host.h - HTTP Host header scanner -------------------*- C++ -*-===//
+//
+/// \file
+/// Find the Host of an HTTP/1.x request without parsing the whole header.
+//
+// Author:  zxh
+// Date:    2026/10/17 11:05:52
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <system_error>
+
+// Requests whose Host isn't within this many bytes go to the default dst.
+const size_t kHttpMaxHeaderSize = 1024 * 8;
+
+/// Scan the request header at the start of \p data for its Host and point
+/// \p host into it, without the port. Return true on success, otherwise set
+/// \p ec, HttpErrIncomplete means more bytes are needed. Nothing is copied
+/// or allocated.
+bool parse_http_host(const char *data, size_t n, std::string_view &host,
+                     std::error_code &ec) noexcept;
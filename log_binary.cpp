@@ -0,0 +1,129 @@
+//===- log_binary.cpp - Binary log records ----------------------*- C++ -*-===//
+//
+/// \file
+/// Compact log records for the file writer, decoded by mux-logcat.
+//
+// Author:  zxh
+// Date:    2026/10/17 22:19:47
+//===----------------------------------------------------------------------===//
+
+#include "log_binary.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace logrus {
+
+// A sync goes out with the first batch after this long.
+static const uint64_t kSyncIntervalNs = 1000000000;
+
+bool get_varint(const char *&p, const char *end, uint64_t &v) {
+  v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p++;
+    v |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static uint64_t unix_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+uint64_t read_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+uint64_t thread_tid() {
+  static thread_local uint64_t tid = ::syscall(SYS_gettid);
+  return tid;
+}
+
+BinaryLog::BinaryLog() : pid_(::getpid()) {
+  tsc0_ = read_tsc();
+  ns0_ = unix_ns();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  uint64_t tsc = read_tsc(), ns = unix_ns();
+  hz_ = ns > ns0_ ? uint64_t((tsc - tsc0_) * 1e9 / (ns - ns0_)) : 1000000000;
+  if (hz_ == 0)
+    hz_ = 1000000000;
+}
+
+uint32_t BinaryLog::intern(std::string_view s) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = ids_.find(std::string(s));
+  if (it != ids_.end())
+    return it->second;
+  uint32_t id = strings_.size();
+  strings_.emplace_back(s);
+  ids_.emplace(strings_.back(), id);
+  return id;
+}
+
+uint32_t BinaryLog::intern_literal(std::string_view s) {
+  // Tagged with the log, a new one must not reuse ids of another.
+  static thread_local const BinaryLog *owner = nullptr;
+  static thread_local std::unordered_map<const char *, uint32_t> cache;
+  if (owner != this) {
+    cache.clear();
+    owner = this;
+  }
+  auto it = cache.find(s.data());
+  if (it != cache.end())
+    return it->second;
+  uint32_t id = intern(s);
+  cache.emplace(s.data(), id);
+  return id;
+}
+
+void BinaryLog::frame(std::string &out, size_t stream, bool new_file) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stream &st = streams_[stream];
+  out.push_back(kRecordProcess);
+  put_varint(out, pid_);
+  if (new_file) {
+    out.push_back(kRecordHeader);
+    out.append(kBinaryMagic, sizeof(kBinaryMagic) - 1);
+    out.push_back(char(kBinaryVersion));
+    st = Stream();
+  }
+
+  for (; st.defined < strings_.size(); st.defined++) {
+    out.push_back(kRecordDefine);
+    put_varint(out, st.defined);
+    put_varint(out, strings_[st.defined].size());
+    out.append(strings_[st.defined]);
+  }
+
+  // The rate is measured since start, so it gets more precise with time.
+  uint64_t ns = unix_ns();
+  if (ns - st.last_sync_ns < kSyncIntervalNs)
+    return;
+  uint64_t tsc = read_tsc();
+  if (ns > ns0_ + kSyncIntervalNs)
+    hz_ = uint64_t((tsc - tsc0_) * 1e9 / (ns - ns0_));
+  st.last_sync_ns = ns;
+  out.push_back(kRecordSync);
+  put_varint(out, tsc);
+  put_varint(out, ns);
+  put_varint(out, hz_);
+}
+
+} // namespace logrus
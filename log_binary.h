@@ -0,0 +1,129 @@
+//===- log_binary.h - Binary log records ------------------------*- C++ -*-===//
+//
+/// \file
+/// Compact log records for the file writer, decoded by mux-logcat.
+///
+/// A file is a stream of records, each starting with its type byte.
+/// Integers are LEB128 varints, signed ones zigzag encoded first.
+///
+///   'P' pid                          the following records, up to the
+///                                    next 'P', come from process pid
+///   'H' "MUXLOG" version             starts a file or a process's output,
+///                                    forget all strings of the process
+///   'D' id len bytes                 define string id
+///   'S' tsc unix_ns hz               clock sync, ns = unix_ns + (t - tsc)
+///                                    * 1e9 / hz for later records
+///   'L' tsc level tid msg n fields   a line, msg and keys are string ids
+///   'T' tsc level tid len bytes      a preformatted line
+///
+/// A field is a key id, a ValueTag and the value. Every string a record
+/// refers to is defined before the record in the same file, by the same
+/// process. Strings and clock syncs are kept per process: while an upgraded
+/// mux drains, it and its successor append batches to the same files, each
+/// batch starting with 'P'. Version 1 files have no 'P', all records are
+/// of one process.
+//
+// Author:  zxh
+// Date:    2026/10/17 22:06:31
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace logrus {
+
+const char kBinaryMagic[] = "MUXLOG";
+const uint8_t kBinaryVersion = 2;
+
+enum RecordType : char {
+  kRecordProcess = 'P',
+  kRecordHeader = 'H',
+  kRecordDefine = 'D',
+  kRecordSync = 'S',
+  kRecordLine = 'L',
+  kRecordText = 'T',
+};
+
+enum ValueTag : uint8_t {
+  kTagInt,
+  kTagUint,
+  kTagDouble, // 8 bytes, little endian IEEE 754
+  kTagString,
+  kTagFalse,
+  kTagTrue,
+  kTagChar,
+  kTagPointer,
+};
+
+inline void put_varint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(char(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(char(v));
+}
+
+inline uint64_t zigzag(int64_t v) {
+  return (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v) {
+  return int64_t(v >> 1) ^ -int64_t(v & 1);
+}
+
+/// Read a varint at \p p, false if it runs past \p end.
+bool get_varint(const char *&p, const char *end, uint64_t &v);
+
+/// Timestamp counter, the TSC on x86 and steady clock nanoseconds elsewhere.
+uint64_t read_tsc();
+
+/// Calling thread's kernel id, as spdlog's %t prints.
+uint64_t thread_tid();
+
+/// Strings of a binary log and the clock to convert timestamps. Producers
+/// intern msg and key literals, the writer puts the definitions and clock
+/// syncs ahead of each batch.
+class BinaryLog {
+public:
+  /// Calibrates the timestamp counter, takes about 10ms.
+  BinaryLog();
+  BinaryLog(const BinaryLog &) = delete;
+  BinaryLog &operator=(const BinaryLog &) = delete;
+
+  /// Id of a literal, looked up by address in a per thread cache first.
+  uint32_t intern_literal(std::string_view s);
+
+  /// Writer side, called before each batch after the rings were read, so
+  /// every id in the batch is defined. A new file gets all of them again.
+  /// The frame starts with the process, so batches of several processes
+  /// in one file decode apart.
+  /// Each \p stream, the shared file or a per-thread segment, keeps its
+  /// own definitions and syncs.
+  void frame(std::string &out, size_t stream, bool new_file);
+
+private:
+  uint32_t intern(std::string_view s);
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, uint32_t> ids_;
+  std::vector<std::string> strings_;
+
+  struct Stream {
+    size_t defined = 0;
+    uint64_t last_sync_ns = 0;
+  };
+
+  // Under mutex_ too.
+  std::unordered_map<size_t, Stream> streams_;
+  uint64_t pid_;
+  uint64_t tsc0_, ns0_;
+  uint64_t hz_;
+};
+
+} // namespace logrus
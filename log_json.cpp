@@ -0,0 +1,196 @@
+//===- log_json.cpp - JSON log values ---------------------------*- C++ -*-===//
+//
+/// \file
+/// JSON strings and numbers for logrus lines. The scan for bytes a string
+/// must escape checks 32 or 16 bytes at a time with AVX2 or SSE2, plain
+/// text is then copied in one piece.
+//
+// Author:  zxh
+// Date:    2026/10/17 23:05:12
+//===----------------------------------------------------------------------===//
+
+#include "logrus.h"
+
+#include <charconv>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace logrus {
+
+using ScanFn = size_t (*)(const char *p, size_t n);
+
+static bool needs_escape(unsigned char c) {
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+static size_t scan_scalar(const char *p, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    if (needs_escape(p[i]))
+      return i;
+  return n;
+}
+
+#if defined(__SSE2__)
+// A byte is a control character if max(x, 0x1f) is still 0x1f, the
+// unsigned compare SSE2 lacks.
+static size_t scan_sse2(const char *p, size_t n) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i ctl = _mm_set1_epi8(0x1f);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)),
+        _mm_cmpeq_epi8(_mm_max_epu8(x, ctl), ctl));
+    if (int mask = _mm_movemask_epi8(m))
+      return i + __builtin_ctz(mask);
+  }
+  return i + scan_scalar(p + i, n - i);
+}
+
+// The 16 byte tail is scanned here too, calling the legacy encoded SSE2
+// loop with the upper ymm halves in use costs a state transition per call.
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *p,
+                                                       size_t n) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i ctl = _mm256_set1_epi8(0x1f);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, quote),
+                        _mm256_cmpeq_epi8(x, backslash)),
+        _mm256_cmpeq_epi8(_mm256_max_epu8(x, ctl), ctl));
+    if (unsigned mask = _mm256_movemask_epi8(m))
+      return i + __builtin_ctz(mask);
+  }
+  if (i + 16 <= n) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm256_castsi256_si128(quote)),
+                     _mm_cmpeq_epi8(x, _mm256_castsi256_si128(backslash))),
+        _mm_cmpeq_epi8(_mm_max_epu8(x, _mm256_castsi256_si128(ctl)),
+                       _mm256_castsi256_si128(ctl)));
+    if (int mask = _mm_movemask_epi8(m))
+      return i + __builtin_ctz(mask);
+    i += 16;
+  }
+  for (; i < n; i++)
+    if (needs_escape(p[i]))
+      return i;
+  return n;
+}
+#endif
+
+// Strings shorter than an AVX2 vector, most keys and addresses, stay with
+// SSE2.
+static const size_t kWideScan = 32;
+
+static ScanFn pick_wide_scan() {
+#if defined(__SSE2__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return scan_avx2;
+  return scan_sse2;
+#else
+  return scan_scalar;
+#endif
+}
+
+static size_t scan(const char *p, size_t n) {
+  static const ScanFn wide = pick_wide_scan();
+  if (n >= kWideScan)
+    return wide(p, n);
+#if defined(__SSE2__)
+  return scan_sse2(p, n);
+#else
+  return scan_scalar(p, n);
+#endif
+}
+
+static void append_escape(std::string &out, unsigned char c) {
+  static const char hex[] = "0123456789abcdef";
+  switch (c) {
+  case '"':
+    out.append("\\\"");
+    break;
+  case '\\':
+    out.append("\\\\");
+    break;
+  case '\n':
+    out.append("\\n");
+    break;
+  case '\r':
+    out.append("\\r");
+    break;
+  case '\t':
+    out.append("\\t");
+    break;
+  case '\b':
+    out.append("\\b");
+    break;
+  case '\f':
+    out.append("\\f");
+    break;
+  default:
+    out.append("\\u00");
+    out.push_back(hex[c >> 4]);
+    out.push_back(hex[c & 0xf]);
+  }
+}
+
+void append_json_string(std::string &out, std::string_view s) {
+  const char *p = s.data();
+  size_t n = s.size();
+  out.push_back('"');
+  for (;;) {
+    size_t i = scan(p, n);
+    out.append(p, i);
+    if (i == n)
+      break;
+    append_escape(out, p[i]);
+    p += i + 1;
+    n -= i + 1;
+  }
+  out.push_back('"');
+}
+
+void json_scalar(std::string &out, bool v) { append_scalar(out, v); }
+
+void json_scalar(std::string &out, char v) {
+  append_json_string(out, std::string_view(&v, 1));
+}
+
+void json_scalar(std::string &out, long long v) { append_scalar(out, v); }
+
+void json_scalar(std::string &out, unsigned long long v) {
+  append_scalar(out, v);
+}
+
+// JSON has no NaN or infinity, they go as strings.
+void json_scalar(std::string &out, double v) {
+  if (std::isfinite(v)) {
+    append_scalar(out, v);
+    return;
+  }
+  out.push_back('"');
+  append_scalar(out, v);
+  out.push_back('"');
+}
+
+void json_scalar(std::string &out, std::string_view v) {
+  append_json_string(out, v);
+}
+
+void json_scalar(std::string &out, const void *v) {
+  out.push_back('"');
+  append_scalar(out, v);
+  out.push_back('"');
+}
+
+} // namespace logrus
@@ -0,0 +1,465 @@
+//===- log_writer.cpp - Asynchronous log file writer ------------*- C++ -*-===//
+//
+/// \file
+/// Per-thread rings drained by one thread into a rotating log file, or
+/// per-thread segment files rotated together.
+//
+// Author:  zxh
+// Date:    2026/10/17 21:14:52
+//===----------------------------------------------------------------------===//
+
+#include "log_writer.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+
+namespace logrus {
+
+// Idle writer wakes this often even if nobody woke it.
+static const std::chrono::milliseconds kIdleWait(100);
+
+// A thread writes its segment buffer once it would pass this.
+static const size_t kSegmentBuffer = 64 * 1024;
+
+// Batches are cut at this many iovecs.
+static const size_t kMaxIov = std::min<size_t>(IOV_MAX, 1024);
+
+bool LogRing::push(const char *data, size_t n) noexcept {
+  size_t head = head_.load(std::memory_order_relaxed);
+  size_t tail = tail_.load(std::memory_order_acquire);
+  if (kSize - (head - tail) < n)
+    return false;
+
+  size_t off = head % kSize;
+  size_t first = std::min(n, kSize - off);
+  std::memcpy(buf_.get() + off, data, first);
+  std::memcpy(buf_.get(), data + first, n - first);
+  head_.store(head + n, std::memory_order_release);
+  return true;
+}
+
+size_t LogRing::peek(iovec iov[2]) const noexcept {
+  size_t head = head_.load(std::memory_order_acquire);
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  size_t n = head - tail;
+  size_t off = tail % kSize;
+  size_t first = std::min(n, kSize - off);
+  iov[0] = {buf_.get() + off, first};
+  iov[1] = {buf_.get(), n - first};
+  return n;
+}
+
+void LogRing::consume(size_t n) noexcept {
+  tail_.store(tail_.load(std::memory_order_relaxed) + n,
+              std::memory_order_release);
+}
+
+// The ring of this thread, closed when the thread exits. Writers are told
+// apart by id, a new one at the address of a destroyed one gets new rings.
+namespace {
+struct RingHandle {
+  uint64_t writer = 0;
+  std::shared_ptr<LogRing> ring;
+  uint64_t segment_writer = 0;
+  std::shared_ptr<LogSegment> segment;
+
+  ~RingHandle() {
+    if (ring)
+      ring->close();
+    if (segment)
+      segment->closed_.store(true, std::memory_order_release);
+  }
+};
+} // namespace
+
+static thread_local RingHandle tl_ring;
+static std::atomic<uint64_t> writer_ids{0};
+
+LogWriter::LogWriter(const std::string &fname, size_t max_file_size,
+                     size_t max_files)
+    : id_(++writer_ids), fname_(fname), max_file_size_(max_file_size),
+      max_files_(max_files) {
+  fd_ = ::open(fname_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+               0644);
+  if (fd_ < 0)
+    throw std::system_error(errno, std::system_category(), fname_);
+  // Only regular files rotate, renaming /dev/null or a fifo would be bad.
+  struct stat st;
+  if (::fstat(fd_, &st) == 0 && S_ISREG(st.st_mode))
+    file_size_ = st.st_size;
+  else
+    rotating_ = false;
+  thread_ = std::thread([this]() { run(); });
+}
+
+LogWriter::~LogWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  thread_.join();
+  if (fd_ >= 0)
+    ::close(fd_);
+  for (auto &seg : segments_) {
+    std::lock_guard<std::mutex> lock(seg->mutex_);
+    if (seg->fd_ >= 0)
+      ::close(seg->fd_);
+    seg->fd_ = -1;
+  }
+}
+
+void LogWriter::set_framing(Framing framing) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  framing_ = std::move(framing);
+  for (auto &seg : segments_) {
+    std::lock_guard<std::mutex> seg_lock(seg->mutex_);
+    seg->framing_ = framing_;
+  }
+}
+
+LogRing &LogWriter::ring() {
+  if (tl_ring.writer != id_) {
+    if (tl_ring.ring)
+      tl_ring.ring->close();
+    tl_ring.ring = std::make_shared<LogRing>();
+    tl_ring.writer = id_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    added_.push_back(tl_ring.ring);
+  }
+  return *tl_ring.ring;
+}
+
+LogSegment &LogWriter::segment() {
+  if (tl_ring.segment_writer != id_) {
+    if (tl_ring.segment)
+      tl_ring.segment->closed_.store(true, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(mutex_);
+    tl_ring.segment = std::make_shared<LogSegment>(segments_.size());
+    tl_ring.segment->framing_ = framing_;
+    tl_ring.segment_writer = id_;
+    segments_.push_back(tl_ring.segment);
+  }
+  return *tl_ring.segment;
+}
+
+void LogWriter::wake() noexcept {
+  // Orders the line pushed before against the look at sleeping_.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.load(std::memory_order_seq_cst) &&
+      sleeping_.exchange(false, std::memory_order_seq_cst)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cond_.notify_one();
+  }
+}
+
+bool LogWriter::write(const char *data, size_t n) {
+  if (sink_.load(std::memory_order_relaxed) == kSinkPerThread) {
+    LogSegment &seg = segment();
+    std::lock_guard<std::mutex> lock(seg.mutex_);
+    if (seg.buf_.size() + n > kSegmentBuffer)
+      flush_segment(seg);
+    seg.buf_.append(data, n);
+    return true;
+  }
+
+  LogRing &r = ring();
+  while (!r.push(data, n)) {
+    if (overflow_.load(std::memory_order_relaxed) == kOverflowDrop ||
+        n > LogRing::kSize) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    wake();
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  wake();
+  return true;
+}
+
+uint64_t LogWriter::take_unreported() noexcept {
+  uint64_t reported = reported_.load(std::memory_order_relaxed);
+  uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+  if (dropped == reported)
+    return 0;
+
+  // Once a second at most, an overloaded queue has no room for more.
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+  int64_t last = reported_ns_.load(std::memory_order_relaxed);
+  if (now - last < 1000000000 ||
+      !reported_ns_.compare_exchange_strong(last, now,
+                                            std::memory_order_relaxed))
+    return 0;
+  reported_.store(dropped, std::memory_order_relaxed);
+  return dropped - reported;
+}
+
+void LogWriter::drain() {
+  if (tl_ring.segment_writer == id_) {
+    std::lock_guard<std::mutex> lock(tl_ring.segment->mutex_);
+    flush_segment(*tl_ring.segment);
+  }
+  if (tl_ring.writer != id_)
+    return;
+  while (!tl_ring.ring->empty()) {
+    wake();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void LogWriter::run() {
+  std::vector<std::shared_ptr<LogRing>> rings;
+  std::vector<std::shared_ptr<LogSegment>> segments;
+  auto flushed = std::chrono::steady_clock::now();
+  Framing framing;
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      rings.insert(rings.end(), added_.begin(), added_.end());
+      added_.clear();
+      segments = segments_;
+      framing = framing_;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now - flushed >= kIdleWait) {
+      flush_segments(segments);
+      flushed = now;
+    }
+    rings.erase(std::remove_if(rings.begin(), rings.end(),
+                               [](const std::shared_ptr<LogRing> &r) {
+                                 return r->closed() && r->empty();
+                               }),
+                rings.end());
+
+    if (write_batch(rings, framing) > 0)
+      continue;
+
+    // Announce sleep before the last look, a producer either sees it and
+    // wakes us or pushed early enough for that look to find its line.
+    std::unique_lock<std::mutex> lock(mutex_);
+    sleeping_.store(true, std::memory_order_seq_cst);
+    bool idle = added_.empty() &&
+                std::all_of(rings.begin(), rings.end(),
+                            [](const std::shared_ptr<LogRing> &r) {
+                              return r->empty();
+                            });
+    if (idle && stop_) {
+      lock.unlock();
+      flush_segments(segments);
+      break;
+    }
+    if (idle)
+      cond_.wait_for(lock, kIdleWait);
+    sleeping_.store(false, std::memory_order_seq_cst);
+  }
+}
+
+size_t LogWriter::write_batch(std::vector<std::shared_ptr<LogRing>> &rings,
+                              const Framing &framing) {
+  std::vector<iovec> iov(1); // the frame
+  std::vector<std::pair<LogRing *, size_t>> taken;
+  size_t total = 0;
+  for (auto &r : rings) {
+    if (iov.size() + 2 > kMaxIov)
+      break;
+    iovec part[2];
+    size_t n = r->peek(part);
+    if (n == 0)
+      continue;
+    for (const auto &p : part)
+      if (p.iov_len > 0)
+        iov.push_back(p);
+    taken.emplace_back(r.get(), n);
+    total += n;
+  }
+  if (total == 0)
+    return 0;
+
+  // Rings that come first would always win a short batch, rotate them.
+  std::rotate(rings.begin(), rings.begin() + 1, rings.end());
+
+  if (rotating_ && file_size_ > 0 && file_size_ + total > max_file_size_)
+    rotate();
+  if (fd_ < 0)
+    fd_ = ::open(fname_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                 0644);
+
+  frame_.clear();
+  if (framing)
+    framing(frame_, 0, new_file_);
+  new_file_ = false;
+  iov[0] = {&frame_[0], frame_.size()};
+
+  // A failed write loses the batch rather than retry it forever.
+  iovec *cur = iov.data();
+  int left = iov.size();
+  while (left > 0) {
+    ssize_t n = ::writev(fd_, cur, left);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    file_size_ += n;
+    while (left > 0 && size_t(n) >= cur->iov_len) {
+      n -= cur->iov_len;
+      cur++;
+      left--;
+    }
+    if (left > 0) {
+      cur->iov_base = static_cast<char *>(cur->iov_base) + n;
+      cur->iov_len -= n;
+    }
+  }
+
+  for (auto &t : taken)
+    t.first->consume(t.second);
+  return total;
+}
+
+// mux.log and "1" make mux.1.log, names without an extension get the tag
+// appended.
+static std::string insert_tag(const std::string &fname,
+                              const std::string &tag) {
+  size_t ext = fname.rfind('.');
+  size_t dir = fname.rfind('/');
+  if (ext == std::string::npos || ext == 0 || ext == fname.size() - 1 ||
+      (dir != std::string::npos && dir >= ext - 1))
+    return fname + "." + tag;
+  return fname.substr(0, ext) + "." + tag + fname.substr(ext);
+}
+
+// Same names as spdlog::sinks::rotating_file_sink, mux.log becomes
+// mux.1.log, mux.2.log up to max_files.
+std::string LogWriter::calc_filename(size_t index) const {
+  return index == 0 ? fname_ : insert_tag(fname_, std::to_string(index));
+}
+
+// mux.log has segments mux.t0.log, mux.t1.log, rotated to mux.t0.1.log.
+std::string LogWriter::segment_filename(size_t segment, size_t index) const {
+  std::string base = insert_tag(fname_, "t" + std::to_string(segment));
+  return index == 0 ? base : insert_tag(base, std::to_string(index));
+}
+
+void LogWriter::rotate() {
+  ::close(fd_);
+  for (size_t i = max_files_; i > 0; i--) {
+    std::string src = calc_filename(i - 1);
+    if (::access(src.c_str(), F_OK) == 0)
+      ::rename(src.c_str(), calc_filename(i).c_str());
+  }
+  fd_ = ::open(fname_.c_str(),
+               O_WRONLY | O_CREAT | O_APPEND | O_TRUNC | O_CLOEXEC, 0644);
+  file_size_ = 0;
+  new_file_ = true;
+}
+
+// Caller holds seg.mutex_. A segment opened before the last rotation
+// moves to a new file first.
+void LogWriter::flush_segment(LogSegment &seg) {
+  if (seg.buf_.empty())
+    return;
+  uint64_t generation = generation_.load(std::memory_order_acquire);
+  if (seg.fd_ < 0 || seg.generation_ != generation)
+    open_segment(seg, generation);
+  if (seg.file_size_ > 0 && seg.file_size_ + seg.buf_.size() > max_file_size_) {
+    rotate_segments(generation);
+    open_segment(seg, generation_.load(std::memory_order_acquire));
+  }
+  if (seg.fd_ < 0) {
+    seg.buf_.clear();
+    return;
+  }
+
+  seg.frame_.clear();
+  if (seg.framing_)
+    seg.framing_(seg.frame_, 1 + seg.index_, seg.new_file_);
+  seg.new_file_ = false;
+
+  // A failed write loses the buffer, as a failed batch does.
+  iovec iov[2] = {{&seg.frame_[0], seg.frame_.size()},
+                  {&seg.buf_[0], seg.buf_.size()}};
+  iovec *cur = iov;
+  int left = 2;
+  while (left > 0) {
+    ssize_t n = ::writev(seg.fd_, cur, left);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    seg.file_size_ += n;
+    while (left > 0 && size_t(n) >= cur->iov_len) {
+      n -= cur->iov_len;
+      cur++;
+      left--;
+    }
+    if (left > 0) {
+      cur->iov_base = static_cast<char *>(cur->iov_base) + n;
+      cur->iov_len -= n;
+    }
+  }
+  seg.buf_.clear();
+}
+
+// The first file of a segment appends to what a previous run left, later
+// ones start empty as rotate() does.
+void LogWriter::open_segment(LogSegment &seg, uint64_t generation) {
+  int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+  if (seg.fd_ >= 0) {
+    ::close(seg.fd_);
+    flags |= O_TRUNC;
+  }
+  std::string name = segment_filename(seg.index_, 0);
+  seg.fd_ = ::open(name.c_str(), flags, 0644);
+  struct stat st;
+  seg.file_size_ = seg.fd_ >= 0 && ::fstat(seg.fd_, &st) == 0 ? st.st_size : 0;
+  seg.generation_ = generation;
+  seg.new_file_ = true;
+}
+
+// Shift every segment, written or not, so index N of all of them is the
+// same rotation. Threads still writing to a renamed file move on at their
+// next flush.
+void LogWriter::rotate_segments(uint64_t generation) {
+  std::lock_guard<std::mutex> rotate_lock(rotate_mutex_);
+  if (generation_.load(std::memory_order_relaxed) != generation)
+    return; // another segment rotated them
+  size_t count;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    count = segments_.size();
+  }
+  for (size_t s = 0; s < count; s++) {
+    for (size_t i = max_files_; i > 0; i--) {
+      std::string src = segment_filename(s, i - 1);
+      if (::access(src.c_str(), F_OK) == 0)
+        ::rename(src.c_str(), segment_filename(s, i).c_str());
+    }
+  }
+  generation_.store(generation + 1, std::memory_order_release);
+}
+
+void LogWriter::flush_segments(
+    std::vector<std::shared_ptr<LogSegment>> &segments) {
+  for (auto &seg : segments) {
+    std::lock_guard<std::mutex> lock(seg->mutex_);
+    flush_segment(*seg);
+    // Segments of exited threads stay listed, their index still rotates.
+    if (seg->closed_.load(std::memory_order_acquire) && seg->fd_ >= 0) {
+      ::close(seg->fd_);
+      seg->fd_ = -1;
+      std::string().swap(seg->buf_);
+    }
+  }
+}
+
+} // namespace logrus
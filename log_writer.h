@@ -0,0 +1,183 @@
+//===- log_writer.h - Asynchronous log file writer --------------*- C++ -*-===//
+//
+/// \file
+/// Per-thread rings drained by one thread into a rotating log file, or
+/// per-thread segment files rotated together.
+//
+// Author:  zxh
+// Date:    2026/10/17 21:02:36
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "logrus.h"
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace logrus {
+
+/// Formatted lines of one thread on their way to the writer. One producer
+/// appends whole lines, the writer takes them, so neither side locks and the
+/// writer never sees half a line.
+class LogRing {
+public:
+  static const size_t kSize = 256 * 1024;
+
+  LogRing() : buf_(new char[kSize]) {}
+  LogRing(const LogRing &) = delete;
+  LogRing &operator=(const LogRing &) = delete;
+
+  /// Producer side. False if \p n bytes don't fit.
+  bool push(const char *data, size_t n) noexcept;
+
+  /// Writer side. Point \p iov at the pending bytes, return their count.
+  size_t peek(iovec iov[2]) const noexcept;
+  void consume(size_t n) noexcept;
+
+  bool empty() const noexcept {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+  /// The producing thread exited, the ring goes once empty.
+  void close() noexcept { closed_.store(true, std::memory_order_release); }
+  bool closed() const noexcept {
+    return closed_.load(std::memory_order_acquire);
+  }
+
+private:
+  std::unique_ptr<char[]> buf_;
+  std::atomic<bool> closed_{false};
+  alignas(64) std::atomic<size_t> head_{0}; // written by the producer
+  alignas(64) std::atomic<size_t> tail_{0}; // written by the writer
+};
+
+/// A thread's own file of a kSinkPerThread writer. The thread buffers its
+/// lines here and writes them once the buffer fills, the writer thread
+/// writes what is left every tick. Both take mutex_, the writer a few times
+/// a second, so the lock stays in the owner's cache.
+struct LogSegment {
+  explicit LogSegment(size_t index) : index_(index) {}
+  LogSegment(const LogSegment &) = delete;
+  LogSegment &operator=(const LogSegment &) = delete;
+
+  const size_t index_; // mux.t<index_>.log
+  std::mutex mutex_;
+  std::string buf_;
+  std::string frame_;
+  std::function<void(std::string &, size_t, bool)> framing_;
+  int fd_ = -1;
+  size_t file_size_ = 0;
+  uint64_t generation_ = 0; // rotation the open file belongs to
+  bool new_file_ = true;
+  std::atomic<bool> closed_{false}; // the thread exited
+};
+
+/// Owns the log file and the thread writing it. Callers only copy a line
+/// into their ring, the writer gathers every ring into one writev and
+/// rotates like spdlog's rotating_file_sink, base.N.ext. A file may pass
+/// \p max_file_size by the last batch written to it.
+///
+/// With kSinkPerThread every thread appends to a LogSegment of its own
+/// instead, the writer thread only flushes idle segments. A segment that
+/// fills rotates all of them, so mux.t0.2.log and mux.t5.2.log cover the
+/// same stretch of time.
+class LogWriter {
+public:
+  /// Bytes to put ahead of a batch, \p new_file for the first batch of a
+  /// file. \p stream is 0 for the shared file, 1 + index for a segment.
+  /// Runs after the batch was taken, for segments on any thread.
+  using Framing =
+      std::function<void(std::string &out, size_t stream, bool new_file)>;
+
+  /// Open \p fname for append, throws std::system_error on failure.
+  LogWriter(const std::string &fname, size_t max_file_size,
+            size_t max_files);
+  LogWriter(const LogWriter &) = delete;
+  LogWriter &operator=(const LogWriter &) = delete;
+
+  /// Write what is queued and stop the thread.
+  ~LogWriter();
+
+  void set_framing(Framing framing);
+
+  void set_overflow(Overflow overflow) {
+    overflow_.store(overflow, std::memory_order_relaxed);
+  }
+
+  /// Ignored for files that don't rotate, segments of /dev/null make no
+  /// sense.
+  void set_sink(Sink sink) {
+    if (rotating_)
+      sink_.store(sink, std::memory_order_relaxed);
+  }
+
+  /// Queue a formatted line from the calling thread, false if dropped.
+  bool write(const char *data, size_t n);
+
+  /// Lines dropped since the writer started.
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  /// Lines dropped since the last report, for the caller to log, 0 if
+  /// nothing dropped or the last report is under a second old.
+  uint64_t take_unreported() noexcept;
+
+  /// Return once the calling thread's lines are in the file.
+  void drain();
+
+private:
+  LogRing &ring();
+  LogSegment &segment();
+  void flush_segment(LogSegment &seg);
+  void open_segment(LogSegment &seg, uint64_t generation);
+  void rotate_segments(uint64_t generation);
+  void flush_segments(std::vector<std::shared_ptr<LogSegment>> &segments);
+  void wake() noexcept;
+  void run();
+  size_t write_batch(std::vector<std::shared_ptr<LogRing>> &rings,
+                     const Framing &framing);
+  void rotate();
+  std::string calc_filename(size_t index) const;
+  std::string segment_filename(size_t segment, size_t index) const;
+
+  const uint64_t id_;
+  const std::string fname_;
+  const size_t max_file_size_;
+  const size_t max_files_;
+  int fd_;
+  size_t file_size_ = 0;
+  bool rotating_ = true;
+  bool new_file_ = true;
+  std::string frame_;
+
+  std::atomic<Overflow> overflow_{kOverflowDrop};
+  std::atomic<Sink> sink_{kSinkShared};
+  std::atomic<uint64_t> generation_{0}; // segment rotations so far
+  std::mutex rotate_mutex_;
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> reported_{0};
+  std::atomic<int64_t> reported_ns_{0};
+
+  // Producers take the mutex only to register a ring, or to wake the writer
+  // after it went to sleep.
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<std::shared_ptr<LogRing>> added_;
+  std::vector<std::shared_ptr<LogSegment>> segments_;
+  Framing framing_;
+  std::atomic<bool> sleeping_{false};
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+} // namespace logrus
@@ -0,0 +1,509 @@
+//===- logcat.cpp - Binary log decoder --------------------------*- C++ -*-===//
+//
+/// \file
+/// mux-logcat, print binary logs of mux -F binary as text or JSON lines, or
+/// merge the per-thread segments of mux -K thread by time.
+//
+// Author:  zxh
+// Date:    2026/10/17 22:41:18
+//===----------------------------------------------------------------------===//
+
+#include "log_binary.h"
+#include "logrus.h"
+
+#include <getopt.h>
+#include <stdio.h>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace logrus;
+
+static struct option opts[] = {
+    {"json", no_argument, NULL, 'j'},
+    {"merge", no_argument, NULL, 'm'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0},
+};
+
+static void usage(char *argv0) {
+  fprintf(stderr, "Usage: %s [-j] [-m] [file...]\n", argv0);
+  fprintf(stderr, "  -j,  --json   JSON lines instead of mux text lines\n");
+  fprintf(stderr, "  -m,  --merge  Merge files by time, e.g. the segments\n");
+  fprintf(stderr, "                mux.t*.log of one rotation, text and\n");
+  fprintf(stderr, "                JSON ones pass as they are\n");
+  fprintf(stderr, "  -h,  --help   Help\n");
+  fprintf(stderr, "Reads stdin without files. Text lines follow the default "
+                  "mux pattern.\n");
+}
+
+/// Decoder state of one stream, reset by every header record.
+class Decoder {
+public:
+  /// Gets each line with its time in unix nanoseconds, without newline.
+  using Emit = std::function<void(int64_t ns, const std::string &line)>;
+
+  Decoder(bool json, Emit emit) : json_(json), emit_(std::move(emit)) {}
+
+  /// Decode whole records from \p p, return where the first incomplete one
+  /// starts. Sets \p error on malformed input.
+  const char *decode(const char *p, const char *end, std::string &error);
+
+private:
+  bool line(const char *&p, const char *end, bool text, std::string &error);
+  bool value(const char *&p, const char *end, std::string &out);
+  void begin(uint64_t tsc, uint8_t level, uint64_t tid);
+
+  bool json_;
+  Emit emit_;
+  int64_t ns_ = 0;
+  // Strings and clock of one writing process, processes appending to the
+  // same file interleave their batches.
+  struct Process {
+    std::vector<std::string> strings;
+    uint64_t sync_tsc = 0, sync_ns = 0, hz = 1000000000;
+  };
+
+  std::unordered_map<uint64_t, Process> processes_;
+  Process *cur_ = &processes_[0]; // version 1 files name no process
+  std::string out_;
+};
+
+void Decoder::begin(uint64_t tsc, uint8_t level, uint64_t tid) {
+  double delta =
+      double(int64_t(tsc - cur_->sync_tsc)) * 1e9 / double(cur_->hz);
+  int64_t ns = int64_t(cur_->sync_ns) + int64_t(delta);
+  ns_ = ns;
+  time_t secs = ns / 1000000000;
+  std::string_view name =
+      level <= kFatal ? to_string(Level(level)) : "unknown";
+
+  char buf[64];
+  struct tm tm;
+  out_.clear();
+  if (json_) {
+    gmtime_r(&secs, &tm);
+    size_t n = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + n, sizeof(buf) - n, ".%06dZ",
+             int(ns % 1000000000 / 1000));
+    out_.append("{\"time\":\"").append(buf).append("\",\"level\":\"");
+    out_.append(name).append("\",\"tid\":");
+    append_scalar(out_, static_cast<unsigned long long>(tid));
+  } else {
+    localtime_r(&secs, &tm);
+    strftime(buf, sizeof(buf), "%Y%m%d %H:%M:%S", &tm);
+    out_.append(name).append(" ").append(buf).append(" ");
+    append_scalar(out_, static_cast<unsigned long long>(tid));
+    out_.push_back(' ');
+  }
+}
+
+bool Decoder::value(const char *&p, const char *end, std::string &out) {
+  auto put = [this, &out](auto x) {
+    if (json_)
+      json_scalar(out, x);
+    else
+      append_scalar(out, x);
+  };
+  if (p >= end)
+    return false;
+  uint8_t tag = *p++;
+  uint64_t v;
+  switch (tag) {
+  case kTagFalse:
+  case kTagTrue:
+    put(tag == kTagTrue);
+    return true;
+  case kTagChar:
+    if (p >= end)
+      return false;
+    put(*p++);
+    return true;
+  case kTagInt:
+    if (!get_varint(p, end, v))
+      return false;
+    put(static_cast<long long>(unzigzag(v)));
+    return true;
+  case kTagUint:
+    if (!get_varint(p, end, v))
+      return false;
+    put(static_cast<unsigned long long>(v));
+    return true;
+  case kTagDouble: {
+    if (end - p < 8)
+      return false;
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; i++)
+      bits |= uint64_t(uint8_t(p[i])) << (i * 8);
+    p += 8;
+    double d;
+    std::memcpy(&d, &bits, sizeof(d));
+    put(d);
+    return true;
+  }
+  case kTagString:
+    if (!get_varint(p, end, v) || uint64_t(end - p) < v)
+      return false;
+    put(std::string_view(p, v));
+    p += v;
+    return true;
+  case kTagPointer:
+    if (!get_varint(p, end, v))
+      return false;
+    put(reinterpret_cast<const void *>(uintptr_t(v)));
+    return true;
+  }
+  p = nullptr; // malformed, not short
+  return false;
+}
+
+bool Decoder::line(const char *&p, const char *end, bool text,
+                   std::string &error) {
+  uint64_t tsc, tid, msg;
+  if (!get_varint(p, end, tsc) || p >= end)
+    return false;
+  uint8_t level = *p++;
+  if (!get_varint(p, end, tid) || !get_varint(p, end, msg))
+    return false;
+
+  if (text) {
+    if (uint64_t(end - p) < msg)
+      return false;
+    begin(tsc, level, tid);
+    if (json_) {
+      out_.append(",\"line\":");
+      append_json_string(out_, std::string_view(p, msg));
+      out_.push_back('}');
+    } else {
+      out_.append(p, msg);
+    }
+    p += msg;
+    return true;
+  }
+
+  uint64_t n;
+  if (!get_varint(p, end, n))
+    return false;
+  if (msg >= cur_->strings.size()) {
+    error = "undefined message id " + std::to_string(msg);
+    return false;
+  }
+  begin(tsc, level, tid);
+  if (json_) {
+    out_.append(",\"msg\":");
+    append_json_string(out_, cur_->strings[msg]);
+  } else {
+    out_.append(begin_line(cur_->strings[msg]));
+  }
+  for (uint64_t i = 0; i < n; i++) {
+    uint64_t key;
+    if (!get_varint(p, end, key))
+      return false;
+    if (key >= cur_->strings.size()) {
+      error = "undefined key id " + std::to_string(key);
+      return false;
+    }
+    if (json_) {
+      out_.push_back(',');
+      append_json_string(out_, cur_->strings[key]);
+      out_.push_back(':');
+    } else {
+      out_.push_back(' ');
+      out_.append(cur_->strings[key]);
+      out_.append(kFieldDelim).append(kFieldValueQuoted);
+    }
+    if (!value(p, end, out_)) {
+      if (!p)
+        error = "unknown value tag";
+      return false;
+    }
+    if (!json_)
+      out_.append(kFieldValueQuoted);
+  }
+  if (json_)
+    out_.push_back('}');
+  return true;
+}
+
+const char *Decoder::decode(const char *p, const char *end,
+                            std::string &error) {
+  while (p < end) {
+    const char *start = p;
+    char type = *p++;
+    bool ok = false;
+    uint64_t id, len, v;
+    switch (type) {
+    case kRecordHeader:
+      // Magic and version byte.
+      ok = end - p >= int(sizeof(kBinaryMagic));
+      if (!ok)
+        break;
+      if (std::memcmp(p, kBinaryMagic, sizeof(kBinaryMagic) - 1) != 0 ||
+          uint8_t(p[sizeof(kBinaryMagic) - 1]) == 0 ||
+          uint8_t(p[sizeof(kBinaryMagic) - 1]) > kBinaryVersion) {
+        error = "bad header";
+        return start;
+      }
+      p += sizeof(kBinaryMagic);
+      cur_->strings.clear();
+      break;
+    case kRecordProcess:
+      ok = get_varint(p, end, id);
+      if (ok)
+        cur_ = &processes_[id];
+      break;
+    case kRecordDefine:
+      ok = get_varint(p, end, id) && get_varint(p, end, len) &&
+           uint64_t(end - p) >= len;
+      if (ok) {
+        if (id >= cur_->strings.size())
+          cur_->strings.resize(id + 1);
+        cur_->strings[id].assign(p, len);
+        p += len;
+      }
+      break;
+    case kRecordSync:
+      ok = get_varint(p, end, cur_->sync_tsc) &&
+           get_varint(p, end, cur_->sync_ns) && get_varint(p, end, v);
+      if (ok && v > 0)
+        cur_->hz = v;
+      break;
+    case kRecordLine:
+    case kRecordText:
+      ok = line(p, end, type == kRecordText, error);
+      if (ok)
+        emit_(ns_, out_);
+      break;
+    default:
+      error = "unknown record type " + std::to_string(uint8_t(type));
+      return start;
+    }
+    if (!error.empty() || !ok)
+      return start;
+  }
+  return p;
+}
+
+static void print_line(int64_t, const std::string &line) {
+  fwrite(line.data(), 1, line.size(), stdout);
+  fputc('\n', stdout);
+}
+
+static bool decode_file(FILE *f, bool json, const char *name) {
+  Decoder decoder(json, print_line);
+  std::vector<char> buf;
+  std::vector<char> chunk(64 * 1024);
+  size_t n;
+  while ((n = fread(chunk.data(), 1, chunk.size(), f)) > 0) {
+    buf.insert(buf.end(), chunk.begin(), chunk.begin() + n);
+    std::string error;
+    const char *rest =
+        decoder.decode(buf.data(), buf.data() + buf.size(), error);
+    if (!error.empty()) {
+      fprintf(stderr, "%s: %s at offset %zu\n", name, error.c_str(),
+              size_t(rest - buf.data()));
+      return false;
+    }
+    buf.erase(buf.begin(), buf.begin() + (rest - buf.data()));
+  }
+  if (!buf.empty())
+    fprintf(stderr, "%s: %zu bytes of a truncated record\n", name,
+            buf.size());
+  return true;
+}
+
+// Time of a line mux wrote as JSON, "time" is UTC, or as text of the
+// default pattern, local time. Seconds are as precise as text gets.
+static bool line_time(const std::string &line, int64_t &ns) {
+  struct tm tm;
+  std::memset(&tm, 0, sizeof(tm));
+  int usec = 0;
+  if (line.compare(0, 9, "{\"time\":\"") == 0) {
+    if (sscanf(line.c_str() + 9, "%4d-%2d-%2dT%2d:%2d:%2d.%6d", &tm.tm_year,
+               &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+               &usec) != 7)
+      return false;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    ns = int64_t(timegm(&tm)) * 1000000000 + int64_t(usec) * 1000;
+    return true;
+  }
+  size_t sp = line.find(' ');
+  if (sp == std::string::npos ||
+      sscanf(line.c_str() + sp + 1, "%4d%2d%2d %2d:%2d:%2d", &tm.tm_year,
+             &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+             &tm.tm_sec) != 6)
+    return false;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  tm.tm_isdst = -1;
+  ns = int64_t(mktime(&tm)) * 1000000000;
+  return true;
+}
+
+/// One input of -m, read a chunk at a time into timed lines. Binary files
+/// are decoded, other files are taken as lines.
+class Source {
+public:
+  Source(FILE *f, const char *name, bool json)
+      : f_(f), name_(name),
+        decoder_(json, [this](int64_t ns, const std::string &line) {
+          lines_.emplace_back(ns, line);
+        }) {}
+
+  ~Source() {
+    if (f_ != stdin)
+      fclose(f_);
+  }
+
+  /// Read until a line is pending or the input ends, false on errors.
+  bool fill();
+
+  bool empty() const { return lines_.empty(); }
+  const std::pair<int64_t, std::string> &front() const {
+    return lines_.front();
+  }
+  void pop() { lines_.pop_front(); }
+
+private:
+  void split_lines(bool eof);
+
+  FILE *f_;
+  const char *name_;
+  bool eof_ = false;
+  int binary_ = -1; // unknown until the first byte
+  Decoder decoder_;
+  std::vector<char> buf_;
+  std::deque<std::pair<int64_t, std::string>> lines_;
+  int64_t last_ns_ = 0; // for lines without a time
+};
+
+void Source::split_lines(bool eof) {
+  size_t start = 0;
+  for (size_t i = 0; i < buf_.size(); i++) {
+    if (buf_[i] != '\n')
+      continue;
+    std::string line(buf_.data() + start, i - start);
+    line_time(line, last_ns_);
+    lines_.emplace_back(last_ns_, std::move(line));
+    start = i + 1;
+  }
+  if (eof && start < buf_.size()) {
+    std::string line(buf_.data() + start, buf_.size() - start);
+    line_time(line, last_ns_);
+    lines_.emplace_back(last_ns_, std::move(line));
+    start = buf_.size();
+  }
+  buf_.erase(buf_.begin(), buf_.begin() + start);
+}
+
+bool Source::fill() {
+  std::vector<char> chunk(64 * 1024);
+  while (lines_.empty() && !eof_) {
+    size_t n = fread(chunk.data(), 1, chunk.size(), f_);
+    if (n == 0)
+      eof_ = true;
+    buf_.insert(buf_.end(), chunk.begin(), chunk.begin() + n);
+    if (binary_ < 0 && !buf_.empty())
+      binary_ = buf_[0] == kRecordHeader || buf_[0] == kRecordProcess;
+    if (binary_ != 1) {
+      split_lines(eof_);
+      continue;
+    }
+
+    std::string error;
+    const char *rest =
+        decoder_.decode(buf_.data(), buf_.data() + buf_.size(), error);
+    if (!error.empty()) {
+      fprintf(stderr, "%s: %s\n", name_, error.c_str());
+      return false;
+    }
+    buf_.erase(buf_.begin(), buf_.begin() + (rest - buf_.data()));
+    if (eof_ && !buf_.empty())
+      fprintf(stderr, "%s: %zu bytes of a truncated record\n", name_,
+              buf_.size());
+  }
+  return true;
+}
+
+// Print the earliest pending line of all sources until all ended, ties go
+// to the source named first.
+static bool merge_files(std::vector<std::unique_ptr<Source>> &sources) {
+  bool ok = true;
+  for (;;) {
+    Source *next = nullptr;
+    for (auto &src : sources) {
+      if (src->empty() && !src->fill())
+        ok = false;
+      if (!src->empty() &&
+          (!next || src->front().first < next->front().first))
+        next = src.get();
+    }
+    if (!next)
+      return ok;
+    print_line(next->front().first, next->front().second);
+    next->pop();
+  }
+}
+
+int main(int argc, char *argv[]) {
+  bool json = false;
+  bool merge = false;
+  int c;
+  while ((c = getopt_long(argc, argv, "jmh", opts, NULL)) >= 0) {
+    switch (c) {
+    case 'j':
+      json = true;
+      break;
+    case 'm':
+      merge = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind == argc)
+    return decode_file(stdin, json, "stdin") ? 0 : 1;
+
+  int status = 0;
+  if (merge) {
+    std::vector<std::unique_ptr<Source>> sources;
+    for (int i = optind; i < argc; i++) {
+      FILE *f = fopen(argv[i], "rb");
+      if (!f) {
+        fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+        status = 1;
+        continue;
+      }
+      sources.push_back(std::make_unique<Source>(f, argv[i], json));
+    }
+    if (!merge_files(sources))
+      status = 1;
+    return status;
+  }
+
+  for (int i = optind; i < argc; i++) {
+    FILE *f = fopen(argv[i], "rb");
+    if (!f) {
+      fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+    if (!decode_file(f, json, argv[i]))
+      status = 1;
+    fclose(f);
+  }
+  return status;
+}
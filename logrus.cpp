@@ -8,6 +8,8 @@
 //===----------------------------------------------------------------------===//
 
 #include "logrus.h"
+#include "log_binary.h"
+#include "log_writer.h"
 
 #define LOGRUS_LEVEL_NAME_CRITICAL spdlog::string_view_t("fatal", 5)
 
@@ -27,49 +29,161 @@
 #include <spdlog/sinks/rotating_file_sink.h>
 #include <spdlog/spdlog.h>
 
+#include <atomic>
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <thread>
+
 namespace logrus {
 
+std::string_view to_string(Level level) {
+  auto name = spdlog::level::to_string_view(
+      static_cast<spdlog::level::level_enum>(level));
+  return std::string_view(name.data(), name.size());
+}
+
+std::string &begin_line(std::string_view msg) {
+  static thread_local std::string line;
+  line.clear();
+  line.append(kFieldMsgKey, strlen_const(kFieldMsgKey));
+  line.append(kFieldDelim, strlen_const(kFieldDelim));
+  line.append(kFieldValueQuoted, strlen_const(kFieldValueQuoted));
+  line.append(msg);
+  line.append(kFieldValueQuoted, strlen_const(kFieldValueQuoted));
+  return line;
+}
+
+void append_scalar(std::string &out, bool v) {
+  out.append(v ? "true" : "false");
+}
+
+void append_scalar(std::string &out, char v) { out.push_back(v); }
+
+void append_scalar(std::string &out, long long v) {
+  char buf[24];
+  auto r = std::to_chars(buf, buf + sizeof(buf), v);
+  out.append(buf, r.ptr);
+}
+
+void append_scalar(std::string &out, unsigned long long v) {
+  char buf[24];
+  auto r = std::to_chars(buf, buf + sizeof(buf), v);
+  out.append(buf, r.ptr);
+}
+
+// Shortest form that reads back the same, as fmt's default.
+void append_scalar(std::string &out, double v) {
+  char buf[32];
+  auto r = std::to_chars(buf, buf + sizeof(buf), v);
+  out.append(buf, r.ptr);
+}
+
+void append_scalar(std::string &out, std::string_view v) { out.append(v); }
+
+void append_scalar(std::string &out, const void *v) {
+  char buf[24];
+  auto r = std::to_chars(buf, buf + sizeof(buf),
+                         reinterpret_cast<uintptr_t>(v), 16);
+  out.append("0x");
+  out.append(buf, r.ptr);
+}
+
+void encode_scalar(std::string &out, bool v) {
+  out.push_back(v ? kTagTrue : kTagFalse);
+}
+
+void encode_scalar(std::string &out, char v) {
+  out.push_back(kTagChar);
+  out.push_back(v);
+}
+
+void encode_scalar(std::string &out, long long v) {
+  out.push_back(kTagInt);
+  put_varint(out, zigzag(v));
+}
+
+void encode_scalar(std::string &out, unsigned long long v) {
+  out.push_back(kTagUint);
+  put_varint(out, v);
+}
+
+void encode_scalar(std::string &out, double v) {
+  uint64_t bits;
+  std::memcpy(&bits, &v, sizeof(bits));
+  out.push_back(kTagDouble);
+  for (int i = 0; i < 8; i++)
+    out.push_back(char(bits >> (i * 8)));
+}
+
+void encode_scalar(std::string &out, std::string_view v) {
+  out.push_back(kTagString);
+  put_varint(out, v.size());
+  out.append(v);
+}
+
+void encode_scalar(std::string &out, const void *v) {
+  out.push_back(kTagPointer);
+  put_varint(out, reinterpret_cast<uintptr_t>(v));
+}
+
 void log_to(Logger *logger, const char *file, int line, const char *func,
             Level level, std::string_view msg,
             std::vector<std::pair<std::string, ValueType>> &&fields) {
-  fmt::basic_memory_buffer<char, 256> buf;
-
-  // Handle msg field
-  std::copy_n(kFieldMsgKey, strlen_const(kFieldMsgKey),
-              std::back_inserter(buf));
-  std::copy_n(kFieldDelim, strlen_const(kFieldDelim), std::back_inserter(buf));
-  std::copy_n(kFieldValueQuoted, strlen_const(kFieldValueQuoted),
-              std::back_inserter(buf));
-  std::copy_n(msg.data(), msg.size(), std::back_inserter(buf));
-  std::copy_n(kFieldValueQuoted, strlen_const(kFieldValueQuoted),
-              std::back_inserter(buf));
-
-  // Handle normal fields
-  for (const auto &pair : fields) {
+  std::string &buf = begin_line(msg);
+  for (const auto &pair : fields)
     std::visit(
-        [&](const auto &value) {
-          std::string s =
-              fmt::format(" {}={}{}{}", pair.first, kFieldValueQuoted, value,
-                          kFieldValueQuoted);
-          std::copy_n(s.begin(), s.size(), std::back_inserter(buf));
-        },
+        [&](const auto &value) { append_field(buf, pair.first, value); },
         pair.second);
-  }
-
-  logger->log(file, line, func, level, std::string(buf.data(), buf.size()));
+  logger->log(file, line, func, level, buf);
 }
 
 class LoggerImpl {
 public:
   LoggerImpl() : logger_(spdlog::default_logger()) {}
 
+  /// The calling thread's copy of formatter_, spdlog formatters cache time
+  /// and are not thread safe.
+  spdlog::formatter &formatter();
+
   std::shared_ptr<spdlog::logger> logger_;
+
+  // Set with set_rotating(), lines then bypass logger_. The writer frames
+  // with binary_ until it stops, so it goes first.
+  std::string name_;
+  std::unique_ptr<BinaryLog> binary_;
+  std::unique_ptr<LogWriter> writer_;
+
+  std::mutex mutex_;
+  std::unique_ptr<spdlog::formatter> formatter_;
+  std::atomic<uint64_t> formatter_id_{0};
 };
 
+static std::atomic<uint64_t> formatter_ids{0};
+
+spdlog::formatter &LoggerImpl::formatter() {
+  static thread_local uint64_t id = 0;
+  static thread_local std::unique_ptr<spdlog::formatter> local;
+  if (id != formatter_id_.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    local = formatter_->clone();
+    id = formatter_id_.load(std::memory_order_relaxed);
+  }
+  return *local;
+}
+
 Logger::Logger() : impl_(std::make_shared<LoggerImpl>()) {}
 
 void Logger::set_pattern(const std::string &pattern) {
   impl_->logger_->set_pattern(pattern);
+  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  impl_->formatter_ = std::make_unique<spdlog::pattern_formatter>(pattern);
+  impl_->formatter_id_.store(++formatter_ids, std::memory_order_release);
 }
 
 void Logger::set_level(Level level) {
@@ -82,18 +196,176 @@ Level Logger::get_level() const {
 
 void Logger::set_rotating(const std::string &lname, const std::string &fname,
                           size_t max_file_size, size_t max_files) {
-  impl_->logger_ =
-      spdlog::rotating_logger_mt(lname, fname, max_file_size, max_files);
+  impl_->writer_ =
+      std::make_unique<LogWriter>(fname, max_file_size, max_files);
+  impl_->name_ = lname;
+  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  if (!impl_->formatter_) {
+    impl_->formatter_ = std::make_unique<spdlog::pattern_formatter>();
+    impl_->formatter_id_.store(++formatter_ids, std::memory_order_release);
+  }
 }
 
-void Logger::log(const char *file, int line, const char *func, Level level,
-                 std::string_view data) {
-  impl_->logger_->log(spdlog::source_loc(file, line, func),
-                      (spdlog::level::level_enum)level, data);
+void Logger::set_overflow(Overflow overflow) {
+  if (impl_->writer_)
+    impl_->writer_->set_overflow(overflow);
+}
+
+void Logger::set_sink(Sink sink) {
+  if (impl_->writer_)
+    impl_->writer_->set_sink(sink);
+}
+
+uint64_t Logger::dropped() const {
+  return impl_->writer_ ? impl_->writer_->dropped() : 0;
+}
+
+void Logger::set_format(Format format) {
+  if (format == kFormatBinary && !impl_->binary_) {
+    if (!impl_->writer_)
+      throw std::logic_error("binary log needs a log file");
+    impl_->binary_ = std::make_unique<BinaryLog>();
+    BinaryLog *binary = impl_->binary_.get();
+    impl_->writer_->set_framing(
+        [binary](std::string &out, size_t stream, bool new_file) {
+          binary->frame(out, stream, new_file);
+        });
+  }
+  format_ = format;
+}
+
+std::string &Logger::begin_record(Level level, std::string_view msg,
+                                  size_t nfields) {
+  static thread_local std::string rec;
+  rec.clear();
+  rec.push_back(kRecordLine);
+  put_varint(rec, read_tsc());
+  rec.push_back(char(level));
+  put_varint(rec, thread_tid());
+  put_varint(rec, impl_->binary_->intern_literal(msg));
+  put_varint(rec, nfields);
+  return rec;
+}
+
+void Logger::encode_key(std::string &rec, std::string_view key) {
+  put_varint(rec, impl_->binary_->intern_literal(key));
+}
+
+// Queue \p data, report drops and stop on fatal.
+static void deliver(Logger &logger, LogWriter &writer, Level level,
+                    const char *data, size_t n) {
+  // The drop count goes out after a line made it, so there is room for it.
+  uint64_t dropped = 0;
+  if (writer.write(data, n))
+    dropped = writer.take_unreported();
+  if (dropped > 0)
+    LOG_WARN_(logger, "Log lines dropped", KV("count", dropped));
+  if (level == Level::kFatal) {
+    writer.drain();
+    std::exit(1);
+  }
+}
+
+void Logger::write_record(Level level, const std::string &rec) {
+  deliver(*this, *impl_->writer_, level, rec.data(), rec.size());
+}
+
+// The calling thread's object up to "tid". "time" is UTC with microseconds,
+// the seconds part is kept per thread.
+static std::string &json_prefix(Level level) {
+  static thread_local std::string obj;
+  static thread_local time_t second = -1;
+  static thread_local char stamp[32];
+  struct timespec ts;
+  ::clock_gettime(CLOCK_REALTIME, &ts);
+  if (ts.tv_sec != second) {
+    struct tm tm;
+    ::gmtime_r(&ts.tv_sec, &tm);
+    std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    second = ts.tv_sec;
+  }
+  char micros[8] = {'.'};
+  for (int i = 6, us = ts.tv_nsec / 1000; i > 0; i--, us /= 10)
+    micros[i] = '0' + us % 10;
+
+  obj.clear();
+  obj.append("{\"time\":\"").append(stamp).append(micros, 7);
+  obj.append("Z\",\"level\":\"").append(to_string(level));
+  obj.append("\",\"tid\":");
+  append_scalar(obj, static_cast<unsigned long long>(thread_tid()));
+  return obj;
+}
+
+std::string &Logger::begin_json(Level level, std::string_view msg) {
+  std::string &obj = json_prefix(level);
+  obj.append(",\"msg\":");
+  append_json_string(obj, msg);
+  return obj;
+}
+
+void Logger::write_json(Level level, std::string &obj) {
+  obj.append("}\n");
+  if (LogWriter *writer = impl_->writer_.get()) {
+    deliver(*this, *writer, level, obj.data(), obj.size());
+    return;
+  }
+
+  // One write per line, whole lines even with threads sharing stdout.
+  for (size_t off = 0; off < obj.size();) {
+    ssize_t n = ::write(STDOUT_FILENO, obj.data() + off, obj.size() - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    off += n;
+  }
   if (level == Level::kFatal)
     std::exit(1);
 }
 
+void Logger::log(const char *file, int line, const char *func, Level level,
+                 std::string_view data) {
+  // Lines formatted elsewhere, from the Entry API, go in as a string.
+  if (format_ == kFormatJson) {
+    std::string &obj = json_prefix(level);
+    obj.append(",\"line\":");
+    append_json_string(obj, data);
+    write_json(level, obj);
+    return;
+  }
+
+  LogWriter *writer = impl_->writer_.get();
+  if (!writer) {
+    impl_->logger_->log(spdlog::source_loc(file, line, func),
+                        (spdlog::level::level_enum)level, data);
+    if (level == Level::kFatal)
+      std::exit(1);
+    return;
+  }
+
+  // Lines formatted elsewhere, from the Entry API, go in as text records.
+  if (format_ == kFormatBinary) {
+    static thread_local std::string rec;
+    rec.clear();
+    rec.push_back(kRecordText);
+    put_varint(rec, read_tsc());
+    rec.push_back(char(level));
+    put_varint(rec, thread_tid());
+    put_varint(rec, data.size());
+    rec.append(data);
+    deliver(*this, *writer, level, rec.data(), rec.size());
+    return;
+  }
+
+  spdlog::details::log_msg msg(spdlog::source_loc(file, line, func),
+                               impl_->name_,
+                               (spdlog::level::level_enum)level, data);
+  static thread_local spdlog::memory_buf_t buf;
+  buf.clear();
+  impl_->formatter().format(msg, buf);
+  deliver(*this, *writer, level, buf.data(), buf.size());
+}
+
 void flush_every(std::chrono::seconds interval) {
   spdlog::flush_every(interval);
 }
@@ -103,4 +375,101 @@ Logger &sl() {
   return logger;
 }
 
+SamplingPolicy sampling_policy;
+
+// Callsites that logged with sampling on, pushed once each, never removed,
+// they are statics.
+static std::atomic<Callsite *> callsites{nullptr};
+
+void Callsite::enroll() noexcept {
+  if (enrolled_.exchange(true))
+    return;
+  next_ = callsites.load(std::memory_order_relaxed);
+  while (!callsites.compare_exchange_weak(next_, this,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed))
+    ;
+}
+
+/// Ends sampling intervals, resets the count of every callsite and logs
+/// the lines each dropped.
+class Sampler {
+public:
+  explicit Sampler(std::chrono::milliseconds interval)
+      : interval_(interval), thread_([this] { run(); }) {}
+
+  ~Sampler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  void set_interval(std::chrono::milliseconds interval) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      interval_ = interval;
+    }
+    cv_.notify_one();
+  }
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+      cv_.wait_for(lock, interval_);
+      if (stop_)
+        break;
+      lock.unlock();
+      summarize();
+      lock.lock();
+    }
+  }
+
+  // Lines a callsite passed with count calls, the rest were dropped.
+  static uint64_t passed(uint64_t count, uint64_t first, uint64_t every) {
+    if (count <= first)
+      return count;
+    return first + (every > 0 ? (count - first + every - 1) / every : 0);
+  }
+
+  void summarize() {
+    uint64_t first = sampling_policy.first.load(std::memory_order_relaxed);
+    uint64_t every = sampling_policy.every.load(std::memory_order_relaxed);
+    Logger &logger = sl();
+    for (Callsite *site = callsites.load(std::memory_order_acquire); site;
+         site = site->next_) {
+      uint64_t count = site->count_.exchange(0, std::memory_order_relaxed);
+      uint64_t dropped = count - passed(count, first, every);
+      // Written past sampling, the summary of a site must never be dropped.
+      if (dropped > 0 && logger.get_level() <= kInfo)
+        logger.log_fields("", 0, "", kInfo, "Log lines suppressed",
+                          fields(KV("callsite", site->msg_),
+                                 KV("count", dropped)));
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::chrono::milliseconds interval_;
+  std::thread thread_;
+};
+
+void set_sampling(std::chrono::milliseconds interval, uint64_t first,
+                  uint64_t every) {
+  static std::mutex mutex;
+  static std::unique_ptr<Sampler> sampler;
+  std::lock_guard<std::mutex> lock(mutex);
+  sampling_policy.first.store(first, std::memory_order_relaxed);
+  sampling_policy.every.store(every, std::memory_order_relaxed);
+  sampling_policy.enabled.store(true, std::memory_order_relaxed);
+  if (sampler)
+    sampler->set_interval(interval);
+  else
+    sampler = std::make_unique<Sampler>(interval);
+}
+
 } // namespace logrus
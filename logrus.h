@@ -11,11 +11,15 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <cstring>
 #include <memory>
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
@@ -37,6 +41,29 @@ enum Level : int {
   kFatal = SPDLOG_LEVEL_CRITICAL,
 };
 
+/// What a full log file queue does with another line, see set_rotating().
+enum Overflow : int {
+  kOverflowDrop,  ///< Drop it, the drop count is logged once there is room.
+  kOverflowBlock, ///< Wait for the writer thread.
+};
+
+/// How the set_rotating() file is written.
+enum Format : int {
+  kFormatText,   ///< Lines of set_pattern().
+  kFormatBinary, ///< Records of log_binary.h, read with mux-logcat.
+  kFormatJson,   ///< An object per line, to stdout without a file.
+};
+
+/// Who writes the set_rotating() file.
+enum Sink : int {
+  kSinkShared,    ///< One file, written by the writer thread.
+  kSinkPerThread, ///< A segment file per thread, mux.t<N>.log, buffered by
+                  ///< the thread itself. Segments rotate together.
+};
+
+/// Level name as lines print it.
+std::string_view to_string(Level level);
+
 const char kFieldMsgKey[] = "msg";
 const char kFieldErrKey[] = "error";
 const char kFieldDelim[] = "=";
@@ -54,6 +81,119 @@ using ValueType =
 
 using FieldType = std::pair<std::string, ValueType>;
 
+/// A field of a LOG_ line. The key is a literal, the value is referenced
+/// until the statement ends, so nothing is copied.
+template <typename T> struct KeyValue {
+  std::string_view key;
+  const T &value;
+};
+
+template <size_t N, typename T>
+KeyValue<T> kv(const char (&key)[N], const T &value) {
+  return KeyValue<T>{std::string_view(key, strlen_const(key)), value};
+}
+
+template <typename... Ts> struct Fields {
+  std::tuple<KeyValue<Ts>...> kvs;
+};
+
+template <typename... Ts> Fields<Ts...> fields(const KeyValue<Ts> &...kvs) {
+  return Fields<Ts...>{std::tuple<KeyValue<Ts>...>(kvs...)};
+}
+
+/// The calling thread's line, cleared and starting with the msg field. Its
+/// capacity stays, so building a line doesn't allocate once warm.
+std::string &begin_line(std::string_view msg);
+
+template <typename T> struct dependent_false : std::false_type {};
+
+/// Call \p f with \p v as bool, char, long long, unsigned long long,
+/// double, std::string_view or const void *. Values print like fmt would,
+/// char as a character, other integers as numbers, pointers in hex.
+template <typename T, typename F> void with_value(const T &v, F &&f) {
+  using D = std::decay_t<T>;
+  if constexpr (std::is_same_v<D, bool>) {
+    f(bool(v));
+  } else if constexpr (std::is_same_v<D, char>) {
+    f(char(v));
+  } else if constexpr (std::is_integral_v<D> && std::is_signed_v<D>) {
+    f(static_cast<long long>(v));
+  } else if constexpr (std::is_integral_v<D>) {
+    f(static_cast<unsigned long long>(v));
+  } else if constexpr (std::is_enum_v<D>) {
+    with_value(static_cast<std::underlying_type_t<D>>(v), f);
+  } else if constexpr (std::is_floating_point_v<D>) {
+    f(double(v));
+  } else if constexpr (std::is_same_v<D, const char *> ||
+                       std::is_same_v<D, char *>) {
+    const char *p = v;
+    f(std::string_view(p ? p : "(null)"));
+  } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+    f(std::string_view(v));
+  } else if constexpr (std::is_pointer_v<D>) {
+    f(static_cast<const void *>(v));
+  } else {
+    static_assert(dependent_false<T>::value, "unsupported log value type");
+  }
+}
+
+void append_scalar(std::string &out, bool v);
+void append_scalar(std::string &out, char v);
+void append_scalar(std::string &out, long long v);
+void append_scalar(std::string &out, unsigned long long v);
+void append_scalar(std::string &out, double v);
+void append_scalar(std::string &out, std::string_view v);
+void append_scalar(std::string &out, const void *v);
+
+template <typename T> void append_value(std::string &out, const T &v) {
+  with_value(v, [&out](auto x) { append_scalar(out, x); });
+}
+
+/// Binary counterparts, see log_binary.h.
+void encode_scalar(std::string &out, bool v);
+void encode_scalar(std::string &out, char v);
+void encode_scalar(std::string &out, long long v);
+void encode_scalar(std::string &out, unsigned long long v);
+void encode_scalar(std::string &out, double v);
+void encode_scalar(std::string &out, std::string_view v);
+void encode_scalar(std::string &out, const void *v);
+
+template <typename T> void encode_value(std::string &out, const T &v) {
+  with_value(v, [&out](auto x) { encode_scalar(out, x); });
+}
+
+/// Append \p s as a quoted JSON string. The scan for bytes to escape is
+/// vectorized where the CPU allows.
+void append_json_string(std::string &out, std::string_view s);
+
+/// JSON counterparts, numbers as numbers and the rest as strings.
+void json_scalar(std::string &out, bool v);
+void json_scalar(std::string &out, char v);
+void json_scalar(std::string &out, long long v);
+void json_scalar(std::string &out, unsigned long long v);
+void json_scalar(std::string &out, double v);
+void json_scalar(std::string &out, std::string_view v);
+void json_scalar(std::string &out, const void *v);
+
+template <typename T>
+void append_json_field(std::string &out, std::string_view key,
+                       const T &value) {
+  out.push_back(',');
+  append_json_string(out, key);
+  out.push_back(':');
+  with_value(value, [&out](auto x) { json_scalar(out, x); });
+}
+
+template <typename T>
+void append_field(std::string &out, std::string_view key, const T &value) {
+  out.push_back(' ');
+  out.append(key);
+  out.append(kFieldDelim, strlen_const(kFieldDelim));
+  out.append(kFieldValueQuoted, strlen_const(kFieldValueQuoted));
+  append_value(out, value);
+  out.append(kFieldValueQuoted, strlen_const(kFieldValueQuoted));
+}
+
 class Logger;
 
 void log_to(Logger *logger, const char *file, int line, const char *func,
@@ -140,6 +280,49 @@ private:
   std::vector<FieldType> fields_;
 };
 
+/// Process wide sampling of LOG_ lines, see set_sampling().
+struct SamplingPolicy {
+  std::atomic<bool> enabled{false};
+  std::atomic<uint64_t> first{0};
+  std::atomic<uint64_t> every{0};
+};
+
+extern SamplingPolicy sampling_policy;
+
+/// State of one LOG_ statement, static in the macro. With sampling on, a
+/// callsite logs its first lines of an interval, then one in every. A
+/// dropped line costs a relaxed increment, the lines a callsite dropped are
+/// summed up in one line when the interval ends. Fatal lines always pass.
+class Callsite {
+public:
+  constexpr explicit Callsite(const char *msg) : msg_(msg) {}
+
+  bool admit(Level level) noexcept {
+    if (!sampling_policy.enabled.load(std::memory_order_relaxed) ||
+        level >= kFatal)
+      return true;
+    if (!enrolled_.load(std::memory_order_relaxed))
+      enroll();
+    uint64_t n = count_.fetch_add(1, std::memory_order_relaxed);
+    uint64_t first = sampling_policy.first.load(std::memory_order_relaxed);
+    if (n < first)
+      return true;
+    uint64_t every = sampling_policy.every.load(std::memory_order_relaxed);
+    return every > 0 && (n - first) % every == 0;
+  }
+
+private:
+  friend class Sampler;
+
+  /// Add to the callsites the sampler resets every interval.
+  void enroll() noexcept;
+
+  const char *msg_;
+  std::atomic<uint64_t> count_{0};
+  std::atomic<bool> enrolled_{false};
+  Callsite *next_ = nullptr;
+};
+
 class LoggerImpl;
 class Logger {
 public:
@@ -152,9 +335,23 @@ public:
   Level get_level() const;
   void set_level(Level level);
 
+  /// Log to a rotating file. Lines are formatted by the calling thread and
+  /// written by a thread of their own, so callers never wait on the file.
+  /// Call before other threads log.
   void set_rotating(const std::string &lname, const std::string &fname,
                     size_t max_file_size, size_t max_files);
 
+  void set_overflow(Overflow overflow);
+
+  /// Give every thread its own segment of the set_rotating() file. Lines of
+  /// a thread never pass a lock another thread takes per line, nothing is
+  /// dropped, the thread writes its buffer itself when full. mux-logcat -m
+  /// merges the segments by time. Only regular files split.
+  void set_sink(Sink sink);
+
+  /// Lines the file queue dropped so far.
+  uint64_t dropped() const;
+
   template <typename T>
   Entry with_field(const std::string &k, const T &v) {
     return Entry(this, k, v);
@@ -202,11 +399,61 @@ public:
   LOGRUS_DECLARE_LOGGER_LOG_WITH_LOC(fatal);
 #undef LOGRUS_DECLARE_LOGGER_LOG_WITH_LOC
 
+  /// Format of the set_rotating() file, binary needs one. JSON without a
+  /// file goes to stdout.
+  void set_format(Format format);
+
+  /// The LOG_ path, fields go straight into the thread's line or record.
+  template <size_t N, typename... Ts>
+  void log_fields(const char *file, int line, const char *func, Level level,
+                  const char (&msg)[N], const Fields<Ts...> &fields) {
+    if (format_ == kFormatBinary) {
+      std::string &rec = begin_record(
+          level, std::string_view(msg, strlen_const(msg)), sizeof...(Ts));
+      std::apply(
+          [this, &rec](const auto &...kv) {
+            ((encode_key(rec, kv.key), encode_value(rec, kv.value)), ...);
+          },
+          fields.kvs);
+      write_record(level, rec);
+      return;
+    }
+    if (format_ == kFormatJson) {
+      std::string &obj =
+          begin_json(level, std::string_view(msg, strlen_const(msg)));
+      std::apply(
+          [&obj](const auto &...kv) {
+            (append_json_field(obj, kv.key, kv.value), ...);
+          },
+          fields.kvs);
+      write_json(level, obj);
+      return;
+    }
+
+    std::string &buf = begin_line(std::string_view(msg, strlen_const(msg)));
+    std::apply(
+        [&buf](const auto &...kv) {
+          (append_field(buf, kv.key, kv.value), ...);
+        },
+        fields.kvs);
+    log(file, line, func, level, buf);
+  }
+
+  /// \p data may be the calling thread's line from begin_line(), which a
+  /// nested log call overwrites.
   void log(const char *file, int line, const char *func, Level level,
            std::string_view data);
 
 private:
+  std::string &begin_record(Level level, std::string_view msg,
+                            size_t nfields);
+  void encode_key(std::string &rec, std::string_view key);
+  void write_record(Level level, const std::string &rec);
+  std::string &begin_json(Level level, std::string_view msg);
+  void write_json(Level level, std::string &obj);
+
   Level level_;
+  Format format_ = kFormatText;
   std::shared_ptr<LoggerImpl> impl_;
 };
 
@@ -228,6 +475,18 @@ inline void set_rotating(const std::string &fname, size_t max_file_size,
   sl().set_rotating("default", fname, max_file_size, max_files);
 }
 
+inline void set_overflow(Overflow overflow) { sl().set_overflow(overflow); }
+
+inline void set_sink(Sink sink) { sl().set_sink(sink); }
+
+inline void set_format(Format format) { sl().set_format(format); }
+
+/// Sample LOG_ lines per callsite, the \p first of every \p interval, then
+/// one in \p every, 0 drops the rest. Callsites that dropped lines log how
+/// many at the end of the interval.
+void set_sampling(std::chrono::milliseconds interval, uint64_t first,
+                  uint64_t every);
+
 template <typename T>
 inline Entry with_field(const std::string &k, const T &v) {
   return sl().with_field(k, v);
@@ -275,32 +534,33 @@ LOGRUS_DECLARE_LOG(fatal);
 
 } // namespace logrus
 
-#define KV(k, v)                                                               \
-  { k, v }
+#define KV(k, v) logrus::kv(k, v)
 
 #define KERR(errnum) KV(logrus::kFieldErrKey, strerror(errnum))
 
 #ifdef LOGRUS_WITH_LOC
-#define LOG_(logger, level, logfunc, msg, ...)                                 \
+#define LOG_(logger, level, msg, ...)                                          \
   do {                                                                         \
-    if (logger.get_level() <= level)                                           \
-      logger.with_fields({__VA_ARGS__})                                        \
-          .logfunc(__FILE__, __LINE__, __FUNCTION__, msg);                     \
+    static logrus::Callsite logrus_callsite(msg);                              \
+    if (logger.get_level() <= level && logrus_callsite.admit(level))           \
+      logger.log_fields(__FILE__, __LINE__, __FUNCTION__, level, msg,          \
+                        logrus::fields(__VA_ARGS__));                          \
   } while (0)
 #else
-#define LOG_(logger, level, logfunc, msg, ...)                                 \
+#define LOG_(logger, level, msg, ...)                                          \
   do {                                                                         \
-    if (logger.get_level() <= level)                                           \
-      logger.with_fields({__VA_ARGS__}).logfunc(msg);                          \
+    static logrus::Callsite logrus_callsite(msg);                              \
+    if (logger.get_level() <= level && logrus_callsite.admit(level))           \
+      logger.log_fields("", 0, "", level, msg, logrus::fields(__VA_ARGS__));   \
   } while (0)
 #endif
 
-#define LOG_TRACE_(l, msg, ...) LOG_(l, logrus::kTrace, trace, msg, __VA_ARGS__)
-#define LOG_DEBUG_(l, msg, ...) LOG_(l, logrus::kDebug, debug, msg, __VA_ARGS__)
-#define LOG_INFO_(l, msg, ...) LOG_(l, logrus::kInfo, info, msg, __VA_ARGS__)
-#define LOG_WARN_(l, msg, ...) LOG_(l, logrus::kWarn, warn, msg, __VA_ARGS__)
-#define LOG_ERROR_(l, msg, ...) LOG_(l, logrus::kError, error, msg, __VA_ARGS__)
-#define LOG_FATAL_(l, msg, ...) LOG_(l, logrus::kFatal, fatal, msg, __VA_ARGS__)
+#define LOG_TRACE_(l, msg, ...) LOG_(l, logrus::kTrace, msg, __VA_ARGS__)
+#define LOG_DEBUG_(l, msg, ...) LOG_(l, logrus::kDebug, msg, __VA_ARGS__)
+#define LOG_INFO_(l, msg, ...) LOG_(l, logrus::kInfo, msg, __VA_ARGS__)
+#define LOG_WARN_(l, msg, ...) LOG_(l, logrus::kWarn, msg, __VA_ARGS__)
+#define LOG_ERROR_(l, msg, ...) LOG_(l, logrus::kError, msg, __VA_ARGS__)
+#define LOG_FATAL_(l, msg, ...) LOG_(l, logrus::kFatal, msg, __VA_ARGS__)
 
 #define LOG_TRACE(msg, ...) LOG_TRACE_(logrus::sl(), msg, __VA_ARGS__)
 #define LOG_DEBUG(msg, ...) LOG_DEBUG_(logrus::sl(), msg, __VA_ARGS__)
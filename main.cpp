@@ -15,6 +15,7 @@
 #include <getopt.h>
 #include <stdio.h>
 
+#include <cstring>
 #include <sstream>
 #include <thread>
 
@@ -27,7 +28,17 @@ static struct option opts[] = {
     {"dst", required_argument, NULL, 'd'},
     {"src", optional_argument, NULL, 's'},
     {"relay_list", optional_argument, NULL, 'r'},
+    {"option", required_argument, NULL, 'o'},
     {"file", optional_argument, NULL, 'f'},
+    {"log_overflow", required_argument, NULL, 'O'},
+    {"log_format", required_argument, NULL, 'F'},
+    {"log_sample", required_argument, NULL, 'S'},
+    {"log_sink", required_argument, NULL, 'K'},
+    {"bandwidth", required_argument, NULL, 'b'},
+    {"quantum", required_argument, NULL, 'q'},
+    {"drain", required_argument, NULL, 'D'},
+    {"metrics", required_argument, NULL, 'M'},
+    {"tcp_info", required_argument, NULL, 'T'},
     {"verbose", no_argument, NULL, 'V'},
     {"help", no_argument, NULL, 'h'},
     {0, 0, 0, 0},
@@ -37,19 +48,81 @@ static struct option opts[] = {
 
 static void usage(char *argv1) {
   fprintf(stderr, "Usage: %s\n", argv1);
-  USAGE_LINE("  -l,  --listen      Listen address or port");
-  USAGE_LINE("  -d,  --dst         Destination address");
+  USAGE_LINE("  -l,  --listen      Listen address, port or unix:path");
+  USAGE_LINE("  -d,  --dst         Destination address or unix:path");
   USAGE_LINE("  -s,  --src         Source address or ip");
-  USAGE_LINE("  -r,  --relay_list  Relay address tuple list [-l,-s,-d/]+");
+  USAGE_LINE("  -r,  --relay_list  Relay address tuple list [-l,-s,-d,-o/]+");
+  USAGE_LINE("                     use ';' between tuples with '/' inside");
+  USAGE_LINE("  -o,  --option      Tuple option key=value, repeatable");
   USAGE_LINE("  -f,  --file        Log file path");
+  USAGE_LINE("  -O,  --log_overflow drop|block when log file writes lag");
+  USAGE_LINE("  -F,  --log_format  text|json|binary, binary needs -f and");
+  USAGE_LINE("                     is read with mux-logcat");
+  USAGE_LINE("  -S,  --log_sample  first[/every[/ms]], each log statement");
+  USAGE_LINE("                     logs its first lines per ms, default");
+  USAGE_LINE("                     1000, then one in every, 0 drops all");
+  USAGE_LINE("  -K,  --log_sink    shared|thread, thread gives every thread");
+  USAGE_LINE("                     its own file, merged with mux-logcat -m");
+  USAGE_LINE("  -b,  --bandwidth   All relays bytes per second, k|m|g suffix");
+  USAGE_LINE("  -q,  --quantum     Bytes a relay reads per turn, 0 disables");
+  USAGE_LINE("  -D,  --drain       Seconds relays may finish after SIGUSR2");
+  USAGE_LINE("                     upgrade hands listeners to a new process");
+  USAGE_LINE("  -M,  --metrics     Serve Prometheus metrics on GET /metrics,");
+  USAGE_LINE("                     address, port or unix:path");
+  USAGE_LINE("  -T,  --tcp_info    Sample TCP_INFO of 1 in N relays every 10s");
+  USAGE_LINE("                     into metrics and Forward done, 0 is none,");
+  USAGE_LINE("                     default 64");
   USAGE_LINE("  -V,  --verbose     Verbose output");
   USAGE_LINE("  -h,  --help        Help");
+  USAGE_LINE("Tuple options:");
+  USAGE_LINE("  send_proxy=v1|v2        PROXY header to dst");
+  USAGE_LINE("  accept_proxy=v1|v2|any  Expect PROXY header from client");
+  USAGE_LINE("  proxy_timeout=ms        PROXY header deadline");
+  USAGE_LINE("  tunnel=client|server    Multiplex via peer mux");
+  USAGE_LINE("  proto=tcp|udp           Relay protocol");
+  USAGE_LINE("  udp_idle=sec            UDP session idle expiry");
+  USAGE_LINE("  udp_max_sessions=n      UDP sessions per thread, new clients");
+  USAGE_LINE("                          past it are dropped");
+  USAGE_LINE("  udp_gro=0|1             UDP receive offload");
+  USAGE_LINE("  udp_gso=0|1             UDP segmentation offload");
+  USAGE_LINE("  sni=[*.]host@dst        Route TLS server name to dst");
+  USAGE_LINE("  host=[*.]host@dst       Route HTTP Host to dst");
+  USAGE_LINE("  sniff=proto@dst         Route by first bytes, proto is one of");
+  USAGE_LINE("                          tls|ssh|http|timeout|hex:..|str:..");
+  USAGE_LINE("  peek_timeout=ms         Wait for first client bytes");
+  USAGE_LINE("  transparent=mode        Take dst from the connection, mode is");
+  USAGE_LINE("                          redirect (SO_ORIGINAL_DST) or tproxy");
+  USAGE_LINE("  spoof_src=0|1           Dial dst from the client address");
+  USAGE_LINE("  frontend=connect|socks5 Client names dst per connection");
+  USAGE_LINE("  connect_allow=rule      Allowed frontend dst, repeatable,");
+  USAGE_LINE("                          cidr[:port[-port]] or [v6]:port,");
+  USAGE_LINE("                          frontend needs at least one");
+  USAGE_LINE("  allow=cidr|deny=cidr    Client acl rule, repeatable, longest");
+  USAGE_LINE("                          prefix wins, any allow denies others");
+  USAGE_LINE("                          accept_proxy checks the PROXY client");
+  USAGE_LINE("  acl_file=path           More acl rules, reloaded on SIGHUP");
+  USAGE_LINE("  max_conns_per_ip=n      Concurrent connections per client");
+  USAGE_LINE("  max_rate_per_ip=n       New connections per second per client");
+  USAGE_LINE("  conn_rate=bytes         Bytes per second of every relay");
+  USAGE_LINE("  tuple_rate=bytes        Bytes per second of all tuple relays");
 }
 
 struct CommandArgs {
   std::vector<RelayEndpointTuple> addr_tuple_list;
   std::string logfile;
-  bool verbose;
+  logrus::Overflow log_overflow = logrus::kOverflowDrop;
+  logrus::Format log_format = logrus::kFormatText;
+  logrus::Sink log_sink = logrus::kSinkShared;
+  bool log_sample = false;
+  uint64_t log_sample_first = 0;
+  uint64_t log_sample_every = 0;
+  std::chrono::milliseconds log_sample_interval{1000};
+  bool verbose = false;
+  uint64_t bandwidth = 0;
+  size_t quantum = RelayServer::kDefaultQuantum;
+  std::chrono::seconds drain{60};
+  RelayEndpoint metrics; // unspecified serves none
+  size_t tcp_info_every = RelayServer::kDefaultTcpInfoEvery;
 };
 
 static tcp::endpoint parse_addr(const std::string &hostport) {
@@ -74,6 +147,23 @@ static tcp::endpoint parse_addr(const std::string &hostport) {
   return tcp::endpoint(address::from_string(p.first), std::stoi(p.second));
 }
 
+// unix:/path or unix:@abstract, otherwise as parse_addr
+static RelayEndpoint parse_stream_addr(const std::string &s) {
+  const std::string prefix = "unix:";
+  if (s.compare(0, prefix.size(), prefix) != 0)
+    return RelayEndpoint(parse_addr(s));
+
+  std::error_code ec;
+  RelayEndpoint ep = make_unix_endpoint(s.substr(prefix.size()), ec);
+  if (ec)
+    throw std::system_error(ec, s);
+  return ep;
+}
+
+static bool is_specified(const RelayEndpoint &ep) {
+  return is_unix(ep) || (is_inet(ep) && to_tcp(ep).port() > 0);
+}
+
 std::vector<std::string> split(const std::string &s, char delim) {
   std::vector<std::string> ans;
   std::istringstream stream(s);
@@ -83,23 +173,239 @@ std::vector<std::string> split(const std::string &s, char delim) {
   return ans;
 }
 
-// listen_addr,src_addr,dst_addr/
+static ProxyProtocolVersion parse_proxy_version(const std::string &s,
+                                                bool allow_any) {
+  if (s == "v1")
+    return kProxyV1;
+  if (s == "v2")
+    return kProxyV2;
+  if (s == "any" && allow_any)
+    return kProxyAny;
+  throw std::logic_error("unknown PROXY protocol version '" + s + "'");
+}
+
+static TunnelMode parse_tunnel_mode(const std::string &s) {
+  if (s == "client")
+    return kTunnelClient;
+  if (s == "server")
+    return kTunnelServer;
+  throw std::logic_error("unknown tunnel mode '" + s + "'");
+}
+
+static RelayProtocol parse_relay_protocol(const std::string &s) {
+  if (s == "tcp")
+    return kRelayTcp;
+  if (s == "udp")
+    return kRelayUdp;
+  throw std::logic_error("unknown protocol '" + s + "'");
+}
+
+static TransparentMode parse_transparent_mode(const std::string &s) {
+  if (s == "redirect")
+    return kTransparentRedirect;
+  if (s == "tproxy")
+    return kTransparentTproxy;
+  throw std::logic_error("unknown transparent mode '" + s + "'");
+}
+
+static FrontendProtocol parse_frontend(const std::string &s) {
+  if (s == "connect")
+    return kFrontendConnect;
+  if (s == "socks5")
+    return kFrontendSocks5;
+  throw std::logic_error("unknown frontend '" + s + "'");
+}
+
+static logrus::Overflow parse_overflow(const std::string &s) {
+  if (s == "drop")
+    return logrus::kOverflowDrop;
+  if (s == "block")
+    return logrus::kOverflowBlock;
+  throw std::logic_error("unknown log overflow '" + s + "'");
+}
+
+static logrus::Format parse_log_format(const std::string &s) {
+  if (s == "text")
+    return logrus::kFormatText;
+  if (s == "binary")
+    return logrus::kFormatBinary;
+  if (s == "json")
+    return logrus::kFormatJson;
+  throw std::logic_error("unknown log format '" + s + "'");
+}
+
+static logrus::Sink parse_log_sink(const std::string &s) {
+  if (s == "shared")
+    return logrus::kSinkShared;
+  if (s == "thread")
+    return logrus::kSinkPerThread;
+  throw std::logic_error("unknown log sink '" + s + "'");
+}
+
+// first[/every[/ms]] of -S.
+static void parse_log_sample(const std::string &s, CommandArgs &args) {
+  size_t end;
+  args.log_sample_first = std::stoull(s, &end);
+  std::string rest = s.substr(end);
+  if (!rest.empty() && rest[0] == '/') {
+    args.log_sample_every = std::stoull(rest.substr(1), &end);
+    rest = rest.substr(1 + end);
+  }
+  if (!rest.empty() && rest[0] == '/') {
+    args.log_sample_interval =
+        std::chrono::milliseconds(std::stoull(rest.substr(1), &end));
+    rest = rest.substr(1 + end);
+  }
+  if (!rest.empty() || args.log_sample_interval.count() == 0)
+    throw std::logic_error("invalid log sample '" + s + "'");
+  args.log_sample = true;
+}
+
+// Bytes per second, with an optional k, m or g suffix of 1024 multiples.
+static uint64_t parse_rate(const std::string &s) {
+  size_t end;
+  uint64_t v = std::stoull(s, &end);
+  std::string unit = s.substr(end);
+  if (unit == "k" || unit == "K")
+    return v << 10;
+  if (unit == "m" || unit == "M")
+    return v << 20;
+  if (unit == "g" || unit == "G")
+    return v << 30;
+  if (!unit.empty())
+    throw std::logic_error("invalid rate '" + s + "'");
+  return v;
+}
+
+static bool parse_bool(const std::string &s) {
+  if (s == "1" || s == "true")
+    return true;
+  if (s == "0" || s == "false")
+    return false;
+  throw std::logic_error("invalid boolean '" + s + "'");
+}
+
+// [*.]host@dst, for sni and host routes
+static void parse_name_route(const std::string &key, const std::string &s,
+                             std::shared_ptr<SniTable> &table) {
+  size_t i = s.find('@');
+  if (i == std::string::npos)
+    throw std::logic_error(key + " route '" + s + "' missing '@'");
+  if (!table)
+    table = std::make_shared<SniTable>();
+  if (!table->add(s.substr(0, i), parse_stream_addr(s.substr(i + 1))))
+    throw std::logic_error("invalid " + key + " pattern '" + s.substr(0, i) +
+                           "'");
+}
+
+// proto@dst
+static void parse_sniff_route(const std::string &s, RelayEndpointTuple &t) {
+  size_t i = s.find('@');
+  if (i == std::string::npos)
+    throw std::logic_error("sniff route '" + s + "' missing '@'");
+  if (!t.sniff)
+    t.sniff = std::make_shared<SniffTable>();
+  if (!t.sniff->add(s.substr(0, i), parse_stream_addr(s.substr(i + 1))))
+    throw std::logic_error("invalid sniff protocol '" + s.substr(0, i) + "'");
+}
+
+// key=value
+static void parse_tuple_option(const std::string &s, RelayEndpointTuple &t) {
+  size_t i = s.find('=');
+  if (i == std::string::npos)
+    throw std::logic_error("tuple option '" + s + "' missing '='");
+  std::string key = s.substr(0, i);
+  std::string value = s.substr(i + 1);
+
+  if (key == "send_proxy")
+    t.send_proxy = parse_proxy_version(value, false);
+  else if (key == "accept_proxy")
+    t.accept_proxy = parse_proxy_version(value, true);
+  else if (key == "proxy_timeout")
+    t.proxy_timeout = std::chrono::milliseconds(std::stoul(value));
+  else if (key == "tunnel")
+    t.tunnel = parse_tunnel_mode(value);
+  else if (key == "proto")
+    t.proto = parse_relay_protocol(value);
+  else if (key == "udp_idle")
+    t.udp_idle = std::chrono::seconds(std::stoul(value));
+  else if (key == "udp_max_sessions") {
+    t.udp_max_sessions = std::stoul(value);
+    if (t.udp_max_sessions == 0)
+      throw std::logic_error("udp_max_sessions must be positive");
+  } else if (key == "udp_gro")
+    t.udp_gro = parse_bool(value);
+  else if (key == "udp_gso")
+    t.udp_gso = parse_bool(value);
+  else if (key == "sni")
+    parse_name_route(key, value, t.sni);
+  else if (key == "host")
+    parse_name_route(key, value, t.host);
+  else if (key == "sniff")
+    parse_sniff_route(value, t);
+  else if (key == "peek_timeout")
+    t.peek_timeout = std::chrono::milliseconds(std::stoul(value));
+  else if (key == "transparent")
+    t.transparent = parse_transparent_mode(value);
+  else if (key == "spoof_src")
+    t.spoof_src = parse_bool(value);
+  else if (key == "frontend")
+    t.frontend = parse_frontend(value);
+  else if (key == "connect_allow") {
+    if (!t.connect_allow)
+      t.connect_allow = std::make_shared<ConnectAllowlist>();
+    if (!t.connect_allow->add(value))
+      throw std::logic_error("invalid connect_allow rule '" + value + "'");
+  } else if (key == "max_conns_per_ip")
+    t.max_conns_per_ip = std::stoul(value);
+  else if (key == "max_rate_per_ip")
+    t.max_rate_per_ip = std::stoul(value);
+  else if (key == "conn_rate")
+    t.conn_rate = parse_rate(value);
+  else if (key == "tuple_rate")
+    t.tuple_rate = parse_rate(value);
+  else if (key == "allow" || key == "deny" || key == "acl_file") {
+    if (!t.acl)
+      t.acl = std::make_shared<AccessControl>();
+    if (key == "acl_file")
+      t.acl->set_file(value);
+    else
+      t.acl->add_rule(key + " " + value);
+  } else
+    throw std::logic_error("unknown tuple option '" + key + "'");
+}
+
+// listen_addr,src_addr,dst_addr[,key=value]*/
 // 80,192.168.32.210:8000,192.168.32.251:8000/192.168.32.245:80,192.168.32.251:8000
+// 53,10.0.0.53:53,proto=udp
+// Tuples are separated by ';' instead when any of them has a unix path.
+// unix:/run/app.sock,192.168.32.251:8000;8080,unix:/run/web.sock
 static std::vector<RelayEndpointTuple> parse_addr_tuple(const char *s) {
   std::vector<RelayEndpointTuple> addr_tuple_list;
-  std::vector<std::string> tuple_str_list = split(s, '/');
+  char delim = std::strchr(s, ';') ? ';' : '/';
+  std::vector<std::string> tuple_str_list = split(s, delim);
   for (const auto &tuple_str : tuple_str_list) {
-    std::vector<std::string> addr_str_list = split(tuple_str, ',');
-    if (addr_str_list.size() < 2)
+    RelayEndpointTuple t;
+    std::vector<std::string> addr_str_list;
+    for (const auto &item : split(tuple_str, ',')) {
+      if (item.find('=') != std::string::npos)
+        parse_tuple_option(item, t);
+      else
+        addr_str_list.push_back(item);
+    }
+    bool need_dst =
+        t.transparent == kTransparentNone && t.frontend == kFrontendNone;
+    if (addr_str_list.empty() || (need_dst && addr_str_list.size() < 2))
       throw std::logic_error("tuple address count must > 2");
 
-    RelayEndpointTuple t;
-    t.listen = parse_addr(addr_str_list[0]);
-    if (addr_str_list.size() == 2) {
-      t.dst = parse_addr(addr_str_list[1]);
+    t.listen = parse_stream_addr(addr_str_list[0]);
+    if (addr_str_list.size() == 1) {
+      // transparent or frontend, dst comes with every connection
+    } else if (addr_str_list.size() == 2) {
+      t.dst = parse_stream_addr(addr_str_list[1]);
     } else {
       t.src = parse_addr(addr_str_list[1]);
-      t.dst = parse_addr(addr_str_list[2]);
+      t.dst = parse_stream_addr(addr_str_list[2]);
     }
     addr_tuple_list.push_back(t);
   }
@@ -109,11 +415,62 @@ static std::vector<RelayEndpointTuple> parse_addr_tuple(const char *s) {
 static void
 check_addr_tuple_valid(const std::vector<RelayEndpointTuple> &addr_tuple_list) {
   for (const auto &t : addr_tuple_list) {
+    if (t.acl) {
+      if (!is_inet(t.listen) || t.proto == kRelayUdp)
+        throw std::logic_error("listen_addr (" + to_string(t.listen) +
+                               ") acl needs tcp ip:port");
+      t.acl->reload(); // first load, errors are fatal here
+    }
+    if ((t.max_conns_per_ip > 0 || t.max_rate_per_ip > 0) &&
+        (t.proto == kRelayUdp || t.tunnel != kTunnelNone))
+      throw std::logic_error("listen_addr (" + to_string(t.listen) +
+                             ") client limits need tcp, no tunnel");
+    if ((t.conn_rate > 0 || t.tuple_rate > 0) &&
+        (t.proto == kRelayUdp || t.tunnel != kTunnelNone))
+      throw std::logic_error("listen_addr (" + to_string(t.listen) +
+                             ") conn_rate and tuple_rate need tcp, no tunnel");
+    if (t.transparent != kTransparentNone) {
+      std::string listen_desc = "listen_addr (" + to_string(t.listen) + ")";
+      if (!is_inet(t.listen) || t.proto == kRelayUdp ||
+          t.tunnel != kTunnelNone)
+        throw std::logic_error(listen_desc +
+                               " transparent needs tcp ip:port, no tunnel");
+      continue;
+    }
+    if (t.frontend != kFrontendNone) {
+      std::string listen_desc = "listen_addr (" + to_string(t.listen) + ")";
+      if (t.proto == kRelayUdp || t.tunnel != kTunnelNone || t.sni ||
+          t.sniff || t.host)
+        throw std::logic_error(listen_desc +
+                               " frontend can't use udp, tunnel or routes");
+      if (!t.connect_allow)
+        throw std::logic_error(listen_desc + " frontend needs connect_allow");
+      continue;
+    }
+    if (t.connect_allow)
+      throw std::logic_error("listen_addr (" + to_string(t.listen) +
+                             ") connect_allow needs frontend");
+
     std::string dst_desc = "dst_addr (" + to_string(t.dst) + ")";
-    if (t.dst.port() == 0)
+    if (is_inet(t.dst) && to_tcp(t.dst).port() == 0)
       throw std::logic_error(dst_desc + " port can't be 0");
-    if (t.dst.address().is_unspecified())
+    if (is_inet(t.dst) && to_tcp(t.dst).address().is_unspecified())
       throw std::logic_error(dst_desc + " ip must be specified");
+    if ((t.proto == kRelayUdp || t.tunnel == kTunnelClient) &&
+        !is_inet(t.dst))
+      throw std::logic_error(dst_desc + " udp and tunnel need ip:port");
+    if ((t.proto == kRelayUdp || t.tunnel == kTunnelServer) &&
+        !is_inet(t.listen))
+      throw std::logic_error("listen_addr (" + to_string(t.listen) +
+                             ") udp and tunnel need ip:port");
+    if ((t.sni || t.sniff || t.host) &&
+        (t.proto == kRelayUdp || t.tunnel != kTunnelNone))
+      throw std::logic_error(dst_desc +
+                             " sni/sniff/host can't use udp or tunnel");
+    if (t.proto == kRelayUdp &&
+        (t.tunnel != kTunnelNone || t.send_proxy != kProxyNone ||
+         t.accept_proxy != kProxyNone))
+      throw std::logic_error(dst_desc + " udp can't use tunnel or PROXY");
   }
 }
 
@@ -121,17 +478,18 @@ static void parse_command_line(int argc, char *argv[], CommandArgs &args) {
   RelayEndpointTuple addr_tuple;
   while (1) {
     int longidnd;
-    int c = getopt_long(argc, argv, "l:d:s:r:f:Vh", opts, &longidnd);
+    int c = getopt_long(argc, argv, "l:d:s:r:o:f:O:F:S:K:b:q:D:M:T:Vh", opts,
+                        &longidnd);
     if (c < 0)
       break;
     char *arg = optarg ? optarg : argv[optind];
 
     switch (c) {
     case 'l':
-      addr_tuple.listen = parse_addr(arg);
+      addr_tuple.listen = parse_stream_addr(arg);
       break;
     case 'd':
-      addr_tuple.dst = parse_addr(arg);
+      addr_tuple.dst = parse_stream_addr(arg);
       break;
     case 's':
       addr_tuple.src = parse_addr(arg);
@@ -139,9 +497,39 @@ static void parse_command_line(int argc, char *argv[], CommandArgs &args) {
     case 'f':
       args.logfile = arg;
       break;
+    case 'O':
+      args.log_overflow = parse_overflow(arg);
+      break;
+    case 'F':
+      args.log_format = parse_log_format(arg);
+      break;
+    case 'S':
+      parse_log_sample(arg, args);
+      break;
+    case 'K':
+      args.log_sink = parse_log_sink(arg);
+      break;
+    case 'b':
+      args.bandwidth = parse_rate(arg);
+      break;
+    case 'q':
+      args.quantum = parse_rate(arg);
+      break;
+    case 'D':
+      args.drain = std::chrono::seconds(std::stoul(arg));
+      break;
+    case 'M':
+      args.metrics = parse_stream_addr(arg);
+      break;
+    case 'T':
+      args.tcp_info_every = std::stoul(arg);
+      break;
     case 'r':
       args.addr_tuple_list = parse_addr_tuple(arg);
       break;
+    case 'o':
+      parse_tuple_option(arg, addr_tuple);
+      break;
     case 'V':
       args.verbose = true;
       break;
@@ -154,15 +542,29 @@ static void parse_command_line(int argc, char *argv[], CommandArgs &args) {
     }
   }
 
-  if (addr_tuple.listen.port() > 0 && addr_tuple.dst.port() > 0)
+  if (is_specified(addr_tuple.listen) &&
+      (is_specified(addr_tuple.dst) ||
+       addr_tuple.transparent != kTransparentNone ||
+       addr_tuple.frontend != kFrontendNone))
     args.addr_tuple_list.push_back(addr_tuple);
 
+  if (args.log_format == logrus::kFormatBinary && args.logfile.empty())
+    throw std::logic_error("binary log format needs -f");
+  if (args.log_sink == logrus::kSinkPerThread && args.logfile.empty())
+    throw std::logic_error("thread log sink needs -f");
+
   check_addr_tuple_valid(args.addr_tuple_list);
 }
 
 static void init_logging(const CommandArgs &args) {
   if (!args.logfile.empty())
     logrus::set_rotating(args.logfile, 1024 * 1024 * 10, 10);
+  logrus::set_overflow(args.log_overflow);
+  logrus::set_sink(args.log_sink);
+  logrus::set_format(args.log_format);
+  if (args.log_sample)
+    logrus::set_sampling(args.log_sample_interval, args.log_sample_first,
+                         args.log_sample_every);
   if (args.verbose)
     logrus::set_level(logrus::kTrace);
   logrus::set_pattern("%^%l%$ %Y%m%d %H:%M:%S %t %v");
@@ -183,7 +585,11 @@ int main(int argc, char *argv[]) {
   LOG_INFO("=== mux start ===");
 
   try {
-    RelayServer s(args.addr_tuple_list);
+    RelayServer s(args.addr_tuple_list, args.bandwidth, args.quantum);
+    s.set_drain_timeout(args.drain);
+    if (is_specified(args.metrics))
+      s.set_metrics(args.metrics);
+    s.set_tcp_info_every(args.tcp_info_every);
     s.run(get_cpu_count());
   } catch (const std::exception &e) {
     LOG_FATAL("Fatal to run mux", KV("error", e.what()));
@@ -0,0 +1,364 @@
+//===- metrics.cpp - Relay metrics ------------------------------*- C++ -*-===//
+//
+/// \file
+/// Per-thread relay counters and latency histograms summed up when scraped,
+/// and the HTTP endpoint serving them in the Prometheus text format.
+//
+// Author:  zxh
+// Date:    2026/10/17 23:58:41
+//===----------------------------------------------------------------------===//
+
+#include "metrics.h"
+#include "logrus.h"
+#include "netutil.h"
+
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <asio/post.hpp>
+#include <asio/read_until.hpp>
+#include <asio/streambuf.hpp>
+#include <asio/write.hpp>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+size_t Metrics::add_tuple(const std::string &name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (frozen_)
+    throw std::logic_error("metrics tuple added after counting started");
+  tuples_.push_back(name);
+  tuple_count_ = tuples_.size();
+  return tuples_.size() - 1;
+}
+
+Metrics::Shard *Metrics::new_shard() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  frozen_ = true;
+  shards_.push_back(std::make_unique<Shard>(
+      tuple_count_ * kTupleMetricCount + kBufferTierCount,
+      kMaxDestinations + tuple_count_));
+  return shards_.back().get();
+}
+
+uint32_t Metrics::series(size_t tuple, std::string_view dst) {
+  Shard &sh = shard();
+  static thread_local std::string key;
+  key.assign(std::to_string(tuple)).append(" ").append(dst);
+  auto it = sh.series_.find(key);
+  if (it != sh.series_.end())
+    return it->second;
+  bool named = false;
+  uint32_t id = add_series(key, tuple, dst, named);
+  // Destinations folded into "other" are not remembered, a tuple dialing
+  // whatever clients name must not grow the table.
+  if (named)
+    sh.series_.emplace(key, id);
+  return id;
+}
+
+uint32_t Metrics::add_series(const std::string &key, size_t tuple,
+                             std::string_view dst, bool &named) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = series_index_.find(key);
+  named = true;
+  if (it != series_index_.end())
+    return it->second;
+  // Named destinations are bounded, the rest of a tuple's share one
+  // series, so a tuple dialing per connection cannot grow scrapes forever.
+  std::string name(dst);
+  std::string index_key = key;
+  if (series_.size() >= kMaxDestinations) {
+    named = false;
+    name = "other";
+    index_key = std::to_string(tuple) + " other";
+    it = series_index_.find(index_key);
+    if (it != series_index_.end())
+      return it->second;
+  }
+  uint32_t id = series_.size();
+  series_.push_back({tuple, name});
+  series_index_.emplace(index_key, id);
+  return id;
+}
+
+int64_t Metrics::sum(const Snapshot &snap, size_t i) {
+  int64_t total = 0;
+  for (const Shard *s : snap.shards)
+    total += s->lines_[i / 8].v[i % 8].load(std::memory_order_relaxed);
+  return total;
+}
+
+static void append_label(std::string &out, const std::string &value) {
+  for (char c : value) {
+    if (c == '\\' || c == '"')
+      out.push_back('\\');
+    if (c == '\n') {
+      out.append("\\n");
+      continue;
+    }
+    out.push_back(c);
+  }
+}
+
+// Microseconds \p us as seconds.
+static void append_seconds(std::string &out, int64_t us) {
+  char s[32];
+  snprintf(s, sizeof(s), "%s%" PRId64 ".%06" PRId64, us < 0 ? "-" : "",
+           std::abs(us) / 1000000, std::abs(us) % 1000000);
+  out.append(s);
+}
+
+std::string Metrics::scrape() {
+  struct Family {
+    const char *name;
+    const char *type;
+    const char *help;
+    bool micros; // counted in microseconds, shown in seconds
+  };
+  static const Family families[kTupleMetricCount] = {
+      {"mux_connections_active", "gauge", "Relays running.", false},
+      {"mux_accepts_total", "counter", "Connections accepted.", false},
+      {"mux_connect_failures_total", "counter",
+       "Upstream connects that failed.", false},
+      {"mux_bytes_in_total", "counter", "Bytes read from clients.", false},
+      {"mux_bytes_out_total", "counter", "Bytes written to clients.", false},
+      {"mux_client_retransmits_total", "counter",
+       "Segments retransmitted to clients of sampled relays.", false},
+      {"mux_server_retransmits_total", "counter",
+       "Segments retransmitted upstream by sampled relays.", false},
+      {"mux_client_busy_seconds_total", "counter",
+       "Time sampled relays had data in flight to clients.", true},
+      {"mux_server_busy_seconds_total", "counter",
+       "Time sampled relays had data in flight upstream.", true},
+      {"mux_client_rwnd_limited_seconds_total", "counter",
+       "Time sampled relays waited for the client receive window.", true},
+      {"mux_server_rwnd_limited_seconds_total", "counter",
+       "Time sampled relays waited for the upstream receive window.", true},
+  };
+  static const char *tiers[kBufferTierCount] = {"initial", "1k", "4k", "16k",
+                                                "64k"};
+
+  // Shards are never freed and tuples are fixed once counting started, so
+  // only the lists are copied.
+  Snapshot snap;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &s : shards_)
+      snap.shards.push_back(s.get());
+    snap.series = series_;
+  }
+  std::string out;
+  for (int m = 0; m < kTupleMetricCount; m++) {
+    const Family &f = families[m];
+    out.append("# HELP ").append(f.name).append(" ").append(f.help);
+    out.append("\n# TYPE ").append(f.name).append(" ").append(f.type);
+    out.append("\n");
+    for (size_t t = 0; t < tuples_.size(); t++) {
+      out.append(f.name).append("{tuple=\"");
+      append_label(out, tuples_[t]);
+      out.append("\"} ");
+      int64_t v = sum(snap, t * kTupleMetricCount + m);
+      if (f.micros)
+        append_seconds(out, v);
+      else
+        out.append(std::to_string(v));
+      out.append("\n");
+    }
+  }
+  for (int m = 0; m < kLatencyMetricCount; m++)
+    scrape_latency(out, snap, static_cast<LatencyMetric>(m));
+  out.append("# HELP mux_relay_buffers Relay buffers by capacity tier.\n");
+  out.append("# TYPE mux_relay_buffers gauge\n");
+  for (int t = 0; t < kBufferTierCount; t++) {
+    out.append("mux_relay_buffers{tier=\"").append(tiers[t]).append("\"} ");
+    out.append(
+        std::to_string(sum(snap, tuple_count_ * kTupleMetricCount + t)));
+    out.append("\n");
+  }
+  return out;
+}
+
+void Metrics::scrape_latency(std::string &out, const Snapshot &snap,
+                             LatencyMetric metric) {
+  struct Family {
+    const char *name;
+    const char *help;
+  };
+  static const Family families[kLatencyMetricCount] = {
+      {"mux_connect_seconds", "Accepted to upstream connected."},
+      {"mux_first_byte_seconds", "Upstream connected to its first byte."},
+      {"mux_upstream_write_seconds", "Writes of one chunk upstream."},
+      {"mux_client_write_seconds", "Writes of one chunk to the client."},
+      {"mux_client_rtt_seconds", "Client RTT of sampled relays."},
+      {"mux_server_rtt_seconds", "Upstream RTT of sampled relays."},
+  };
+  static const std::vector<std::string> bounds = [] {
+    std::vector<std::string> b;
+    char s[32];
+    for (int i = 0; i < LatencyBuckets::kCount; i++) {
+      uint64_t us = LatencyBuckets::upper(i);
+      snprintf(s, sizeof(s), "%" PRIu64 ".%06" PRIu64, us / 1000000,
+               us % 1000000);
+      b.push_back(s);
+    }
+    b.push_back("+Inf");
+    return b;
+  }();
+
+  const Family &f = families[metric];
+  out.append("# HELP ").append(f.name).append(" ").append(f.help);
+  out.append("\n# TYPE ").append(f.name).append(" histogram\n");
+  int64_t buckets[LatencyBuckets::kCount + 1];
+  for (size_t id = 0; id < snap.series.size(); id++) {
+    std::fill(std::begin(buckets), std::end(buckets), 0);
+    int64_t sum_us = 0;
+    for (const Shard *s : snap.shards) {
+      const Latencies *l =
+          s->latencies_[id].load(std::memory_order_acquire);
+      if (!l)
+        continue;
+      const Histogram &h = l->h[metric];
+      for (int i = 0; i <= LatencyBuckets::kCount; i++)
+        buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+      sum_us += h.sum_us.load(std::memory_order_relaxed);
+    }
+
+    std::string labels = "tuple=\"";
+    append_label(labels, tuples_[snap.series[id].tuple]);
+    labels.append("\",dst=\"");
+    append_label(labels, snap.series[id].dst);
+    labels.append("\"");
+    int64_t count = 0;
+    for (int i = 0; i <= LatencyBuckets::kCount; i++) {
+      count += buckets[i];
+      out.append(f.name).append("_bucket{").append(labels);
+      out.append(",le=\"").append(bounds[i]).append("\"} ");
+      out.append(std::to_string(count)).append("\n");
+    }
+    out.append(f.name).append("_sum{").append(labels).append("} ");
+    append_seconds(out, sum_us);
+    out.append("\n");
+    out.append(f.name).append("_count{").append(labels).append("} ");
+    out.append(std::to_string(count)).append("\n");
+  }
+}
+
+Metrics &metrics() {
+  static Metrics m;
+  return m;
+}
+
+// Bytes of a request head, more is refused.
+static const size_t kMaxRequestSize = 4096;
+
+namespace {
+/// One scrape, read the request head, answer and close.
+class MetricsSession : public std::enable_shared_from_this<MetricsSession> {
+public:
+  explicit MetricsSession(asio::generic::stream_protocol::socket socket)
+      : socket_(std::move(socket)), request_(kMaxRequestSize) {}
+
+  void start() noexcept {
+    auto self = shared_from_this();
+    asio::async_read_until(socket_, request_, "\r\n\r\n",
+                           [this, self](std::error_code ec, size_t n) {
+                             if (ec)
+                               return;
+                             respond(n);
+                           });
+  }
+
+private:
+  void respond(size_t n) noexcept {
+    std::string head(asio::buffers_begin(request_.data()),
+                     asio::buffers_begin(request_.data()) + n);
+    std::string body;
+    if (head.compare(0, 13, "GET /metrics ") == 0) {
+      body = metrics().scrape();
+      response_ = "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: text/plain; version=0.0.4\r\n";
+    } else {
+      body = "not found\n";
+      response_ = "HTTP/1.0 404 Not Found\r\n"
+                  "Content-Type: text/plain\r\n";
+    }
+    response_.append("Content-Length: ")
+        .append(std::to_string(body.size()))
+        .append("\r\nConnection: close\r\n\r\n")
+        .append(body);
+
+    auto self = shared_from_this();
+    asio::async_write(socket_, asio::buffer(response_),
+                      [this, self](std::error_code ec, size_t) {
+                        socket_.shutdown(asio::socket_base::shutdown_both,
+                                         ec);
+                      });
+  }
+
+  asio::generic::stream_protocol::socket socket_;
+  asio::streambuf request_;
+  std::string response_;
+};
+} // namespace
+
+MetricsServer::MetricsServer(
+    const asio::generic::stream_protocol::endpoint &endpoint, int fd)
+    : acceptor_(context_) {
+  if (fd >= 0) {
+    acceptor_.assign(endpoint.protocol(), fd);
+    return;
+  }
+  acceptor_.open(endpoint.protocol());
+  set_cloexec(acceptor_.native_handle());
+  if (is_inet(endpoint)) {
+    acceptor_.set_option(asio::socket_base::reuse_address(true));
+  } else {
+    // Same as relay listeners, a socket file of a previous run goes.
+    const sockaddr_un *sun =
+        reinterpret_cast<const sockaddr_un *>(endpoint.data());
+    struct stat st;
+    if (sun->sun_path[0] != '\0' && ::stat(sun->sun_path, &st) == 0 &&
+        S_ISSOCK(st.st_mode))
+      ::unlink(sun->sun_path);
+  }
+  acceptor_.bind(endpoint);
+  acceptor_.listen();
+}
+
+MetricsServer::~MetricsServer() {
+  context_.stop();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+void MetricsServer::start() {
+  do_accept();
+  thread_ = std::thread([this]() { context_.run(); });
+}
+
+void MetricsServer::close() noexcept {
+  // The acceptor belongs to the server thread, scrapes being answered
+  // finish and the thread then runs out of work.
+  asio::post(context_, [this]() {
+    std::error_code ec;
+    acceptor_.close(ec);
+  });
+}
+
+void MetricsServer::do_accept() noexcept {
+  acceptor_.async_accept(
+      [this](std::error_code ec, asio::generic::stream_protocol::socket s) {
+        if (ec) {
+          if (ec == asio::error::operation_aborted)
+            return;
+          LOG_ERROR("Fail to accept metrics conn", KV("error", ec.message()));
+        } else {
+          std::make_shared<MetricsSession>(std::move(s))->start();
+        }
+        do_accept();
+      });
+}
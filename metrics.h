@@ -0,0 +1,242 @@
+//===- metrics.h - Relay metrics --------------------------------*- C++ -*-===//
+//
+/// \file
+/// Per-thread relay counters and latency histograms summed up when scraped,
+/// and the HTTP endpoint serving them in the Prometheus text format.
+//
+// Author:  zxh
+// Date:    2026/10/17 23:56:08
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <asio/basic_socket_acceptor.hpp>
+#include <asio/generic/stream_protocol.hpp>
+#include <asio/io_context.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+enum TupleMetric : int {
+  kMetricActive,          // relays running, a gauge
+  kMetricAccepts,         // connections accepted
+  kMetricConnectFailures, // upstream connects that failed
+  kMetricBytesIn,         // read from clients
+  kMetricBytesOut,        // written to clients
+  // TCP_INFO of sampled relays, a client entry is followed by its server
+  // one. Times are in microseconds.
+  kMetricClientRetransmits,
+  kMetricServerRetransmits,
+  kMetricClientBusy,
+  kMetricServerBusy,
+  kMetricClientRwndLimited,
+  kMetricServerRwndLimited,
+  kTupleMetricCount,
+};
+
+/// Capacity tiers relay buffers grow through.
+enum BufferTier : int {
+  kBufferTierInitial, // as made, below 1k
+  kBufferTier1k,
+  kBufferTier4k,
+  kBufferTier16k,
+  kBufferTier64k,
+  kBufferTierCount,
+};
+
+/// Latencies kept per tuple and destination.
+enum LatencyMetric : int {
+  kLatencyConnect,       // accepted to upstream connected
+  kLatencyFirstByte,     // upstream connected to its first byte
+  kLatencyUpstreamWrite, // one chunk written upstream
+  kLatencyClientWrite,   // one chunk written to the client
+  kLatencyClientRtt,     // TCP_INFO of sampled relays
+  kLatencyServerRtt,
+  kLatencyMetricCount,
+};
+
+/// Log latency buckets in microseconds, one per power of two up to 2^27us,
+/// about 134s. kSubBits splits each power of two HDR style, kept at 0 as
+/// every bucket costs memory in each thread and a line per series in a
+/// scrape. Longer latencies only count in +Inf.
+struct LatencyBuckets {
+  static const int kSubBits = 0;
+  static const int kMaxShift = 27;
+  static const int kCount = (kMaxShift - kSubBits + 1) << kSubBits;
+
+  /// Bucket of \p us, kCount if beyond the last one.
+  static int index(uint64_t us) noexcept {
+    if (us < (1u << kSubBits))
+      return static_cast<int>(us);
+    int shift = 63 - __builtin_clzll(us) - kSubBits;
+    if (shift >= kMaxShift - kSubBits)
+      return kCount;
+    return ((shift + 1) << kSubBits) + static_cast<int>(us >> shift) -
+           (1 << kSubBits);
+  }
+
+  /// Exclusive upper bound of bucket \p i in microseconds.
+  static uint64_t upper(int i) noexcept {
+    if (i < (1 << kSubBits))
+      return i + 1;
+    int shift = (i >> kSubBits) - 1;
+    return (uint64_t((i & ((1 << kSubBits) - 1)) + (1 << kSubBits)) + 1)
+           << shift;
+  }
+};
+
+/// Relay counters of the process, see metrics(). Each thread adds to a
+/// shard of its own with a plain load and store, shards are whole cache
+/// lines. A scrape sums them up, so counting never takes a lock or an
+/// atomic read-modify-write on a line another thread writes. Latency
+/// histograms are kept the same way, per thread and series.
+class Metrics {
+public:
+  /// Register a tuple named \p name, returns the index add() takes. Throws
+  /// std::logic_error once a thread counted.
+  size_t add_tuple(const std::string &name);
+
+  void add(size_t tuple, TupleMetric metric, int64_t n) noexcept {
+    bump(tuple * kTupleMetricCount + metric, n);
+  }
+
+  /// Buffer gauges, a buffer counts in the tier of its capacity.
+  void add_buffer(BufferTier tier, int64_t n) noexcept {
+    bump(tuple_count_ * kTupleMetricCount + tier, n);
+  }
+
+  /// Latency series of \p tuple and the destination \p dst, for observe().
+  /// Past kMaxDestinations named ones the tuple's series "other" is given.
+  /// Named series are cached in a table of the calling thread, the shared
+  /// table is locked for others and for destinations new to the thread.
+  uint32_t series(size_t tuple, std::string_view dst);
+
+  void observe(uint32_t series, LatencyMetric metric,
+               std::chrono::nanoseconds d) noexcept {
+    uint64_t us = d.count() > 0 ? d.count() / 1000 : 0;
+    Histogram &h = latencies(series).h[metric];
+    bump(h.buckets[LatencyBuckets::index(us)], 1);
+    bump(h.sum_us, us);
+  }
+
+  /// All metrics in the Prometheus text format.
+  std::string scrape();
+
+  static const size_t kMaxDestinations = 256;
+
+private:
+  struct alignas(64) Line {
+    std::atomic<int64_t> v[8];
+  };
+
+  struct Histogram {
+    std::atomic<int64_t> buckets[LatencyBuckets::kCount + 1]; // last is +Inf
+    std::atomic<int64_t> sum_us;
+  };
+
+  struct alignas(64) Latencies {
+    Histogram h[kLatencyMetricCount];
+  };
+
+  struct Shard {
+    Shard(size_t n, size_t series)
+        : lines_(new Line[(n + 7) / 8]()),
+          latencies_(new std::atomic<Latencies *>[series]()) {}
+    std::unique_ptr<Line[]> lines_;
+    // Made by the owning thread when it first observes a series.
+    std::unique_ptr<std::atomic<Latencies *>[]> latencies_;
+    // "tuple dst" to named series, read and written by the owning thread
+    // only, so at most kMaxDestinations entries.
+    std::unordered_map<std::string, uint32_t> series_;
+  };
+
+  struct Series {
+    size_t tuple;
+    std::string dst;
+  };
+
+  static void bump(std::atomic<int64_t> &v, int64_t n) noexcept {
+    v.store(v.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+  }
+
+  void bump(size_t i, int64_t n) noexcept {
+    bump(shard().lines_[i / 8].v[i % 8], n);
+  }
+
+  Latencies &latencies(uint32_t series) noexcept {
+    std::atomic<Latencies *> &slot = shard().latencies_[series];
+    Latencies *l = slot.load(std::memory_order_relaxed);
+    if (!l) {
+      l = new Latencies();
+      slot.store(l, std::memory_order_release);
+    }
+    return *l;
+  }
+
+  Shard &shard() noexcept {
+    static thread_local Shard *local = nullptr;
+    if (!local)
+      local = new_shard();
+    return *local;
+  }
+
+  /// What a scrape reads, copied under mutex_ so formatting holds no lock.
+  struct Snapshot {
+    std::vector<const Shard *> shards;
+    std::vector<Series> series;
+  };
+
+  Shard *new_shard();
+  static int64_t sum(const Snapshot &snap, size_t i);
+  uint32_t add_series(const std::string &key, size_t tuple,
+                      std::string_view dst, bool &named);
+  void scrape_latency(std::string &out, const Snapshot &snap,
+                      LatencyMetric metric);
+
+  std::mutex mutex_;
+  std::vector<std::string> tuples_;
+  size_t tuple_count_ = 0; // tuples_.size() once frozen
+  bool frozen_ = false;
+  std::vector<std::unique_ptr<Shard>> shards_; // never freed, threads hold them
+  std::vector<Series> series_;
+  std::unordered_map<std::string, uint32_t> series_index_; // by "tuple dst"
+};
+
+Metrics &metrics();
+
+/// Serves metrics() on GET /metrics over HTTP/1.0, from a TCP or unix
+/// socket. Runs a thread of its own, formatting a scrape never holds up a
+/// relay context.
+class MetricsServer {
+public:
+  /// Listen on \p endpoint, or on \p fd if not -1, a listener passed by a
+  /// predecessor. Throws std::system_error on failure.
+  MetricsServer(const asio::generic::stream_protocol::endpoint &endpoint,
+                int fd = -1);
+
+  ~MetricsServer();
+
+  /// Start the thread serving scrapes.
+  void start();
+
+  int native_handle() { return acceptor_.native_handle(); }
+
+  /// Stop serving, a draining process leaves scrapes to its successor.
+  void close() noexcept;
+
+private:
+  void do_accept() noexcept;
+
+  asio::io_context context_;
+  asio::basic_socket_acceptor<asio::generic::stream_protocol> acceptor_;
+  std::thread thread_;
+};
@@ -10,12 +10,237 @@
 #include "netutil.h"
 #include "errors.h"
 
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6/ip6_tables.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <cstring>
+
+EndpointText::EndpointText(const asio::ip::tcp::endpoint &endpoint) {
+  format(endpoint.data(), endpoint.size());
+}
+
+EndpointText::EndpointText(const asio::ip::udp::endpoint &endpoint) {
+  format(endpoint.data(), endpoint.size());
+}
+
+EndpointText::EndpointText(
+    const asio::generic::stream_protocol::endpoint &endpoint) {
+  format(endpoint.data(), endpoint.size());
+}
+
+void EndpointText::append(std::string_view s) {
+  size_t n = std::min(s.size(), kCapacity - size_);
+  std::memcpy(data_ + size_, s.data(), n);
+  size_ += n;
+}
+
+// Digits of v at p, returns the end.
+static char *put_uint(char *p, uint32_t v) {
+  char tmp[10];
+  int n = 0;
+  do {
+    tmp[n++] = char('0' + v % 10);
+    v /= 10;
+  } while (v);
+  while (n)
+    *p++ = tmp[--n];
+  return p;
+}
+
+// Text of an IPv6 address as glibc's inet_ntop gives it, the first longest
+// run of two or more zero groups is "::", v4 mapped and compatible
+// addresses end in dotted quads.
+static char *put_ipv6(char *p, const in6_addr &addr) {
+  static const char hex[] = "0123456789abcdef";
+  const uint8_t *b = addr.s6_addr;
+  uint16_t words[8];
+  for (int i = 0; i < 8; i++)
+    words[i] = uint16_t(b[2 * i] << 8 | b[2 * i + 1]);
+
+  int best = -1, best_len = 0;
+  for (int i = 0; i < 8;) {
+    if (words[i] != 0) {
+      i++;
+      continue;
+    }
+    int j = i;
+    while (j < 8 && words[j] == 0)
+      j++;
+    if (j - i > best_len) {
+      best = i;
+      best_len = j - i;
+    }
+    i = j;
+  }
+  if (best_len < 2)
+    best = -1;
+
+  for (int i = 0; i < 8; i++) {
+    if (i == best) {
+      *p++ = ':';
+      i += best_len - 1;
+      if (i == 7)
+        *p++ = ':';
+      continue;
+    }
+    if (i > 0)
+      *p++ = ':';
+    if (i == 6 && best == 0 &&
+        (best_len == 6 || (best_len == 5 && words[5] == 0xffff))) {
+      for (int k = 12; k < 16; k++) {
+        p = put_uint(p, b[k]);
+        if (k < 15)
+          *p++ = '.';
+      }
+      break;
+    }
+    uint16_t w = words[i];
+    int shift = 12;
+    while (shift > 0 && (w >> shift) == 0)
+      shift -= 4;
+    for (; shift >= 0; shift -= 4)
+      *p++ = hex[(w >> shift) & 0xf];
+  }
+  return p;
+}
+
+// Same text as asio's operator<<, ip:port and [ip]:port, a v6 scope by
+// interface name when link local, else by number.
+void EndpointText::format(const sockaddr *addr, size_t len) {
+  size_ = 0;
+  char buf[INET6_ADDRSTRLEN + IF_NAMESIZE + 16];
+  char *p = buf;
+  if (addr->sa_family == AF_INET && len >= sizeof(sockaddr_in)) {
+    const sockaddr_in *sin = reinterpret_cast<const sockaddr_in *>(addr);
+    const uint8_t *ip = reinterpret_cast<const uint8_t *>(&sin->sin_addr);
+    for (int i = 0; i < 4; i++) {
+      p = put_uint(p, ip[i]);
+      *p++ = i < 3 ? '.' : ':';
+    }
+    p = put_uint(p, ntohs(sin->sin_port));
+  } else if (addr->sa_family == AF_INET6 && len >= sizeof(sockaddr_in6)) {
+    const sockaddr_in6 *sin6 = reinterpret_cast<const sockaddr_in6 *>(addr);
+    *p++ = '[';
+    p = put_ipv6(p, sin6->sin6_addr);
+    if (uint32_t scope = sin6->sin6_scope_id) {
+      *p++ = '%';
+      if (!IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr) ||
+          !if_indextoname(scope, p))
+        p = put_uint(p, scope);
+      else
+        p += std::strlen(p);
+    }
+    *p++ = ']';
+    *p++ = ':';
+    p = put_uint(p, ntohs(sin6->sin6_port));
+  } else if (addr->sa_family == AF_UNIX) {
+    const sockaddr_un *sun = reinterpret_cast<const sockaddr_un *>(addr);
+    size_t off = offsetof(sockaddr_un, sun_path);
+    size_t n = len > off ? len - off : 0;
+    append("unix:");
+    if (n == 0)
+      return; // unnamed, e.g. the client end of a unix connection
+    if (sun->sun_path[0] == '\0') {
+      append("@");
+      append(std::string_view(sun->sun_path + 1, n - 1));
+    } else {
+      append(std::string_view(sun->sun_path, strnlen(sun->sun_path, n)));
+    }
+    return;
+  } else {
+    append("unspec");
+    return;
+  }
+  append(std::string_view(buf, p - buf));
+}
 
 std::string to_string(const asio::ip::tcp::endpoint &endpoint) {
-  std::stringstream ss;
-  ss << endpoint;
-  return ss.str();
+  return std::string(EndpointText(endpoint).view());
+}
+
+std::string to_string(const asio::ip::udp::endpoint &endpoint) {
+  return std::string(EndpointText(endpoint).view());
+}
+
+std::string
+to_string(const asio::generic::stream_protocol::endpoint &endpoint) {
+  return std::string(EndpointText(endpoint).view());
+}
+
+bool is_inet(const asio::generic::stream_protocol::endpoint &endpoint) {
+  int family = endpoint.data()->sa_family;
+  return family == AF_INET || family == AF_INET6;
+}
+
+bool is_unix(const asio::generic::stream_protocol::endpoint &endpoint) {
+  return endpoint.data()->sa_family == AF_UNIX;
+}
+
+asio::ip::tcp::endpoint
+to_tcp(const asio::generic::stream_protocol::endpoint &endpoint) {
+  asio::ip::tcp::endpoint ep;
+  if (!is_inet(endpoint) || endpoint.size() > ep.capacity())
+    return ep;
+  std::memcpy(ep.data(), endpoint.data(), endpoint.size());
+  ep.resize(endpoint.size());
+  return ep;
+}
+
+asio::generic::stream_protocol::endpoint
+make_unix_endpoint(const std::string &path, std::error_code &ec) {
+  sockaddr_un sun;
+  std::memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(sun.sun_path)) {
+    ec = std::error_code(AddrErrInvalidUnixPath, address_category());
+    return {};
+  }
+
+  size_t len = path.size();
+  std::memcpy(sun.sun_path, path.data(), len);
+  if (path[0] == '@')
+    sun.sun_path[0] = '\0'; // abstract names aren't NUL terminated
+  else
+    len++;
+
+  ec = std::error_code();
+  return asio::generic::stream_protocol::endpoint(
+      &sun, offsetof(sockaddr_un, sun_path) + len);
+}
+
+asio::ip::tcp::endpoint original_dst(int fd, bool v6, std::error_code &ec) {
+  asio::ip::tcp::endpoint ep;
+  socklen_t len = ep.capacity();
+  int r = v6 ? ::getsockopt(fd, SOL_IPV6, IP6T_SO_ORIGINAL_DST, ep.data(), &len)
+             : ::getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, ep.data(), &len);
+  if (r < 0) {
+    ec = std::error_code(errno, std::system_category());
+    return {};
+  }
+  ep.resize(len);
+  ec = std::error_code();
+  return ep;
+}
+
+void set_cloexec(int fd) {
+  int flags = ::fcntl(fd, F_GETFD);
+  if (flags >= 0)
+    ::fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+bool is_local_address(const asio::ip::address &addr) {
+  asio::ip::udp::endpoint ep(addr, 0);
+  int fd = ::socket(ep.data()->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return false;
+  bool local = ::bind(fd, ep.data(), ep.size()) == 0;
+  ::close(fd);
+  return local;
 }
 
 std::pair<std::string, std::string> split_host_port(const std::string &hostport,
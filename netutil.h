@@ -9,10 +9,67 @@
 
 #pragma once
 
+#include <asio/generic/stream_protocol.hpp>
 #include <asio/ip/tcp.hpp>
+#include <asio/ip/udp.hpp>
+#include <string_view>
 #include <system_error>
 
+/// An endpoint formatted as to_string() does, into its own fixed buffer
+/// without allocating. Converts to std::string_view, so it goes straight
+/// into log fields.
+class EndpointText {
+public:
+  EndpointText() = default;
+  explicit EndpointText(const asio::ip::tcp::endpoint &endpoint);
+  explicit EndpointText(const asio::ip::udp::endpoint &endpoint);
+  explicit EndpointText(
+      const asio::generic::stream_protocol::endpoint &endpoint);
+
+  std::string_view view() const { return std::string_view(data_, size_); }
+  operator std::string_view() const { return view(); }
+
+private:
+  void format(const sockaddr *addr, size_t len);
+  void append(std::string_view s);
+
+  // "unix:" and a full sun_path, longer than any [v6%scope]:port.
+  static const size_t kCapacity = 116;
+
+  char data_[kCapacity];
+  uint8_t size_ = 0;
+};
+
 std::string to_string(const asio::ip::tcp::endpoint &endpoint);
 
+std::string to_string(const asio::ip::udp::endpoint &endpoint);
+
+/// Format inet endpoints as ip:port and unix ones as unix:path, abstract
+/// names as unix:@name.
+std::string to_string(const asio::generic::stream_protocol::endpoint &endpoint);
+
+bool is_inet(const asio::generic::stream_protocol::endpoint &endpoint);
+
+bool is_unix(const asio::generic::stream_protocol::endpoint &endpoint);
+
+/// The inet address of \p endpoint, unspecified with port 0 for other
+/// families.
+asio::ip::tcp::endpoint
+to_tcp(const asio::generic::stream_protocol::endpoint &endpoint);
+
+/// Unix socket endpoint for \p path, a leading '@' names an abstract socket.
+asio::generic::stream_protocol::endpoint
+make_unix_endpoint(const std::string &path, std::error_code &ec);
+
+/// Destination of a connection before an iptables/nftables REDIRECT or
+/// DNAT, from SO_ORIGINAL_DST.
+asio::ip::tcp::endpoint original_dst(int fd, bool v6, std::error_code &ec);
+
+/// Keep \p fd from processes this one execs.
+void set_cloexec(int fd);
+
+/// Whether \p addr is assigned to this host, probed by binding to it.
+bool is_local_address(const asio::ip::address &addr);
+
 std::pair<std::string, std::string> split_host_port(const std::string &hostport,
                                                     std::error_code &ec);
@@ -0,0 +1,353 @@
+//===- proxy_protocol.cpp - PROXY protocol ----------------------*- C++ -*-===//
+//
+/// \file
+/// HAProxy PROXY protocol v1/v2 header encoding and parsing.
+//
+// Author:  zxh
+// Date:    2026/10/16 09:14:05
+//===----------------------------------------------------------------------===//
+
+#include "proxy_protocol.h"
+#include "errors.h"
+
+#include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <string_view>
+
+using asio::ip::tcp;
+
+// Both ends of a header must share one family, so mixed pairs are promoted
+// to IPv6 with v4-mapped addresses.
+static asio::ip::address_v6 to_v6(const asio::ip::address &addr) {
+  if (addr.is_v6())
+    return addr.to_v6();
+  return asio::ip::make_address_v6(asio::ip::v4_mapped, addr.to_v4());
+}
+
+static char *append(char *p, const char *s, size_t n) {
+  std::memcpy(p, s, n);
+  return p + n;
+}
+
+template <size_t N>
+static char *append(char *p, const char (&s)[N]) {
+  return append(p, s, N - 1);
+}
+
+static char *append_addr(char *p, char *end, const asio::ip::address &addr) {
+  if (addr.is_v4()) {
+    auto bytes = addr.to_v4().to_bytes();
+    if (!::inet_ntop(AF_INET, bytes.data(), p, end - p))
+      return p;
+  } else {
+    auto bytes = addr.to_v6().to_bytes();
+    if (!::inet_ntop(AF_INET6, bytes.data(), p, end - p))
+      return p;
+  }
+  return p + std::strlen(p);
+}
+
+static char *append_port(char *p, char *end, uint16_t port) {
+  return std::to_chars(p, end, port).ptr;
+}
+
+void ProxyHeader::build(ProxyProtocolVersion version, const tcp::endpoint &src,
+                        const tcp::endpoint &dst) noexcept {
+  switch (version) {
+  case kProxyV1:
+    build_v1(src, dst);
+    break;
+  case kProxyV2:
+    build_v2(src, dst);
+    break;
+  default:
+    size_ = 0;
+    break;
+  }
+}
+
+void ProxyHeader::build_v1(const tcp::endpoint &src,
+                           const tcp::endpoint &dst) noexcept {
+  char *p = data_.data();
+  char *end = p + data_.size();
+
+  asio::ip::address saddr = src.address();
+  asio::ip::address daddr = dst.address();
+  if (saddr.is_v4() && daddr.is_v4()) {
+    p = append(p, "PROXY TCP4 ");
+  } else {
+    saddr = to_v6(saddr);
+    daddr = to_v6(daddr);
+    p = append(p, "PROXY TCP6 ");
+  }
+
+  p = append_addr(p, end, saddr);
+  *p++ = ' ';
+  p = append_addr(p, end, daddr);
+  *p++ = ' ';
+  p = append_port(p, end, src.port());
+  *p++ = ' ';
+  p = append_port(p, end, dst.port());
+  p = append(p, "\r\n");
+  size_ = p - data_.data();
+}
+
+void ProxyHeader::build_v2(const tcp::endpoint &src,
+                           const tcp::endpoint &dst) noexcept {
+  uint8_t *p = reinterpret_cast<uint8_t *>(data_.data());
+  std::memcpy(p, kProxyV2Signature, sizeof(kProxyV2Signature));
+  p[12] = 0x21; // version 2, PROXY command
+
+  uint16_t addr_len;
+  if (src.address().is_v4() && dst.address().is_v4()) {
+    p[13] = 0x11; // AF_INET, STREAM
+    addr_len = 12;
+    auto sb = src.address().to_v4().to_bytes();
+    auto db = dst.address().to_v4().to_bytes();
+    std::memcpy(p + 16, sb.data(), 4);
+    std::memcpy(p + 20, db.data(), 4);
+  } else {
+    p[13] = 0x21; // AF_INET6, STREAM
+    addr_len = 36;
+    auto sb = to_v6(src.address()).to_bytes();
+    auto db = to_v6(dst.address()).to_bytes();
+    std::memcpy(p + 16, sb.data(), 16);
+    std::memcpy(p + 32, db.data(), 16);
+  }
+  p[14] = addr_len >> 8;
+  p[15] = addr_len & 0xFF;
+
+  uint8_t *ports = p + 16 + addr_len - 4;
+  ports[0] = src.port() >> 8;
+  ports[1] = src.port() & 0xFF;
+  ports[2] = dst.port() >> 8;
+  ports[3] = dst.port() & 0xFF;
+  size_ = 16 + addr_len;
+}
+
+void ProxyHeader::build_unknown(ProxyProtocolVersion version) noexcept {
+  switch (version) {
+  case kProxyV1:
+    size_ = append(data_.data(), "PROXY UNKNOWN\r\n") - data_.data();
+    break;
+  case kProxyV2: {
+    uint8_t *p = reinterpret_cast<uint8_t *>(data_.data());
+    std::memcpy(p, kProxyV2Signature, sizeof(kProxyV2Signature));
+    p[12] = 0x21; // version 2, PROXY command
+    p[13] = 0x00; // AF_UNSPEC
+    p[14] = 0;
+    p[15] = 0;
+    size_ = 16;
+    break;
+  }
+  default:
+    size_ = 0;
+    break;
+  }
+}
+
+const char *to_string(ProxyProtocolVersion version) {
+  switch (version) {
+  case kProxyV1:
+    return "v1";
+  case kProxyV2:
+    return "v2";
+  case kProxyAny:
+    return "any";
+  default:
+    return "none";
+  }
+}
+
+static size_t fail(std::error_code &ec, ProxyProtocolErrors err) {
+  ec = std::error_code(err, proxy_protocol_category());
+  return 0;
+}
+
+// A load balancer writes the whole header at once, so the first read almost
+// always has 16 bytes and the signature is checked with a single compare.
+static bool match_v2_signature(const char *data, size_t n) {
+#ifdef __SSE2__
+  if (n >= 16) {
+    static const uint8_t sig[16] = {0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D,
+                                    0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A};
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sig));
+    return (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0x0FFF) == 0x0FFF;
+  }
+#endif
+  return std::memcmp(data, kProxyV2Signature,
+                     std::min(n, sizeof(kProxyV2Signature))) == 0;
+}
+
+static uint16_t be16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+static size_t parse_v2(const char *data, size_t n, ProxyAddrs &addrs,
+                       std::error_code &ec) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+  if (!match_v2_signature(data, n))
+    return fail(ec, ProxyErrBadSignature);
+  if (n < 16)
+    return fail(ec, ProxyErrIncomplete);
+  if ((p[12] & 0xF0) != 0x20)
+    return fail(ec, ProxyErrBadVersion);
+
+  size_t len = be16(p + 14);
+  size_t total = 16 + len;
+  if (total > kProxyMaxParseSize)
+    return fail(ec, ProxyErrHeaderTooLong);
+  if (n < total)
+    return fail(ec, ProxyErrIncomplete);
+
+  uint8_t cmd = p[12] & 0x0F;
+  if (cmd == 0x00) { // LOCAL
+    addrs.proxied = false;
+    return total;
+  }
+  if (cmd != 0x01)
+    return fail(ec, ProxyErrBadVersion);
+
+  const uint8_t *a = p + 16;
+  switch (p[13]) {
+  case 0x11: { // TCP over IPv4
+    if (len < 12)
+      return fail(ec, ProxyErrBadAddress);
+    asio::ip::address_v4::bytes_type sb, db;
+    std::memcpy(sb.data(), a, 4);
+    std::memcpy(db.data(), a + 4, 4);
+    addrs.src = tcp::endpoint(asio::ip::address_v4(sb), be16(a + 8));
+    addrs.dst = tcp::endpoint(asio::ip::address_v4(db), be16(a + 10));
+    break;
+  }
+  case 0x21: { // TCP over IPv6
+    if (len < 36)
+      return fail(ec, ProxyErrBadAddress);
+    asio::ip::address_v6::bytes_type sb, db;
+    std::memcpy(sb.data(), a, 16);
+    std::memcpy(db.data(), a + 16, 16);
+    addrs.src = tcp::endpoint(asio::ip::address_v6(sb), be16(a + 32));
+    addrs.dst = tcp::endpoint(asio::ip::address_v6(db), be16(a + 34));
+    break;
+  }
+  default: // UNSPEC, UDP and unix sockets carry nothing we can use
+    addrs.proxied = false;
+    return total;
+  }
+  addrs.proxied = true;
+  return total;
+}
+
+static bool parse_v1_addr(std::string_view s, int family,
+                          asio::ip::address &addr) {
+  char buf[INET6_ADDRSTRLEN];
+  if (s.empty() || s.size() >= sizeof(buf))
+    return false;
+  std::memcpy(buf, s.data(), s.size());
+  buf[s.size()] = '\0';
+
+  if (family == AF_INET) {
+    asio::ip::address_v4::bytes_type b;
+    if (::inet_pton(AF_INET, buf, b.data()) != 1)
+      return false;
+    addr = asio::ip::address_v4(b);
+  } else {
+    asio::ip::address_v6::bytes_type b;
+    if (::inet_pton(AF_INET6, buf, b.data()) != 1)
+      return false;
+    addr = asio::ip::address_v6(b);
+  }
+  return true;
+}
+
+static bool parse_v1_port(std::string_view s, uint16_t &port) {
+  if (s.empty() || s.size() > 5)
+    return false;
+  unsigned v;
+  auto r = std::from_chars(s.data(), s.data() + s.size(), v);
+  if (r.ec != std::errc() || r.ptr != s.data() + s.size() || v > 65535)
+    return false;
+  port = v;
+  return true;
+}
+
+static size_t parse_v1(const char *data, size_t n, ProxyAddrs &addrs,
+                       std::error_code &ec) {
+  const size_t kMaxLine = 107;
+  if (std::memcmp(data, "PROXY ", std::min(n, size_t(6))) != 0)
+    return fail(ec, ProxyErrBadSignature);
+
+  const char *nl = static_cast<const char *>(
+      std::memchr(data, '\n', std::min(n, kMaxLine)));
+  if (!nl) {
+    if (n >= kMaxLine)
+      return fail(ec, ProxyErrHeaderTooLong);
+    return fail(ec, ProxyErrIncomplete);
+  }
+  if (nl - data < 7 || nl[-1] != '\r')
+    return fail(ec, ProxyErrBadAddress);
+  size_t total = nl - data + 1;
+
+  // PROXY <proto> <src> <dst> <sport> <dport>
+  std::string_view line(data + 6, nl - 1 - (data + 6));
+  std::string_view tokens[5];
+  size_t ntokens = 0;
+  while (!line.empty() && ntokens < 5) {
+    size_t sp = line.find(' ');
+    tokens[ntokens++] = line.substr(0, sp);
+    line = sp == std::string_view::npos ? std::string_view()
+                                        : line.substr(sp + 1);
+  }
+
+  if (ntokens >= 1 && tokens[0] == "UNKNOWN") {
+    addrs.proxied = false;
+    return total;
+  }
+  if (ntokens != 5 || !line.empty())
+    return fail(ec, ProxyErrBadAddress);
+
+  int family;
+  if (tokens[0] == "TCP4")
+    family = AF_INET;
+  else if (tokens[0] == "TCP6")
+    family = AF_INET6;
+  else
+    return fail(ec, ProxyErrBadVersion);
+
+  asio::ip::address saddr, daddr;
+  uint16_t sport, dport;
+  if (!parse_v1_addr(tokens[1], family, saddr) ||
+      !parse_v1_addr(tokens[2], family, daddr) ||
+      !parse_v1_port(tokens[3], sport) || !parse_v1_port(tokens[4], dport))
+    return fail(ec, ProxyErrBadAddress);
+
+  addrs.src = tcp::endpoint(saddr, sport);
+  addrs.dst = tcp::endpoint(daddr, dport);
+  addrs.proxied = true;
+  return total;
+}
+
+size_t parse_proxy_header(const char *data, size_t n,
+                          ProxyProtocolVersion accept, ProxyAddrs &addrs,
+                          std::error_code &ec) noexcept {
+  ec = std::error_code();
+  if (n == 0)
+    return fail(ec, ProxyErrIncomplete);
+
+  if (data[0] == '\r') {
+    if (accept == kProxyV1)
+      return fail(ec, ProxyErrVersionNotAllowed);
+    return parse_v2(data, n, addrs, ec);
+  }
+  if (data[0] == 'P') {
+    if (accept == kProxyV2)
+      return fail(ec, ProxyErrVersionNotAllowed);
+    return parse_v1(data, n, addrs, ec);
+  }
+  return fail(ec, ProxyErrBadSignature);
+}
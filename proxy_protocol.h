@@ -0,0 +1,84 @@
+//===- proxy_protocol.h - PROXY protocol ------------------------*- C++ -*-===//
+//
+/// \file
+/// HAProxy PROXY protocol v1/v2 header encoding and parsing.
+//
+// Author:  zxh
+// Date:    2026/10/16 09:12:40
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <system_error>
+
+#include <asio/ip/tcp.hpp>
+
+enum ProxyProtocolVersion : int {
+  kProxyNone = 0,
+  kProxyV1 = 1,
+  kProxyV2 = 2,
+  kProxyAny = 3, // accept side only
+};
+
+// "\r\n\r\n\0\r\nQUIT\n"
+const uint8_t kProxyV2Signature[12] = {0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D,
+                                       0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A};
+
+/// Fixed size PROXY protocol header, built once per connection and sent in
+/// front of the first upstream payload.
+class ProxyHeader {
+public:
+  // The longest v1 line is "PROXY TCP6 <39> <39> 65535 65535\r\n" (107 bytes),
+  // the longest inet v2 header is 16 + 36 bytes.
+  static constexpr size_t kMaxSize = 108;
+
+  ProxyHeader() : size_(0) {}
+
+  const char *data() const { return data_.data(); }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  void clear() { size_ = 0; }
+
+  /// Encode a header announcing the connection from \p src to \p dst.
+  void build(ProxyProtocolVersion version,
+             const asio::ip::tcp::endpoint &src,
+             const asio::ip::tcp::endpoint &dst) noexcept;
+
+  /// Encode a header without addresses, for connections that aren't inet
+  /// on both ends. Receivers keep the connection's own addresses.
+  void build_unknown(ProxyProtocolVersion version) noexcept;
+
+private:
+  void build_v1(const asio::ip::tcp::endpoint &src,
+                const asio::ip::tcp::endpoint &dst) noexcept;
+  void build_v2(const asio::ip::tcp::endpoint &src,
+                const asio::ip::tcp::endpoint &dst) noexcept;
+
+  std::array<char, kMaxSize> data_;
+  size_t size_;
+};
+
+const char *to_string(ProxyProtocolVersion version);
+
+/// Addresses carried by an inbound PROXY header. For LOCAL (health check)
+/// headers and unsupported families \c proxied is false and the connection's
+/// own addresses stay in effect.
+struct ProxyAddrs {
+  asio::ip::tcp::endpoint src;
+  asio::ip::tcp::endpoint dst;
+  bool proxied = false;
+};
+
+// A v1 line is at most 107 bytes, v2 allows TLVs after the addresses, refuse
+// anything beyond this.
+const size_t kProxyMaxParseSize = 1024;
+
+/// Parse a PROXY header of an \p accept version at the start of \p data.
+/// Return the header length, or 0 with \p ec set. ProxyErrIncomplete means
+/// more bytes are needed.
+size_t parse_proxy_header(const char *data, size_t n,
+                          ProxyProtocolVersion accept, ProxyAddrs &addrs,
+                          std::error_code &ec) noexcept;
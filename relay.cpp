@@ -8,8 +8,17 @@
 //===----------------------------------------------------------------------===//
 
 #include "relay.h"
+#include "errors.h"
 #include "logrus.h"
 #include "netutil.h"
+#include "tunnel.h"
+#include "udp_relay.h"
+
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include <thread>
 
@@ -17,6 +26,31 @@
 
 using asio::ip::tcp;
 
+using IpTransparent =
+    asio::detail::socket_option::boolean<SOL_IP, IP_TRANSPARENT>;
+using Ipv6Transparent =
+    asio::detail::socket_option::boolean<SOL_IPV6, IPV6_TRANSPARENT>;
+
+const char *to_string(TransparentMode mode) {
+  switch (mode) {
+  case kTransparentRedirect:
+    return "redirect";
+  case kTransparentTproxy:
+    return "tproxy";
+  default:
+    return "none";
+  }
+}
+
+// Allow binding and accepting foreign addresses, needs CAP_NET_ADMIN.
+template <typename Socket>
+static void set_transparent(Socket &sock, int family, std::error_code &ec) {
+  if (family == AF_INET6)
+    sock.set_option(Ipv6Transparent(true), ec);
+  else
+    sock.set_option(IpTransparent(true), ec);
+}
+
 enum StreamBufCapcity : size_t {
   kSmall = 1024,
   kMedium = 1024 * 4,
@@ -24,6 +58,34 @@ enum StreamBufCapcity : size_t {
   kXLarge = 1024 * 64,
 };
 
+static BufferTier tier_of(size_t capacity) {
+  if (capacity < StreamBufCapcity::kSmall)
+    return kBufferTierInitial;
+  if (capacity < StreamBufCapcity::kMedium)
+    return kBufferTier1k;
+  if (capacity < StreamBufCapcity::kLarge)
+    return kBufferTier4k;
+  if (capacity < StreamBufCapcity::kXLarge)
+    return kBufferTier16k;
+  return kBufferTier64k;
+}
+
+RelayBuffer::RelayBuffer(size_t max_size)
+    : asio::streambuf(max_size), tier_(tier_of(capacity())) {
+  metrics().add_buffer(tier_, 1);
+}
+
+RelayBuffer::~RelayBuffer() { metrics().add_buffer(tier_, -1); }
+
+void RelayBuffer::update_tier() noexcept {
+  BufferTier tier = tier_of(capacity());
+  if (tier == tier_)
+    return;
+  metrics().add_buffer(tier_, -1);
+  metrics().add_buffer(tier, 1);
+  tier_ = tier;
+}
+
 static asio::streambuf::mutable_buffers_type
 make_prepare_buf(Relay::SharedBuffer buf, bool need_grow) {
   if (!need_grow)
@@ -39,84 +101,281 @@ make_prepare_buf(Relay::SharedBuffer buf, bool need_grow) {
   else
     new_cap = StreamBufCapcity::kXLarge;
 
-  return buf->prepare(std::min(new_cap, buf->max_size()) - buf->size());
+  auto space = buf->prepare(std::min(new_cap, buf->max_size()) - buf->size());
+  buf->update_tier();
+  return space;
 }
 
-Relay::Relay(tcp::socket client_conn, tcp::socket server_conn,
-             const tcp::endpoint &client_laddr,
-             const tcp::endpoint &client_raddr,
-             const tcp::endpoint &server_laddr,
-             const tcp::endpoint &server_raddr)
+// Client bytes the peek stages may hold back before routing.
+static const size_t kPeekMaxSize =
+    std::max(kTlsMaxPeekSize, kHttpMaxHeaderSize);
+
+static Relay::SharedBuffer make_shared_buf() {
+  return std::make_shared<RelayBuffer>(1024 * 128);
+}
+
+std::atomic<size_t> Relay::live_(0);
+std::atomic<size_t> RelayHandshake::live_(0);
+
+Relay::Relay(RelaySocket client_conn, RelaySocket server_conn,
+             const RelayEndpoint &client_laddr,
+             const RelayEndpoint &client_raddr,
+             const RelayEndpoint &server_laddr,
+             const RelayEndpoint &server_raddr)
     : client_(std::move(client_conn), client_laddr, client_raddr),
       server_(std::move(server_conn), server_laddr, server_raddr),
       start_time_(std::chrono::system_clock::now()) {
-  LOG_INFO("Forward", KV("from", to_string(client_raddr)),
-           KV("via", to_string(client_laddr)),
-           KV("to", to_string(server_raddr)));
+  live_.fetch_add(1, std::memory_order_relaxed);
+  LOG_INFO("Forward", KV("from", client_.raddr_text_),
+           KV("via", client_.laddr_text_),
+           KV("to", server_.raddr_text_));
 }
 
 Relay::~Relay() {
+  live_.fetch_sub(1, std::memory_order_relaxed);
+  if (metered_)
+    metrics().add(metrics_tuple_, kMetricActive, -1);
   auto dur = std::chrono::duration_cast<std::chrono::seconds>(
                  std::chrono::system_clock::now() - start_time_)
                  .count();
-  LOG_INFO("Forward done", KV("from", to_string(client_.raddr_)),
-           KV("via", to_string(client_.laddr_)),
-           KV("to", to_string(server_.raddr_)),
+  if (!tcp_sampled_) {
+    LOG_INFO("Forward done", KV("from", client_.raddr_text_),
+             KV("via", client_.laddr_text_),
+             KV("to", server_.raddr_text_),
+             KV("in_bytes", client_.read_count_),
+             KV("out_bytes", client_.write_count_), KV("dur", dur));
+    return;
+  }
+
+  // Sockets closed on an error keep the sample of the last timer expiry.
+  sample_tcp_info();
+  const TcpSample &c = client_.tcp_info_;
+  const TcpSample &s = server_.tcp_info_;
+  LOG_INFO("Forward done", KV("from", client_.raddr_text_),
+           KV("via", client_.laddr_text_),
+           KV("to", server_.raddr_text_),
            KV("in_bytes", client_.read_count_),
-           KV("out_bytes", client_.write_count_), KV("dur", dur));
+           KV("out_bytes", client_.write_count_), KV("dur", dur),
+           KV("client_rtt_us", c.rtt_us),
+           KV("client_retrans", c.retransmits), KV("client_cwnd", c.cwnd),
+           KV("client_rate", c.delivery_rate),
+           KV("client_busy_us", c.busy_us),
+           KV("client_rwnd_limited_us", c.rwnd_limited_us),
+           KV("server_rtt_us", s.rtt_us),
+           KV("server_retrans", s.retransmits), KV("server_cwnd", s.cwnd),
+           KV("server_rate", s.delivery_rate),
+           KV("server_busy_us", s.busy_us),
+           KV("server_rwnd_limited_us", s.rwnd_limited_us));
+}
+
+void Relay::sample_tcp_info() noexcept {
+  for (RelayConn *conn : {&client_, &server_}) {
+    int fd = conn->conn_.native_handle();
+    if (fd < 0 || !is_inet(conn->raddr_))
+      continue;
+    TcpSample now;
+    std::error_code ec;
+    read_tcp_info(fd, now, ec);
+    if (ec)
+      continue;
+    if (metered_) {
+      // Server entries follow their client ones.
+      int side = conn == &client_ ? 0 : 1;
+      const TcpSample &prev = conn->tcp_info_;
+      Metrics &m = metrics();
+      m.add(metrics_tuple_, TupleMetric(kMetricClientRetransmits + side),
+            int64_t(now.retransmits) - prev.retransmits);
+      m.add(metrics_tuple_, TupleMetric(kMetricClientBusy + side),
+            int64_t(now.busy_us - prev.busy_us));
+      m.add(metrics_tuple_, TupleMetric(kMetricClientRwndLimited + side),
+            int64_t(now.rwnd_limited_us - prev.rwnd_limited_us));
+      m.observe(latency_series_,
+                LatencyMetric(kLatencyClientRtt + side),
+                std::chrono::microseconds(now.rtt_us));
+    }
+    conn->tcp_info_ = now;
+  }
 }
 
-void Relay::start() noexcept {
-  auto client_buf = std::make_shared<asio::streambuf>(1024 * 128);
-  auto server_buf = std::make_shared<asio::streambuf>(1024 * 128);
-  io_copy(client_, server_, client_buf, false);
+void Relay::meter(size_t tuple, uint32_t series,
+                  std::chrono::steady_clock::time_point connected) {
+  metered_ = true;
+  metrics_tuple_ = tuple;
+  latency_series_ = series;
+  connected_ = connected;
+  metrics().add(tuple, kMetricActive, 1);
+}
+
+void Relay::count_read(RelayConn &from, size_t n) noexcept {
+  if (metered_) {
+    if (&from == &client_)
+      metrics().add(metrics_tuple_, kMetricBytesIn, n);
+    else if (from.read_count_ == 0)
+      metrics().observe(latency_series_, kLatencyFirstByte,
+                        std::chrono::steady_clock::now() - connected_);
+  }
+  from.read_count_ += n;
+}
+
+void Relay::start(SharedBuffer client_buf) noexcept {
+  if (!client_buf)
+    client_buf = make_shared_buf();
+  auto server_buf = make_shared_buf();
+  if (!preamble_.empty() || client_buf->size() > 0) {
+    // Client data queued while connecting upstream leaves in the same write
+    // as the header and handshake bytes, the header is sent alone if the
+    // server speaks first.
+    read_available(client_, client_buf);
+    write_all(client_, server_, client_buf, false);
+  } else {
+    io_copy(client_, server_, client_buf, false);
+  }
   io_copy(server_, client_, server_buf, false);
 }
 
+void Relay::send_proxy_header(ProxyProtocolVersion version) noexcept {
+  if (is_inet(client_.raddr_) && is_inet(client_.laddr_))
+    preamble_.build(version, to_tcp(client_.raddr_), to_tcp(client_.laddr_));
+  else
+    preamble_.build_unknown(version);
+}
+
+void Relay::read_available(RelayConn &from, SharedBuffer buf) noexcept {
+  std::error_code ec;
+  size_t avail = from.conn_.available(ec);
+  if (ec || avail == 0)
+    return;
+
+  // Data is already queued, so this never blocks. Errors are left to the
+  // following async read.
+  size_t n = from.conn_.read_some(make_prepare_buf(buf, false), ec);
+  if (ec)
+    return;
+  LOG_TRACE("Read", KV("laddr", from.laddr_text_),
+            KV("raddr", from.raddr_text_), KV("n", n));
+  count_read(from, n);
+  buf->commit(n);
+}
+
 void Relay::io_copy(RelayConn &from, RelayConn &to, SharedBuffer buf,
                     bool grow) noexcept {
+  if (scheduler_ || shaper_) {
+    paced_copy(from, to, buf, grow);
+    return;
+  }
   auto self = shared_from_this();
   from.conn_.async_read_some(
       make_prepare_buf(buf, grow),
       [this, self, &from, &to, buf](asio::error_code ec, size_t n) {
+        on_read(from, to, buf, ec, n);
+      });
+}
+
+void Relay::paced_copy(RelayConn &from, RelayConn &to, SharedBuffer buf,
+                       bool grow) noexcept {
+  // Turns and tokens are only handed out once there is data, an idle relay
+  // holds neither.
+  auto self = shared_from_this();
+  from.conn_.async_wait(
+      asio::socket_base::wait_read,
+      [this, self, &from, &to, buf, grow](std::error_code ec) {
         if (ec) {
-          if (ec == asio::error::eof) {
-            LOG_DEBUG("Closed by", KV("laddr", to_string(from.laddr_)),
-                      KV("raddr", to_string(from.raddr_)));
-            from.conn_.shutdown(asio::socket_base::shutdown_receive, ec);
-            to.conn_.shutdown(asio::socket_base::shutdown_send, ec);
-          } else {
-            LOG_DEBUG("Fail to read from", KV("error", ec.message()),
-                      KV("laddr", to_string(from.laddr_)),
-                      KV("raddr", to_string(from.raddr_)));
-          }
+          on_read(from, to, buf, ec, 0);
+          return;
+        }
+        if (!scheduler_) {
+          read_turn(from, to, buf, grow, SIZE_MAX);
           return;
         }
-        LOG_TRACE("Read", KV("laddr", to_string(from.laddr_)),
-                  KV("raddr", to_string(from.raddr_)), KV("n", n));
-        from.read_count_ += n;
-        buf->commit(n);
-        write_all(from, to, buf, buf->capacity() == n);
+        scheduler_->ready(from.deficit_,
+                          [this, self, &from, &to, buf, grow](size_t budget) {
+                            return read_turn(from, to, buf, grow, budget);
+                          });
+      });
+}
+
+size_t Relay::read_turn(RelayConn &from, RelayConn &to, SharedBuffer buf,
+                        bool grow, size_t budget) noexcept {
+  auto space = make_prepare_buf(buf, grow);
+  size_t want = std::min(space.size(), budget);
+  size_t granted = want;
+  if (shaper_) {
+    granted = shaper_->take(want);
+    if (granted == 0) {
+      // Unread bytes stay in the kernel and push back on the sender.
+      auto self = shared_from_this();
+      shaper_->wait([this, self, &from, &to, buf, grow]() {
+        paced_copy(from, to, buf, grow);
       });
+      return 0;
+    }
+  }
+
+  std::error_code ec;
+  size_t n = from.conn_.read_some(asio::buffer(space, granted), ec);
+  if (shaper_ && n < granted)
+    shaper_->give(granted - n);
+  on_read(from, to, buf, ec, n);
+  return n == want ? budget - want : 0;
+}
+
+void Relay::on_read(RelayConn &from, RelayConn &to, SharedBuffer buf,
+                    std::error_code ec, size_t n) noexcept {
+  if (ec) {
+    if (ec == asio::error::eof) {
+      LOG_DEBUG("Closed by", KV("laddr", from.laddr_text_),
+                KV("raddr", from.raddr_text_));
+      from.conn_.shutdown(asio::socket_base::shutdown_receive, ec);
+      to.conn_.shutdown(asio::socket_base::shutdown_send, ec);
+    } else {
+      LOG_DEBUG("Fail to read from", KV("error", ec.message()),
+                KV("laddr", from.laddr_text_),
+                KV("raddr", from.raddr_text_));
+    }
+    return;
+  }
+  LOG_TRACE("Read", KV("laddr", from.laddr_text_),
+            KV("raddr", from.raddr_text_), KV("n", n));
+  count_read(from, n);
+  buf->commit(n);
+  write_all(from, to, buf, buf->capacity() == n);
 }
 
 void Relay::write_all(RelayConn &from, RelayConn &to, SharedBuffer buf,
                       bool need_grow) noexcept {
   auto self = shared_from_this();
+  size_t preamble_size = &to == &server_ ? preamble_.size() : 0;
+  std::array<asio::const_buffer, 2> bufs = {
+      asio::buffer(preamble_.data(), preamble_size), buf->data()};
+  auto begin = metered_ ? std::chrono::steady_clock::now()
+                        : std::chrono::steady_clock::time_point();
   asio::async_write(
-      to.conn_, buf->data(),
-      [this, self, &from, &to, buf, need_grow](std::error_code ec, size_t n) {
+      to.conn_, bufs,
+      [this, self, &from, &to, buf, need_grow, preamble_size,
+       begin](std::error_code ec, size_t n) {
         if (ec) {
           LOG_ERROR("Fail to write", KV("error", ec.message()),
-                    KV("laddr", to_string(to.laddr_)),
-                    KV("raddr", to_string(to.raddr_)));
+                    KV("laddr", to.laddr_text_),
+                    KV("raddr", to.raddr_text_));
           from.conn_.close(ec);
           to.conn_.close(ec);
           return;
         }
-        LOG_TRACE("Write", KV("laddr", to_string(to.laddr_)),
-                  KV("raddr", to_string(to.raddr_)), KV("n", n));
+        if (preamble_size > 0) {
+          n -= preamble_size;
+          preamble_.clear();
+        }
+        LOG_TRACE("Write", KV("laddr", to.laddr_text_),
+                  KV("raddr", to.raddr_text_), KV("n", n));
         to.write_count_ += n;
+        if (metered_) {
+          metrics().observe(latency_series_,
+                            &to == &client_ ? kLatencyClientWrite
+                                            : kLatencyUpstreamWrite,
+                            std::chrono::steady_clock::now() - begin);
+          if (&to == &client_)
+            metrics().add(metrics_tuple_, kMetricBytesOut, n);
+        }
         buf->consume(n);
         if (buf->size() > 0)
           write_all(from, to, buf, need_grow);
@@ -128,124 +387,983 @@ void Relay::write_all(RelayConn &from, RelayConn &to, SharedBuffer buf,
 const std::chrono::seconds RelayIOContext::kTimerExpirySeconds(10);
 
 RelayIOContext::RelayIOContext(
-    size_t id, const std::vector<RelayEndpointTuple> &endpoint_tuples)
+    size_t id, const std::vector<RelayEndpointTuple> &endpoint_tuples,
+    size_t quantum, size_t tcp_info_every)
     : id_(id), context_(), timer_(context_, kTimerExpirySeconds),
-      endpoint_tuples_(endpoint_tuples) {
+      endpoint_tuples_(endpoint_tuples), shaping_queue_(context_),
+      scheduler_(context_, quantum), tcp_info_every_(tcp_info_every) {
+  for (const auto &et : endpoint_tuples_) {
+    if (et.proto != kRelayUdp)
+      continue;
+    auto r = std::make_shared<UdpRelay>(context_, et);
+    r->start();
+    udp_relays_.emplace_back(r);
+  }
   wait_timer();
 }
 
 void RelayIOContext::wait_timer() noexcept {
   timer_.async_wait([this](std::error_code ec) {
+    connect_tunnels();
+    auto now = std::chrono::steady_clock::now();
+    for (auto &r : udp_relays_)
+      r->expire(now);
+    for (auto &c : connect_caches_)
+      c.second.expire(now);
+    sample_tcp_info();
     timer_.expires_after(kTimerExpirySeconds);
     wait_timer();
   });
 }
 
+void RelayIOContext::track_tcp_info(const std::shared_ptr<Relay> &relay) {
+  if (tcp_info_every_ == 0 || tcp_info_count_++ % tcp_info_every_ != 0)
+    return;
+  relay->track_tcp_info();
+  tcp_sampled_.push_back(relay);
+}
+
+void RelayIOContext::sample_tcp_info() noexcept {
+  for (size_t i = 0; i < tcp_sampled_.size();) {
+    if (auto r = tcp_sampled_[i].lock()) {
+      r->sample_tcp_info();
+      i++;
+      continue;
+    }
+    tcp_sampled_[i] = std::move(tcp_sampled_.back());
+    tcp_sampled_.pop_back();
+  }
+}
+
 void RelayIOContext::new_conn(
     int connfd, const RelayEndpointTuple &endpoint_tuple) noexcept {
   std::error_code ec;
-  auto client_conn = std::make_shared<tcp::socket>(context_);
-  client_conn->assign(endpoint_tuple.listen.protocol(), connfd, ec);
+  RelaySocket client_conn(context_);
+  client_conn.assign(endpoint_tuple.listen.protocol(), connfd, ec);
   if (ec) {
-    LOG_ERROR("Fail to make tcp socket", KV("error", ec.message()),
+    LOG_ERROR("Fail to make stream socket", KV("error", ec.message()),
               KV("fd", connfd), KV("id", id_));
     ::close(connfd);
     return;
   }
 
-  tcp::endpoint client_laddr = client_conn->local_endpoint(ec);
+  RelayEndpoint client_laddr = client_conn.local_endpoint(ec);
   if (ec) {
     LOG_INFO("Fail to get client local addr", KV("err", ec.message()),
-             KV("fd", client_conn->native_handle()));
+             KV("fd", client_conn.native_handle()));
     return;
   }
-  tcp::endpoint client_raddr = client_conn->remote_endpoint(ec);
+  RelayEndpoint client_raddr = client_conn.remote_endpoint(ec);
   if (ec) {
     LOG_INFO("Fail to get client remote addr", KV("err", ec.message()),
-             KV("laddr", to_string(client_laddr)),
-             KV("fd", client_conn->native_handle()));
+             KV("laddr", EndpointText(client_laddr)),
+             KV("fd", client_conn.native_handle()));
+    return;
+  }
+
+  // Over the limit clients are closed before anything else is spent on
+  // them. Behind a PROXY sender every peer is the balancer, the handshake
+  // admits the client the header names instead.
+  ClientLease lease;
+  if (endpoint_tuple.limiter && is_inet(client_raddr) &&
+      endpoint_tuple.accept_proxy == kProxyNone) {
+    auto verdict = endpoint_tuple.limiter->admit(
+        client_table(endpoint_tuple), to_tcp(client_raddr).address(), lease);
+    if (verdict != ClientLimiter::kAdmit) {
+      LOG_DEBUG("Refuse conn", KV("error", to_string(verdict)),
+                KV("laddr", EndpointText(client_laddr)),
+                KV("raddr", EndpointText(client_raddr)));
+      return;
+    }
+  }
+  LOG_INFO("New conn", KV("laddr", EndpointText(client_laddr)),
+           KV("raddr", EndpointText(client_raddr)), KV("fd", connfd));
+
+  if (endpoint_tuple.tunnel == kTunnelServer) {
+    // Tunnel listeners are always inet.
+    tcp::socket tunnel_conn(context_);
+    tunnel_conn.assign(to_tcp(client_laddr).protocol(),
+                       client_conn.release(ec), ec);
+    std::make_shared<Tunnel>(context_, endpoint_tuple)
+        ->accept(std::move(tunnel_conn));
+    return;
+  }
+
+  std::make_shared<RelayHandshake>(*this, std::move(client_conn), client_laddr,
+                                   client_raddr, endpoint_tuple,
+                                   std::move(lease))
+      ->start();
+}
+
+std::shared_ptr<Tunnel>
+RelayIOContext::tunnel(const RelayEndpointTuple &endpoint_tuple) {
+  std::shared_ptr<Tunnel> &t = tunnels_[endpoint_tuple.listen];
+  if (!t || t->closed()) {
+    t = std::make_shared<Tunnel>(context_, endpoint_tuple);
+    t->connect();
+  }
+  return t;
+}
+
+void RelayIOContext::connect_tunnels() noexcept {
+  for (const auto &et : endpoint_tuples_)
+    if (et.tunnel == kTunnelClient)
+      tunnel(et);
+}
+
+RelayHandshake::RelayHandshake(RelayIOContext &context,
+                               RelaySocket client_conn,
+                               const RelayEndpoint &client_laddr,
+                               const RelayEndpoint &client_raddr,
+                               const RelayEndpointTuple &endpoint_tuple,
+                               ClientLease lease)
+    : context_(context), client_conn_(std::move(client_conn)),
+      server_conn_(client_conn_.get_executor()), client_laddr_(client_laddr),
+      client_raddr_(client_raddr), endpoint_tuple_(endpoint_tuple),
+      dst_(endpoint_tuple.dst), client_buf_(make_shared_buf()),
+      accepted_(std::chrono::steady_clock::now()),
+      deadline_(client_conn_.get_executor()), peek_expired_(false),
+      sniff_pending_(false), sni_pending_(false), host_pending_(false),
+      sniff_state_(0), sniff_offset_(0), socks_greeted_(false),
+      lease_(std::move(lease)) {
+  live_.fetch_add(1, std::memory_order_relaxed);
+}
+
+RelayHandshake::~RelayHandshake() {
+  live_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void RelayHandshake::start() noexcept {
+  if (endpoint_tuple_.transparent != kTransparentNone && !recover_dst()) {
+    close();
+    return;
+  }
+  if (endpoint_tuple_.accept_proxy != kProxyNone) {
+    auto self = shared_from_this();
+    deadline_.expires_after(endpoint_tuple_.proxy_timeout);
+    deadline_.async_wait([this, self](std::error_code ec) {
+      if (ec)
+        return;
+      LOG_ERROR("Fail to read PROXY header", KV("error", "timeout"),
+                KV("laddr", EndpointText(client_laddr_)),
+                KV("raddr", EndpointText(client_raddr_)));
+      close();
+    });
+    read_proxy_header();
+    return;
+  }
+  route();
+}
+
+void RelayHandshake::read_proxy_header() noexcept {
+  auto self = shared_from_this();
+  client_conn_.async_read_some(
+      client_buf_->prepare(kProxyMaxParseSize - client_buf_->size()),
+      [this, self](std::error_code ec, size_t n) {
+        if (ec) {
+          if (ec != asio::error::operation_aborted)
+            LOG_ERROR("Fail to read PROXY header", KV("error", ec.message()),
+                      KV("laddr", EndpointText(client_laddr_)),
+                      KV("raddr", EndpointText(client_raddr_)));
+          close();
+          return;
+        }
+        client_buf_->commit(n);
+
+        ProxyAddrs addrs;
+        auto data = client_buf_->data();
+        size_t len =
+            parse_proxy_header(static_cast<const char *>(data.data()),
+                               data.size(), endpoint_tuple_.accept_proxy,
+                               addrs, ec);
+        if (ec == std::error_code(ProxyErrIncomplete,
+                                  proxy_protocol_category())) {
+          read_proxy_header();
+          return;
+        }
+        if (ec) {
+          LOG_ERROR("Fail to parse PROXY header", KV("error", ec.message()),
+                    KV("laddr", EndpointText(client_laddr_)),
+                    KV("raddr", EndpointText(client_raddr_)));
+          close();
+          return;
+        }
+        deadline_.cancel();
+        client_buf_->consume(len);
+
+        if (addrs.proxied) {
+          LOG_INFO("Accept PROXY", KV("peer", EndpointText(client_raddr_)),
+                   KV("laddr", EndpointText(addrs.dst)),
+                   KV("raddr", EndpointText(addrs.src)));
+          client_laddr_ = RelayEndpoint(addrs.dst);
+          client_raddr_ = RelayEndpoint(addrs.src);
+          if (endpoint_tuple_.transparent != kTransparentNone)
+            dst_ = client_laddr_; // the PROXY sender saw the real dst
+        }
+        if (!admit_proxied()) {
+          close();
+          return;
+        }
+        route();
+      });
+}
+
+bool RelayHandshake::admit_proxied() noexcept {
+  if (!is_inet(client_raddr_))
+    return true;
+  asio::ip::address addr = to_tcp(client_raddr_).address();
+  const AccessControl *acl = endpoint_tuple_.acl.get();
+  if (acl && !acl->allowed(addr)) {
+    LOG_DEBUG("Deny by acl", KV("raddr", EndpointText(client_raddr_)),
+              KV("laddr", EndpointText(client_laddr_)));
+    return false;
+  }
+  if (endpoint_tuple_.limiter) {
+    auto verdict = endpoint_tuple_.limiter->admit(
+        context_.client_table(endpoint_tuple_), addr, lease_);
+    if (verdict != ClientLimiter::kAdmit) {
+      LOG_DEBUG("Refuse conn", KV("error", to_string(verdict)),
+                KV("laddr", EndpointText(client_laddr_)),
+                KV("raddr", EndpointText(client_raddr_)));
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RelayHandshake::recover_dst() noexcept {
+  std::error_code ec;
+  tcp::endpoint dst;
+  if (endpoint_tuple_.transparent == kTransparentRedirect)
+    dst = original_dst(client_conn_.native_handle(),
+                       client_laddr_.data()->sa_family == AF_INET6, ec);
+  else
+    dst = to_tcp(client_laddr_);
+  if (ec) {
+    LOG_ERROR("Fail to get original dst", KV("error", ec.message()),
+              KV("laddr", EndpointText(client_laddr_)),
+              KV("raddr", EndpointText(client_raddr_)));
+    return false;
+  }
+
+  // A client dialing the listener itself would be relayed back to it. The
+  // bind probe only runs for the listen port.
+  if (dst.port() == to_tcp(endpoint_tuple_.listen).port() &&
+      is_local_address(dst.address())) {
+    LOG_ERROR("Fail to get original dst", KV("error", "loop to listener"),
+              KV("laddr", EndpointText(client_laddr_)),
+              KV("raddr", EndpointText(client_raddr_)));
+    return false;
+  }
+  dst_ = RelayEndpoint(dst);
+  return true;
+}
+
+void RelayHandshake::route() noexcept {
+  if (endpoint_tuple_.frontend != kFrontendNone) {
+    auto self = shared_from_this();
+    deadline_.expires_after(endpoint_tuple_.peek_timeout);
+    deadline_.async_wait([this, self](std::error_code ec) {
+      if (ec)
+        return;
+      peek_expired_ = true;
+      client_conn_.cancel(ec);
+    });
+    read_request();
+    return;
+  }
+
+  sniff_pending_ = endpoint_tuple_.sniff != nullptr;
+  sni_pending_ = endpoint_tuple_.sni != nullptr;
+  host_pending_ = endpoint_tuple_.host != nullptr;
+  if (!sniff_pending_ && !sni_pending_ && !host_pending_) {
+    connect();
+    return;
+  }
+
+  // A client that stays silent past the deadline goes to the default dst,
+  // e.g. a protocol where the server speaks first.
+  auto self = shared_from_this();
+  deadline_.expires_after(endpoint_tuple_.peek_timeout);
+  deadline_.async_wait([this, self](std::error_code ec) {
+    if (ec)
+      return;
+    peek_expired_ = true;
+    client_conn_.cancel(ec);
+  });
+  peek();
+}
+
+void RelayHandshake::peek() noexcept {
+  auto data = client_buf_->data();
+  const char *p = static_cast<const char *>(data.data());
+  size_t n = data.size();
+  bool done = sniff_protocol(p, n) && read_client_hello(p, n) &&
+              read_http_host(p, n);
+
+  if (!done && !peek_expired_ && n < kPeekMaxSize) {
+    auto self = shared_from_this();
+    client_conn_.async_read_some(
+        client_buf_->prepare(kPeekMaxSize - n),
+        [this, self](std::error_code ec, size_t n) {
+          if (ec && !(ec == asio::error::operation_aborted && peek_expired_)) {
+            LOG_ERROR("Fail to peek", KV("error", ec.message()),
+                      KV("laddr", EndpointText(client_laddr_)),
+                      KV("raddr", EndpointText(client_raddr_)));
+            close();
+            return;
+          }
+          client_buf_->commit(n);
+          peek();
+        });
     return;
   }
-  LOG_INFO("New conn", KV("laddr", to_string(client_laddr)),
-           KV("raddr", to_string(client_raddr)), KV("fd", connfd));
 
-  auto server_conn = std::make_shared<tcp::socket>(context_);
-  if (endpoint_tuple.src.port() > 0 ||
-      !endpoint_tuple.src.address().is_unspecified()) {
-    server_conn->bind(endpoint_tuple.src, ec);
+  deadline_.cancel();
+  if (sniff_pending_ && endpoint_tuple_.sniff->timeout_route() >= 0) {
+    const auto &r =
+        endpoint_tuple_.sniff->routes()[endpoint_tuple_.sniff->timeout_route()];
+    dst_ = r.dst;
+    LOG_DEBUG("Route by protocol", KV("proto", r.proto),
+              KV("raddr", EndpointText(client_raddr_)),
+              KV("to", EndpointText(dst_)));
+  }
+  connect();
+}
+
+bool RelayHandshake::sniff_protocol(const char *data, size_t n) noexcept {
+  if (!sniff_pending_)
+    return true;
+
+  // Only bytes not seen before are fed, the automaton state carries over.
+  int route = endpoint_tuple_.sniff->feed(sniff_state_, data + sniff_offset_,
+                                          n - sniff_offset_);
+  sniff_offset_ = n;
+  if (route == kSniffMore)
+    return false;
+
+  sniff_pending_ = false;
+  if (route == kSniffNone) {
+    LOG_DEBUG("Route by protocol", KV("proto", "unknown"),
+              KV("raddr", EndpointText(client_raddr_)),
+              KV("to", EndpointText(dst_)));
+    return true;
+  }
+  const auto &r = endpoint_tuple_.sniff->routes()[route];
+  dst_ = r.dst;
+  sni_pending_ = sni_pending_ && r.proto == "tls";
+  host_pending_ = host_pending_ && r.proto == "http";
+  LOG_DEBUG("Route by protocol", KV("proto", r.proto),
+            KV("raddr", EndpointText(client_raddr_)),
+            KV("to", EndpointText(dst_)));
+  return true;
+}
+
+bool RelayHandshake::read_client_hello(const char *data, size_t n) noexcept {
+  if (!sni_pending_)
+    return true;
+
+  std::string_view sni;
+  std::error_code ec;
+  parse_tls_sni(data, n, sni, ec);
+  if (ec == std::error_code(TlsErrIncomplete, tls_category()))
+    return false;
+
+  sni_pending_ = false;
+  const RelayEndpoint *dst = ec ? nullptr : endpoint_tuple_.sni->find(sni);
+  if (dst)
+    dst_ = *dst;
+  LOG_DEBUG("Route by SNI", KV("sni", std::string(sni)),
+            KV("error", ec ? ec.message() : "none"),
+            KV("raddr", EndpointText(client_raddr_)),
+            KV("to", EndpointText(dst_)));
+  return true;
+}
+
+bool RelayHandshake::read_http_host(const char *data, size_t n) noexcept {
+  if (!host_pending_)
+    return true;
+
+  std::string_view host;
+  std::error_code ec;
+  parse_http_host(data, n, host, ec);
+  if (ec == std::error_code(HttpErrIncomplete, http_category()))
+    return false;
+
+  host_pending_ = false;
+  const RelayEndpoint *dst = ec ? nullptr : endpoint_tuple_.host->find(host);
+  if (dst)
+    dst_ = *dst;
+  LOG_DEBUG("Route by Host", KV("host", std::string(host)),
+            KV("error", ec ? ec.message() : "none"),
+            KV("raddr", EndpointText(client_raddr_)),
+            KV("to", EndpointText(dst_)));
+  return true;
+}
+
+void RelayHandshake::read_request() noexcept {
+  auto data = client_buf_->data();
+  const char *p = static_cast<const char *>(data.data());
+  size_t n = data.size();
+
+  // An empty buffer always parses as incomplete, so the first read starts
+  // here too.
+  std::error_code ec;
+  ConnectTarget target;
+  size_t len;
+  if (endpoint_tuple_.frontend == kFrontendConnect)
+    len = parse_http_connect(p, n, target, ec);
+  else if (!socks_greeted_)
+    len = parse_socks5_greeting(p, n, ec);
+  else
+    len = parse_socks5_request(p, n, target, ec);
+
+  if (ec == std::error_code(FrontendErrIncomplete, frontend_category())) {
+    if (n >= kFrontendMaxRequestSize) {
+      reject(std::error_code(FrontendErrMalformed, frontend_category()));
+      return;
+    }
+    auto self = shared_from_this();
+    client_conn_.async_read_some(
+        client_buf_->prepare(kFrontendMaxRequestSize - n),
+        [this, self](std::error_code ec, size_t n) {
+          if (ec) {
+            LOG_ERROR("Fail to read proxy request",
+                      KV("error", peek_expired_ ? "timeout" : ec.message()),
+                      KV("laddr", EndpointText(client_laddr_)),
+                      KV("raddr", EndpointText(client_raddr_)));
+            close();
+            return;
+          }
+          client_buf_->commit(n);
+          read_request();
+        });
+    return;
+  }
+  if (ec) {
+    LOG_ERROR("Fail to parse proxy request", KV("error", ec.message()),
+              KV("frontend", to_string(endpoint_tuple_.frontend)),
+              KV("raddr", EndpointText(client_raddr_)));
+    reject(ec);
+    return;
+  }
+  client_buf_->consume(len);
+
+  if (endpoint_tuple_.frontend == kFrontendSocks5 && !socks_greeted_) {
+    socks_greeted_ = true;
+    auto self = shared_from_this();
+    asio::async_write(client_conn_, asio::buffer(kSocks5NoAuth),
+                      [this, self](std::error_code ec, size_t) {
+                        if (ec) {
+                          close();
+                          return;
+                        }
+                        read_request();
+                      });
+    return;
+  }
+  deadline_.cancel();
+  resolve(target);
+}
+
+void RelayHandshake::resolve(const ConnectTarget &target) noexcept {
+  std::string key = target.host.find(':') == std::string::npos
+                        ? target.host
+                        : "[" + target.host + "]";
+  key += ":" + std::to_string(target.port);
+  auto now = std::chrono::steady_clock::now();
+  ConnectCache &cache = context_.connect_cache(endpoint_tuple_);
+  if (const ConnectCache::Entry *e = cache.find(key, now)) {
+    if (!e->allowed) {
+      LOG_WARN("Deny proxy request", KV("target", key),
+               KV("raddr", EndpointText(client_raddr_)));
+      reject(std::error_code(FrontendErrNotAllowed, frontend_category()));
+      return;
+    }
+    dst_ = e->dst;
+    connect();
+    return;
+  }
+
+  std::error_code ec;
+  asio::ip::address addr = asio::ip::make_address(target.host, ec);
+  if (!ec) {
+    select_dst({tcp::endpoint(addr, target.port)}, key);
+    return;
+  }
+
+  // The resolver lives only while a lookup is running, most tuples never
+  // need one.
+  auto self = shared_from_this();
+  auto resolver = std::make_shared<tcp::resolver>(context_.context());
+  resolver->async_resolve(
+      target.host, std::to_string(target.port),
+      [this, self, resolver, key](std::error_code ec,
+                                  tcp::resolver::results_type results) {
+        if (ec) {
+          LOG_ERROR("Fail to resolve", KV("error", ec.message()),
+                    KV("target", key),
+                    KV("raddr", EndpointText(client_raddr_)));
+          reject(ec);
+          return;
+        }
+        std::vector<tcp::endpoint> candidates;
+        for (const auto &r : results)
+          candidates.push_back(r.endpoint());
+        select_dst(candidates, key);
+      });
+}
+
+void RelayHandshake::select_dst(const std::vector<tcp::endpoint> &candidates,
+                                const std::string &key) noexcept {
+  const ConnectAllowlist *allow = endpoint_tuple_.connect_allow.get();
+  const tcp::endpoint *dst = nullptr;
+  for (const auto &c : candidates) {
+    if (allow && allow->allowed(c)) {
+      dst = &c;
+      break;
+    }
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  context_.connect_cache(endpoint_tuple_).insert(
+      key, dst ? RelayEndpoint(*dst) : RelayEndpoint(), dst != nullptr, now);
+  if (!dst) {
+    LOG_WARN("Deny proxy request", KV("target", key),
+             KV("raddr", EndpointText(client_raddr_)));
+    reject(std::error_code(FrontendErrNotAllowed, frontend_category()));
+    return;
+  }
+  dst_ = RelayEndpoint(*dst);
+  connect();
+}
+
+void RelayHandshake::reject(const std::error_code &ec) noexcept {
+  deadline_.cancel();
+  reply_ = frontend_reply(endpoint_tuple_.frontend, socks_greeted_, ec,
+                          tcp::endpoint());
+  auto self = shared_from_this();
+  asio::async_write(client_conn_, asio::buffer(reply_),
+                    [this, self](std::error_code, size_t) { close(); });
+}
+
+void RelayHandshake::connect() noexcept {
+  if (endpoint_tuple_.tunnel == kTunnelClient) {
+    deadline_.cancel();
+    context_.tunnel(endpoint_tuple_)
+        ->open_stream(std::move(client_conn_), client_laddr_, client_raddr_,
+                      client_buf_);
+    return;
+  }
+
+  std::error_code ec;
+  if (endpoint_tuple_.spoof_src && is_inet(dst_) && is_inet(client_raddr_)) {
+    // Upstream sees the client address, the kernel picks the port.
+    RelayEndpoint src(tcp::endpoint(to_tcp(client_raddr_).address(), 0));
+    server_conn_.open(dst_.protocol(), ec);
+    if (!ec)
+      set_transparent(server_conn_, dst_.data()->sa_family, ec);
+    if (!ec)
+      server_conn_.bind(src, ec);
     if (ec) {
       LOG_ERROR("Fail to bind", KV("err", ec.message()),
-                KV("src", to_string(endpoint_tuple.src)));
+                KV("src", EndpointText(src)));
+      close();
+      return;
+    }
+  } else if (is_inet(dst_) &&
+             (endpoint_tuple_.src.port() > 0 ||
+              !endpoint_tuple_.src.address().is_unspecified())) {
+    RelayEndpoint src(endpoint_tuple_.src);
+    server_conn_.open(src.protocol(), ec);
+    if (!ec)
+      server_conn_.bind(src, ec);
+    if (ec) {
+      LOG_ERROR("Fail to bind", KV("err", ec.message()),
+                KV("src", EndpointText(endpoint_tuple_.src)));
+      close();
       return;
     }
   }
 
-  server_conn->async_connect(endpoint_tuple.dst, [=](std::error_code ec) {
+  if (!server_conn_.is_open()) {
+    server_conn_.open(dst_.protocol(), ec);
     if (ec) {
+      LOG_ERROR("Fail to open", KV("err", ec.message()),
+                KV("dst", EndpointText(dst_)));
+      close();
+      return;
+    }
+  }
+  set_cloexec(server_conn_.native_handle());
+
+  auto self = shared_from_this();
+  server_conn_.async_connect(dst_, [this, self](std::error_code ec) {
+    if (ec) {
+      metrics().add(endpoint_tuple_.metrics_tuple, kMetricConnectFailures, 1);
       LOG_ERROR("Fail to connect", KV("error", ec.message()),
-                KV("src", to_string(endpoint_tuple.src)),
-                KV("dst", to_string(endpoint_tuple.dst)));
+                KV("src", EndpointText(endpoint_tuple_.src)),
+                KV("dst", EndpointText(dst_)));
+      if (endpoint_tuple_.frontend != kFrontendNone)
+        reject(ec);
+      else
+        close();
       return;
     }
 
-    tcp::endpoint server_laddr = server_conn->local_endpoint(ec);
+    connected_ = std::chrono::steady_clock::now();
+    latency_series_ = metrics().series(endpoint_tuple_.metrics_tuple,
+                                       EndpointText(dst_));
+    metrics().observe(latency_series_, kLatencyConnect,
+                      connected_ - accepted_);
+
+    RelayEndpoint server_laddr = server_conn_.local_endpoint(ec);
     if (ec) {
       LOG_ERROR("Fail to get server local addr", KV("err", ec.message()),
-                KV("fd", server_conn->native_handle()),
-                KV("client_raddr", to_string(client_raddr)));
+                KV("fd", server_conn_.native_handle()),
+                KV("client_raddr", EndpointText(client_raddr_)));
+      close();
       return;
     }
-    LOG_DEBUG("Connected to", KV("laddr", to_string(server_laddr)),
-              KV("raddr", to_string(endpoint_tuple.dst)));
+    LOG_DEBUG("Connected to", KV("laddr", EndpointText(server_laddr)),
+              KV("raddr", EndpointText(dst_)));
 
-    std::make_shared<Relay>(std::move(*client_conn), std::move(*server_conn),
-                            client_laddr, client_raddr, client_raddr,
-                            endpoint_tuple.dst)
-        ->start();
+    if (endpoint_tuple_.frontend == kFrontendNone) {
+      start_relay(server_laddr);
+      return;
+    }
+    reply_ = frontend_reply(endpoint_tuple_.frontend, socks_greeted_,
+                            std::error_code(), to_tcp(server_laddr));
+    asio::async_write(client_conn_, asio::buffer(reply_),
+                      [this, self, server_laddr](std::error_code ec, size_t) {
+                        if (ec) {
+                          close();
+                          return;
+                        }
+                        start_relay(server_laddr);
+                      });
   });
 }
 
-RelayServer::RelayServer(std::vector<RelayEndpointTuple> endpoint_tuples)
-    : endpoint_tuples_(endpoint_tuples), relay_context_idx_(0) {}
+void RelayHandshake::start_relay(const RelayEndpoint &server_laddr) noexcept {
+  auto relay = std::make_shared<Relay>(std::move(client_conn_),
+                                       std::move(server_conn_), client_laddr_,
+                                       client_raddr_, server_laddr, dst_);
+  if (endpoint_tuple_.send_proxy != kProxyNone)
+    relay->send_proxy_header(endpoint_tuple_.send_proxy);
+  relay->hold(std::move(lease_));
+  if (endpoint_tuple_.conn_rate > 0 || endpoint_tuple_.tuple_bucket ||
+      endpoint_tuple_.global_bucket)
+    relay->shape(std::make_unique<RelayShaper>(
+        context_.shaping_queue(), endpoint_tuple_.conn_rate,
+        endpoint_tuple_.tuple_bucket, endpoint_tuple_.global_bucket));
+  if (context_.scheduler().enabled())
+    relay->schedule(context_.scheduler());
+  relay->meter(endpoint_tuple_.metrics_tuple, latency_series_, connected_);
+  context_.track_tcp_info(relay);
+  relay->start(client_buf_);
+}
+
+void RelayHandshake::close() noexcept {
+  std::error_code ec;
+  deadline_.cancel();
+  client_conn_.close(ec);
+  server_conn_.close(ec);
+}
+
+RelayServer::Acceptor::Acceptor(asio::io_context &context,
+                                const RelayEndpointTuple &endpoint_tuple,
+                                int fd)
+    : endpoint_tuple_(endpoint_tuple), acceptor_(context) {
+  const RelayEndpoint &listen = endpoint_tuple.listen;
+  if (fd >= 0) {
+    // Already bound and listening, with options set by the predecessor.
+    acceptor_.assign(listen.protocol(), fd);
+    return;
+  }
+  acceptor_.open(listen.protocol());
+  set_cloexec(acceptor_.native_handle());
+  if (is_inet(listen)) {
+    acceptor_.set_option(asio::socket_base::reuse_address(true));
+    if (endpoint_tuple.transparent == kTransparentTproxy) {
+      std::error_code ec;
+      set_transparent(acceptor_, listen.data()->sa_family, ec);
+      if (ec)
+        throw std::system_error(ec, "IP_TRANSPARENT");
+    }
+  } else {
+    // A socket file left by a previous run makes bind fail, anything else
+    // at the path is left alone.
+    const sockaddr_un *sun =
+        reinterpret_cast<const sockaddr_un *>(listen.data());
+    struct stat st;
+    if (sun->sun_path[0] != '\0' && ::stat(sun->sun_path, &st) == 0 &&
+        S_ISSOCK(st.st_mode))
+      ::unlink(sun->sun_path);
+  }
+  acceptor_.bind(listen);
+  acceptor_.listen();
+}
+
+RelayServer::RelayServer(std::vector<RelayEndpointTuple> endpoint_tuples,
+                         uint64_t bandwidth, size_t quantum)
+    : endpoint_tuples_(endpoint_tuples), relay_context_idx_(0),
+      quantum_(quantum), reloading_(false) {
+  // Limiters and buckets are made once here and shared by the contexts'
+  // copies of the tuples.
+  auto global = bandwidth > 0 ? std::make_shared<TokenBucket>(bandwidth)
+                              : nullptr;
+  for (auto &et : endpoint_tuples_) {
+    if (et.max_conns_per_ip > 0 || et.max_rate_per_ip > 0)
+      et.limiter = std::make_shared<ClientLimiter>(et.max_conns_per_ip,
+                                                   et.max_rate_per_ip);
+    if (et.tuple_rate > 0)
+      et.tuple_bucket = std::make_shared<TokenBucket>(et.tuple_rate);
+    if (et.proto == kRelayTcp && et.tunnel == kTunnelNone)
+      et.global_bucket = global;
+    et.metrics_tuple = metrics().add_tuple(to_string(et.listen));
+  }
+}
 
 void RelayServer::run(size_t co_num) {
   co_num = std::max(co_num, size_t(1));
-  LOG_INFO("Relay Server run", KV("co_num", co_num));
+  std::error_code ec;
+  inherited_.receive(ec);
+  if (ec)
+    throw std::system_error(ec, "receive listeners");
+  LOG_INFO("Relay Server run", KV("co_num", co_num),
+           KV("quantum", quantum_), KV("tcp_info_every", tcp_info_every_));
 
   for (size_t i = 0; i < co_num; i++)
     relay_contexts_.emplace_back(
-        std::make_shared<RelayIOContext>(i, endpoint_tuples_));
+        std::make_shared<RelayIOContext>(i, endpoint_tuples_, quantum_,
+                                         tcp_info_every_));
 
   for (const auto &et : endpoint_tuples_) {
     LOG_INFO("Listen on", KV("addr", to_string(et.listen)),
-             KV("via", to_string(et.src)), KV("to", to_string(et.dst)));
-    auto a = std::make_shared<Acceptor>(relay_contexts_[0]->context(), et);
+             KV("via", to_string(et.src)), KV("to", to_string(et.dst)),
+             KV("send_proxy", to_string(et.send_proxy)),
+             KV("accept_proxy", to_string(et.accept_proxy)),
+             KV("tunnel", to_string(et.tunnel)),
+             KV("proto", et.proto == kRelayUdp ? "udp" : "tcp"),
+             KV("transparent", to_string(et.transparent)),
+             KV("frontend", to_string(et.frontend)));
+    if (et.sniff)
+      for (const auto &r : et.sniff->routes())
+        LOG_INFO("Route by protocol", KV("addr", to_string(et.listen)),
+                 KV("proto", r.proto), KV("to", to_string(r.dst)));
+    if (et.sni)
+      for (const auto &r : et.sni->routes())
+        LOG_INFO("Route by SNI", KV("addr", to_string(et.listen)),
+                 KV("sni", r.first), KV("to", to_string(r.second)));
+    if (et.host)
+      for (const auto &r : et.host->routes())
+        LOG_INFO("Route by Host", KV("addr", to_string(et.listen)),
+                 KV("host", r.first), KV("to", to_string(r.second)));
+    if (et.conn_rate > 0 || et.tuple_rate > 0)
+      LOG_INFO("Bandwidth", KV("addr", to_string(et.listen)),
+               KV("conn_rate", et.conn_rate), KV("tuple_rate", et.tuple_rate));
+    if (et.limiter)
+      LOG_INFO("Client limit", KV("addr", to_string(et.listen)),
+               KV("max_conns", et.max_conns_per_ip),
+               KV("max_rate", et.max_rate_per_ip));
+    if (et.acl)
+      LOG_INFO("Access control", KV("addr", to_string(et.listen)),
+               KV("file", et.acl->file()));
+    if (et.proto == kRelayUdp)
+      continue; // bound by every RelayIOContext
+    auto a = std::make_shared<Acceptor>(relay_contexts_[0]->context(), et,
+                                        inherited_.take(to_string(et.listen)));
     do_accept(*a);
     acceptors_.emplace_back(a);
   }
 
+  if (serve_metrics_) {
+    metrics_server_ = std::make_unique<MetricsServer>(
+        metrics_endpoint_, inherited_.take(metrics_listener_name()));
+    metrics_server_->start();
+    LOG_INFO("Serve metrics", KV("addr", EndpointText(metrics_endpoint_)));
+  }
+
+  signals_ = std::make_unique<asio::signal_set>(relay_contexts_[0]->context(),
+                                                SIGHUP, SIGUSR2);
+  wait_signals();
+
+  if (inherited_.upgrading()) {
+    inherited_.ready();
+    LOG_INFO("Upgraded, predecessor drains");
+  }
+
   std::vector<std::thread> threads;
   for (int i = 1; i < relay_contexts_.size(); i++)
     threads.emplace_back(
         std::thread([i, this]() { relay_contexts_[i]->run(); }));
   relay_contexts_[0]->run();
+  for (auto &t : threads)
+    t.join();
 }
 
 void RelayServer::do_accept(Acceptor &ra) noexcept {
   ra.acceptor_.async_wait(
       asio::socket_base::wait_read, [this, &ra](std::error_code ec) {
-        int connfd = ::accept(ra.acceptor_.native_handle(), nullptr, nullptr);
+        if (ec)
+          return; // closed by drain()
+        sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        int connfd = ::accept4(ra.acceptor_.native_handle(),
+                               reinterpret_cast<sockaddr *>(&peer), &peer_len,
+                               SOCK_CLOEXEC);
         if (connfd < 0) {
-          LOG_ERROR("Fail to accept", KERR(errno));
+          // A shared listener loses races to the other process on upgrade.
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+            LOG_ERROR("Fail to accept", KERR(errno));
+          do_accept(ra);
           return;
         }
+        metrics().add(ra.endpoint_tuple_.metrics_tuple, kMetricAccepts, 1);
+
+        // Denied clients are closed here, before a context sees them. Behind
+        // a PROXY sender the peer is the balancer, the handshake checks the
+        // client once the header names it.
+        const AccessControl *acl = ra.endpoint_tuple_.acl.get();
+        if (acl && ra.endpoint_tuple_.accept_proxy == kProxyNone) {
+          tcp::endpoint raddr = to_tcp(RelayEndpoint(&peer, peer_len));
+          if (!acl->allowed(raddr.address())) {
+            LOG_DEBUG("Deny by acl", KV("raddr", EndpointText(raddr)),
+                      KV("laddr", to_string(ra.endpoint_tuple_.listen)));
+            ::close(connfd);
+            do_accept(ra);
+            return;
+          }
+        }
 
         relay_context_idx_++;
         if (relay_context_idx_ % relay_contexts_.size() == 0)
           relay_context_idx_++;
         auto ctx = relay_contexts_[relay_context_idx_ % relay_contexts_.size()];
-        ctx->new_conn(connfd, ra.endpoint_tuple_);
+        asio::post(ctx->context(), [ctx, connfd, &ra]() {
+          ctx->new_conn(connfd, ra.endpoint_tuple_);
+        });
 
         do_accept(ra);
       });
 }
+
+void RelayServer::wait_signals() noexcept {
+  signals_->async_wait([this](std::error_code ec, int signo) {
+    if (ec)
+      return;
+    wait_signals();
+    if (signo == SIGHUP)
+      reload_acl();
+    else if (signo == SIGUSR2)
+      upgrade();
+  });
+}
+
+void RelayServer::reload_acl() noexcept {
+  // Files are read and compiled off the accept thread, a reload still
+  // running makes this signal a no-op.
+  if (reloading_.exchange(true))
+    return;
+  std::thread([this]() {
+    for (const auto &a : acceptors_) {
+      const auto &acl = a->endpoint_tuple_.acl;
+      if (!acl)
+        continue;
+      try {
+        size_t n = acl->reload();
+        LOG_INFO("Reload acl",
+                 KV("addr", to_string(a->endpoint_tuple_.listen)),
+                 KV("file", acl->file()), KV("rules", n));
+      } catch (const std::exception &e) {
+        LOG_ERROR("Fail to reload acl", KV("error", e.what()),
+                  KV("addr", to_string(a->endpoint_tuple_.listen)));
+      }
+    }
+    reloading_ = false;
+  }).detach();
+}
+
+void RelayServer::upgrade() noexcept {
+  if (upgrade_channel_ || draining_)
+    return;
+
+  std::vector<int> fds;
+  std::vector<std::string> names;
+  for (const auto &a : acceptors_) {
+    fds.push_back(a->acceptor_.native_handle());
+    names.push_back(to_string(a->endpoint_tuple_.listen));
+  }
+  if (metrics_server_) {
+    fds.push_back(metrics_server_->native_handle());
+    names.push_back(metrics_listener_name());
+  }
+  std::error_code ec;
+  int channel = spawn_successor(fds, names, successor_, ec);
+  if (channel < 0) {
+    LOG_ERROR("Fail to upgrade", KV("error", ec.message()));
+    return;
+  }
+  LOG_INFO("Upgrade", KV("pid", successor_), KV("listeners", fds.size()));
+
+  // Both processes accept until the successor reports ready, the listen
+  // queues stay open throughout.
+  auto &context = relay_contexts_[0]->context();
+  upgrade_channel_ = std::make_unique<RelaySocket>(context);
+  upgrade_channel_->assign(asio::generic::stream_protocol(AF_UNIX, 0),
+                           channel, ec);
+  upgrade_channel_->async_read_some(
+      asio::buffer(&upgrade_reply_, 1), [this](std::error_code ec, size_t n) {
+        upgrade_channel_.reset();
+        if (ec || n != 1 || upgrade_reply_ != kUpgradeReady) {
+          LOG_ERROR("Fail to upgrade",
+                    KV("error", ec ? ec.message() : "successor quit"),
+                    KV("pid", successor_));
+          ::waitpid(successor_, nullptr, WNOHANG);
+          return;
+        }
+        drain();
+      });
+}
+
+void RelayServer::drain() noexcept {
+  draining_ = true;
+  for (auto &a : acceptors_) {
+    std::error_code ec;
+    a->acceptor_.close(ec);
+  }
+  if (metrics_server_)
+    metrics_server_->close();
+  LOG_INFO("Drain", KV("relays", Relay::live()),
+           KV("handshakes", RelayHandshake::live()),
+           KV("streams", TunnelStream::live()),
+           KV("udp_sessions", UdpSession::live()),
+           KV("timeout", drain_timeout_.count()));
+  drain_timer_ =
+      std::make_unique<asio::steady_timer>(relay_contexts_[0]->context());
+  wait_drained(std::chrono::steady_clock::now() + drain_timeout_);
+}
+
+void RelayServer::wait_drained(
+    std::chrono::steady_clock::time_point deadline) noexcept {
+  // Udp sessions are not waited for, the old listeners keep taking new
+  // datagrams so they never run out. Their clients go on with a new
+  // session in the successor once this process quits.
+  size_t live =
+      Relay::live() + RelayHandshake::live() + TunnelStream::live();
+  if (live == 0 || std::chrono::steady_clock::now() >= deadline) {
+    LOG_INFO("Drained", KV("relays", Relay::live()),
+             KV("handshakes", RelayHandshake::live()),
+             KV("streams", TunnelStream::live()),
+             KV("udp_sessions", UdpSession::live()));
+    for (auto &c : relay_contexts_)
+      c->context().stop();
+    return;
+  }
+  drain_timer_->expires_after(std::chrono::milliseconds(100));
+  drain_timer_->async_wait([this, deadline](std::error_code ec) {
+    if (!ec)
+      wait_drained(deadline);
+  });
+}
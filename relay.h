@@ -9,102 +9,433 @@
 
 #pragma once
 
+#include "acl.h"
+#include "client_limit.h"
+#include "frontend.h"
+#include "http_host.h"
+#include "metrics.h"
+#include "netutil.h"
+#include "proxy_protocol.h"
+#include "scheduler.h"
+#include "shaper.h"
+#include "upgrade.h"
+#include "sni.h"
+#include "sniff.h"
+#include "tcp_info.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+
 #include <asio.hpp>
+#include <asio/generic/stream_protocol.hpp>
 #include <asio/ip/tcp.hpp>
 #include <asio/streambuf.hpp>
 
+// Relayed stream connections are TCP or unix sockets.
+using RelaySocket = asio::generic::stream_protocol::socket;
+using RelayEndpoint = asio::generic::stream_protocol::endpoint;
+
+enum TunnelMode : int {
+  kTunnelNone = 0,
+  kTunnelClient = 1, // carry accepted connections as streams to dst
+  kTunnelServer = 2, // accept tunnels, dial dst for every stream
+};
+
+enum RelayProtocol : int {
+  kRelayTcp = 0,
+  kRelayUdp = 1,
+};
+
+enum TransparentMode : int {
+  kTransparentNone = 0,
+  kTransparentRedirect = 1, // dst from SO_ORIGINAL_DST (REDIRECT/DNAT)
+  kTransparentTproxy = 2,   // dst is the local address (TPROXY)
+};
+
+const char *to_string(TransparentMode mode);
+
 struct RelayEndpointTuple {
-  asio::ip::tcp::endpoint listen;
-  asio::ip::tcp::endpoint src;
-  asio::ip::tcp::endpoint dst;
+  RelayEndpoint listen;        // ip:port or unix:path
+  asio::ip::tcp::endpoint src; // bound for inet dst only
+  RelayEndpoint dst;           // ip:port or unix:path
+  ProxyProtocolVersion send_proxy = kProxyNone;
+  ProxyProtocolVersion accept_proxy = kProxyNone;
+  std::chrono::milliseconds proxy_timeout{1000};
+  TunnelMode tunnel = kTunnelNone;
+  RelayProtocol proto = kRelayTcp;
+  std::chrono::seconds udp_idle{60};
+  size_t udp_max_sessions = 4096; // per listener and context
+  bool udp_gro = false;
+  bool udp_gso = false;
+  std::shared_ptr<SniTable> sni; // routes by TLS server name, dst is default
+  std::shared_ptr<SniffTable> sniff; // routes by protocol, before sni
+  std::shared_ptr<SniTable> host;    // routes by HTTP Host, dst is default
+  std::chrono::milliseconds peek_timeout{1000};
+  TransparentMode transparent = kTransparentNone; // dst per connection
+  bool spoof_src = false; // dial upstream from the client address
+  FrontendProtocol frontend = kFrontendNone;      // dst named by the client
+  std::shared_ptr<ConnectAllowlist> connect_allow; // front-end dst policy
+  std::shared_ptr<AccessControl> acl;              // clients served, inet only
+  uint32_t max_conns_per_ip = 0; // 0 is unlimited
+  uint32_t max_rate_per_ip = 0;  // new connections per second
+  std::shared_ptr<ClientLimiter> limiter; // made by RelayServer from the above
+  uint64_t conn_rate = 0;  // bytes per second of every relay, 0 is unlimited
+  uint64_t tuple_rate = 0; // bytes per second of all relays together
+  std::shared_ptr<TokenBucket> tuple_bucket;  // made by RelayServer
+  std::shared_ptr<TokenBucket> global_bucket; // shared by all tuples
+  size_t metrics_tuple = 0; // index in metrics(), set by RelayServer
 };
 
 struct RelayConn {
-  asio::ip::tcp::socket conn_;
-  asio::ip::tcp::endpoint laddr_;
-  asio::ip::tcp::endpoint raddr_;
+  RelaySocket conn_;
+  RelayEndpoint laddr_;
+  RelayEndpoint raddr_;
+  EndpointText laddr_text_; // formatted once for every log line
+  EndpointText raddr_text_;
   uint64_t read_count_;
   uint64_t write_count_;
+  size_t deficit_; // RelayScheduler credit for reading from conn_
+  TcpSample tcp_info_; // last sample, if the relay is sampled
 
-  RelayConn(asio::ip::tcp::socket conn, const asio::ip::tcp::endpoint &laddr,
-            const asio::ip::tcp::endpoint &raddr)
-      : conn_(std::move(conn)), laddr_(laddr), raddr_(raddr), read_count_(0),
-        write_count_(0) {}
+  RelayConn(RelaySocket conn, const RelayEndpoint &laddr,
+            const RelayEndpoint &raddr)
+      : conn_(std::move(conn)), laddr_(laddr), raddr_(raddr),
+        laddr_text_(laddr), raddr_text_(raddr), read_count_(0),
+        write_count_(0), deficit_(0) {}
+};
+
+/// Relay buffer, counted in the metrics tier of its capacity.
+class RelayBuffer : public asio::streambuf {
+public:
+  explicit RelayBuffer(size_t max_size);
+  ~RelayBuffer();
+
+  /// Move to the tier of the capacity, after it grew.
+  void update_tier() noexcept;
+
+private:
+  BufferTier tier_;
 };
 
 class Relay : public std::enable_shared_from_this<Relay> {
 public:
-  using SharedBuffer = std::shared_ptr<asio::streambuf>;
+  using SharedBuffer = std::shared_ptr<RelayBuffer>;
   using TimePoint = std::chrono::time_point<std::chrono::system_clock,
                                             std::chrono::nanoseconds>;
 
-  Relay(asio::ip::tcp::socket client_conn, asio::ip::tcp::socket server_conn,
-        const asio::ip::tcp::endpoint &client_laddr,
-        const asio::ip::tcp::endpoint &client_raddr,
-        const asio::ip::tcp::endpoint &server_laddr,
-        const asio::ip::tcp::endpoint &server_raddr);
+  Relay(RelaySocket client_conn, RelaySocket server_conn,
+        const RelayEndpoint &client_laddr, const RelayEndpoint &client_raddr,
+        const RelayEndpoint &server_laddr, const RelayEndpoint &server_raddr);
 
   ~Relay();
 
-  void start() noexcept;
+  /// Relays of all contexts not yet destroyed.
+  static size_t live() { return live_.load(std::memory_order_relaxed); }
+
+  /// Start relaying, \p client_buf holds client bytes already read by the
+  /// handshake and is delivered upstream first.
+  void start(SharedBuffer client_buf = nullptr) noexcept;
+
+  /// Announce the client addresses to upstream with a PROXY protocol header,
+  /// must be called before start().
+  void send_proxy_header(ProxyProtocolVersion version) noexcept;
+
+  /// Keep the client's admission slot until the relay ends.
+  void hold(ClientLease lease) { lease_ = std::move(lease); }
+
+  /// Pace reads by \p shaper, must be called before start().
+  void shape(std::unique_ptr<RelayShaper> shaper) {
+    shaper_ = std::move(shaper);
+  }
+
+  /// Take turns with the other relays of \p scheduler, must be called before
+  /// start().
+  void schedule(RelayScheduler &scheduler) { scheduler_ = &scheduler; }
+
+  /// Sample TCP_INFO of both sockets from now on, RelayIOContext calls
+  /// sample_tcp_info() on its timer and the last sample goes into the
+  /// "Forward done" line.
+  void track_tcp_info() { tcp_sampled_ = true; }
+
+  /// Read TCP_INFO of both inet sockets, counting what changed since the
+  /// previous sample in the metrics.
+  void sample_tcp_info() noexcept;
+
+  /// Count the relay and its client bytes in the metrics of \p tuple, and
+  /// its latencies in \p series since upstream \p connected, must be
+  /// called before start().
+  void meter(size_t tuple, uint32_t series,
+             std::chrono::steady_clock::time_point connected);
 
 private:
   void io_copy(RelayConn &from, RelayConn &to, SharedBuffer buf,
                bool need_grow) noexcept;
 
+  /// io_copy() of scheduled or shaped relays, waits until readable, then
+  /// for its turn, then reads as many bytes as the turn and tokens allow.
+  void paced_copy(RelayConn &from, RelayConn &to, SharedBuffer buf,
+                  bool need_grow) noexcept;
+
+  /// Read up to \p budget bytes, return the budget left for lack of buffer
+  /// space.
+  size_t read_turn(RelayConn &from, RelayConn &to, SharedBuffer buf,
+                   bool need_grow, size_t budget) noexcept;
+
+  void on_read(RelayConn &from, RelayConn &to, SharedBuffer buf,
+               std::error_code ec, size_t n) noexcept;
+
   void write_all(RelayConn &from, RelayConn &to, SharedBuffer buf,
                  bool need_grow) noexcept;
 
+  void read_available(RelayConn &from, SharedBuffer buf) noexcept;
+
+  /// Account \p n bytes read from \p from.
+  void count_read(RelayConn &from, size_t n) noexcept;
+
   RelayConn client_;
   RelayConn server_;
   TimePoint start_time_;
+  ProxyHeader preamble_; // sent ahead of the first client payload
+  ClientLease lease_;
+  std::unique_ptr<RelayShaper> shaper_;
+  RelayScheduler *scheduler_ = nullptr;
+  bool metered_ = false;
+  size_t metrics_tuple_ = 0;
+  uint32_t latency_series_ = 0;
+  std::chrono::steady_clock::time_point connected_;
+  bool tcp_sampled_ = false;
+
+  static std::atomic<size_t> live_;
+};
+
+class RelayIOContext;
+class Tunnel;
+class UdpRelay;
+
+/// Accepted client connection on its way to a Relay. Runs the inbound
+/// stages on the first client bytes, then dials the upstream. Bytes read
+/// by the stages are kept and delivered upstream first.
+class RelayHandshake : public std::enable_shared_from_this<RelayHandshake> {
+public:
+  RelayHandshake(RelayIOContext &context, RelaySocket client_conn,
+                 const RelayEndpoint &client_laddr,
+                 const RelayEndpoint &client_raddr,
+                 const RelayEndpointTuple &endpoint_tuple,
+                 ClientLease lease = ClientLease());
+
+  ~RelayHandshake();
+
+  void start() noexcept;
+
+  /// Handshakes of all contexts not yet destroyed.
+  static size_t live() { return live_.load(std::memory_order_relaxed); }
+
+private:
+  /// Transparent tuples, recover the destination the client dialed.
+  bool recover_dst() noexcept;
+
+  void read_proxy_header() noexcept;
+
+  /// Accept proxy tuples, check the client the PROXY header names against
+  /// the acl and client limits, on accept only the sender's address was
+  /// known.
+  bool admit_proxied() noexcept;
+
+  /// Peek stages, pick dst_ from the first client bytes.
+  void route() noexcept;
+
+  void peek() noexcept;
+
+  /// Return false while more bytes are needed.
+  bool sniff_protocol(const char *data, size_t n) noexcept;
+
+  bool read_client_hello(const char *data, size_t n) noexcept;
+
+  bool read_http_host(const char *data, size_t n) noexcept;
+
+  /// Front-end tuples, read the CONNECT or SOCKS5 request naming dst_.
+  void read_request() noexcept;
+
+  void resolve(const ConnectTarget &target) noexcept;
+
+  void select_dst(const std::vector<asio::ip::tcp::endpoint> &candidates,
+                  const std::string &key) noexcept;
+
+  /// Tell the front-end client why its request failed, then close.
+  void reject(const std::error_code &ec) noexcept;
+
+  void connect() noexcept;
+
+  void start_relay(const RelayEndpoint &server_laddr) noexcept;
+
+  void close() noexcept;
+
+  RelayIOContext &context_;
+  RelaySocket client_conn_;
+  RelaySocket server_conn_;
+  RelayEndpoint client_laddr_;
+  RelayEndpoint client_raddr_;
+  const RelayEndpointTuple &endpoint_tuple_;
+  RelayEndpoint dst_;
+  Relay::SharedBuffer client_buf_;
+  std::chrono::steady_clock::time_point accepted_;
+  std::chrono::steady_clock::time_point connected_;
+  uint32_t latency_series_ = 0; // of dst_, once connected
+  asio::steady_timer deadline_;
+  bool peek_expired_; // peek stage gave up waiting, use the default dst
+  bool sniff_pending_;
+  bool sni_pending_;
+  bool host_pending_;
+  uint32_t sniff_state_;
+  size_t sniff_offset_; // bytes fed to the sniffer so far
+  bool socks_greeted_;
+  std::string reply_; // front-end reply being written
+  ClientLease lease_; // passed on to the Relay
+
+  static std::atomic<size_t> live_;
 };
 
 class RelayIOContext : private asio::noncopyable {
 public:
   RelayIOContext() = delete;
   RelayIOContext(size_t id,
-                 const std::vector<RelayEndpointTuple> &endpoint_tuples);
+                 const std::vector<RelayEndpointTuple> &endpoint_tuples,
+                 size_t quantum, size_t tcp_info_every);
 
-  void run() { context_.run(); }
+  void run() {
+    connect_tunnels();
+    context_.run();
+  }
 
   void new_conn(int connfd, const RelayEndpointTuple &endpoint_tuple) noexcept;
 
   asio::io_context &context() { return context_; }
 
+  /// The tunnel carrying streams of a tunnel client tuple, reconnected if the
+  /// previous one went down.
+  std::shared_ptr<Tunnel> tunnel(const RelayEndpointTuple &endpoint_tuple);
+
+  /// Destinations resolved for a frontend tuple, kept per tuple since each
+  /// has its own allowlist.
+  ConnectCache &connect_cache(const RelayEndpointTuple &endpoint_tuple) {
+    return connect_caches_[endpoint_tuple.listen];
+  }
+
+  /// Live clients of a tuple with client limits on this context.
+  ClientTable &client_table(const RelayEndpointTuple &endpoint_tuple) {
+    return client_tables_[endpoint_tuple.listen];
+  }
+
+  ShapingQueue &shaping_queue() { return shaping_queue_; }
+
+  RelayScheduler &scheduler() { return scheduler_; }
+
+  /// Sample TCP_INFO of one in tcp_info_every relays started here, on every
+  /// timer expiry.
+  void track_tcp_info(const std::shared_ptr<Relay> &relay);
+
 public:
   static const std::chrono::seconds kTimerExpirySeconds;
 
 private:
   void wait_timer() noexcept;
 
+  void connect_tunnels() noexcept;
+
+  void sample_tcp_info() noexcept;
+
   size_t id_;
   asio::io_context context_;
   asio::steady_timer timer_; // keep io_context not empty
   std::vector<RelayEndpointTuple> endpoint_tuples_;
+  std::map<RelayEndpoint, std::shared_ptr<Tunnel>> tunnels_;
+  std::vector<std::shared_ptr<UdpRelay>> udp_relays_;
+  std::map<RelayEndpoint, ConnectCache> connect_caches_;
+  std::map<RelayEndpoint, ClientTable> client_tables_;
+  ShapingQueue shaping_queue_;
+  RelayScheduler scheduler_;
+  size_t tcp_info_every_; // 0 samples none
+  size_t tcp_info_count_ = 0;
+  std::vector<std::weak_ptr<Relay>> tcp_sampled_;
 };
 
 class RelayServer {
 public:
-  RelayServer(std::vector<RelayEndpointTuple> endpoint_tuples);
+  /// \p bandwidth caps all relays together in bytes per second, 0 is
+  /// unlimited. \p quantum is the RelayScheduler turn, 0 disables it.
+  RelayServer(std::vector<RelayEndpointTuple> endpoint_tuples,
+              uint64_t bandwidth = 0, size_t quantum = kDefaultQuantum);
+
+  static const size_t kDefaultQuantum = 1024 * 32;
+
+  /// How long an upgraded process waits for its relays before quitting.
+  void set_drain_timeout(std::chrono::seconds timeout) {
+    drain_timeout_ = timeout;
+  }
+
+  /// Sample TCP_INFO of one in \p every relays, 0 samples none.
+  void set_tcp_info_every(size_t every) { tcp_info_every_ = every; }
+
+  static const size_t kDefaultTcpInfoEvery = 64;
+
+  /// Serve metrics() on \p endpoint once running.
+  void set_metrics(const RelayEndpoint &endpoint) {
+    metrics_endpoint_ = endpoint;
+    serve_metrics_ = true;
+  }
 
   void run(size_t co_num);
 
 private:
   struct Acceptor {
     RelayEndpointTuple endpoint_tuple_;
-    asio::ip::tcp::acceptor acceptor_;
+    asio::basic_socket_acceptor<asio::generic::stream_protocol> acceptor_;
 
+    /// Listen on \p fd if not -1, it was passed by a predecessor.
     Acceptor(asio::io_context &context,
-             const RelayEndpointTuple &endpoint_tuple)
-        : endpoint_tuple_(endpoint_tuple),
-          acceptor_(context, endpoint_tuple.listen) {}
+             const RelayEndpointTuple &endpoint_tuple, int fd = -1);
   };
 
   void do_accept(Acceptor &acceptor) noexcept;
 
+  /// SIGHUP reloads acl files, SIGUSR2 upgrades.
+  void wait_signals() noexcept;
+
+  void reload_acl() noexcept;
+
+  /// Start this binary again, hand it the listeners and drain once it
+  /// accepts.
+  void upgrade() noexcept;
+
+  /// Stop accepting, quit when relays and tunnel streams are done or the
+  /// drain timeout passed.
+  void drain() noexcept;
+
+  void wait_drained(std::chrono::steady_clock::time_point deadline) noexcept;
+
+  /// Name of the metrics listener handed over on upgrade, apart from relay
+  /// listeners.
+  std::string metrics_listener_name() const {
+    return "metrics " + to_string(metrics_endpoint_);
+  }
+
   std::vector<RelayEndpointTuple> endpoint_tuples_;
   std::vector<std::shared_ptr<Acceptor>> acceptors_;
   std::vector<std::shared_ptr<RelayIOContext>> relay_contexts_;
   size_t relay_context_idx_;
+  size_t quantum_;
+  size_t tcp_info_every_ = kDefaultTcpInfoEvery;
+  std::unique_ptr<asio::signal_set> signals_;
+  std::atomic<bool> reloading_;
+  InheritedListeners inherited_;
+  std::chrono::seconds drain_timeout_{60};
+  std::unique_ptr<RelaySocket> upgrade_channel_; // to the successor
+  pid_t successor_ = 0;
+  char upgrade_reply_ = 0;
+  bool draining_ = false;
+  std::unique_ptr<asio::steady_timer> drain_timer_;
+  bool serve_metrics_ = false;
+  RelayEndpoint metrics_endpoint_;
+  std::unique_ptr<MetricsServer> metrics_server_;
 };
\ No newline at end of file
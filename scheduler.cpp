@@ -0,0 +1,49 @@
+//===- scheduler.cpp - Relay scheduling -------------------------*- C++ -*-===//
+//
+/// \file
+/// Deficit round robin between the relays of one context.
+//
+// Author:  zxh
+// Date:    2026/10/17 19:34:50
+//===----------------------------------------------------------------------===//
+
+#include "scheduler.h"
+
+#include <asio/post.hpp>
+
+#include <algorithm>
+#include <cstdint>
+
+void RelayScheduler::ready(size_t &deficit, Turn turn) {
+  ready_.push_back(Flow{&deficit, std::move(turn)});
+  if (!posted_) {
+    posted_ = true;
+    asio::post(context_, [this]() { round(); });
+  }
+}
+
+void RelayScheduler::round() noexcept {
+  // Flows made ready during the round wait for the next one. A flow alone
+  // in its round has no one to wait for and reads all it can.
+  size_t n = ready_.size();
+  if (n == 1) {
+    Flow flow = std::move(ready_.front());
+    ready_.pop_front();
+    flow.turn(SIZE_MAX);
+    *flow.deficit = 0;
+  } else {
+    for (; n > 0; n--) {
+      Flow flow = std::move(ready_.front());
+      ready_.pop_front();
+
+      size_t left = flow.turn(*flow.deficit + quantum_);
+      *flow.deficit = std::min(left, quantum_);
+    }
+  }
+
+  if (ready_.empty()) {
+    posted_ = false;
+    return;
+  }
+  asio::post(context_, [this]() { round(); });
+}
@@ -0,0 +1,51 @@
+//===- scheduler.h - Relay scheduling ---------------------------*- C++ -*-===//
+//
+/// \file
+/// Deficit round robin between the relays of one context.
+//
+// Author:  zxh
+// Date:    2026/10/17 19:26:18
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <asio/io_context.hpp>
+
+#include <deque>
+#include <functional>
+
+/// Relay directions with bytes to read take turns. Every turn adds a quantum
+/// to the direction's deficit and it may read that many bytes, so a bulk
+/// flow moves at most a quantum before every other ready flow had its turn.
+/// A flow that drained before using its deficit loses the rest. A flow
+/// alone in its round is not held back.
+class RelayScheduler {
+public:
+  /// Reads up to the given budget. Returns the budget it could not use for
+  /// lack of buffer space, 0 once the flow drained.
+  using Turn = std::function<size_t(size_t budget)>;
+
+  /// \p quantum 0 disables scheduling, see enabled().
+  RelayScheduler(asio::io_context &context, size_t quantum)
+      : context_(context), quantum_(quantum), posted_(false) {}
+
+  bool enabled() const { return quantum_ > 0; }
+
+  /// Queue a readable flow, \p deficit lives with the flow.
+  void ready(size_t &deficit, Turn turn);
+
+private:
+  struct Flow {
+    size_t *deficit;
+    Turn turn;
+  };
+
+  /// One round over the flows ready when it starts, the next round is
+  /// posted so other handlers run in between.
+  void round() noexcept;
+
+  asio::io_context &context_;
+  size_t quantum_;
+  bool posted_;
+  std::deque<Flow> ready_;
+};
@@ -0,0 +1,122 @@
+//===- shaper.cpp - Relay bandwidth shaping ---------------------*- C++ -*-===//
+//
+/// \file
+/// Token buckets per connection, per tuple and global.
+//
+// Author:  zxh
+// Date:    2026/10/17 18:44:02
+//===----------------------------------------------------------------------===//
+
+#include "shaper.h"
+
+#include <algorithm>
+
+const std::chrono::milliseconds ShapingQueue::kTick(10);
+
+static int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+TokenBucket::TokenBucket(uint64_t rate)
+    : rate_(rate), burst_(std::max<int64_t>(rate / 10, 1500)),
+      tokens_(burst_), last_ns_(now_ns()) {}
+
+void TokenBucket::refill(int64_t now) noexcept {
+  int64_t last = last_ns_.load(std::memory_order_relaxed);
+  int64_t elapsed = now - last;
+  if (elapsed <= 0)
+    return;
+
+  // The refill stamp only moves by the time the added tokens stand for, so
+  // frequent refills don't round the rate down.
+  int64_t add, next;
+  if (elapsed >= 1000000000) {
+    add = burst_;
+    next = now;
+  } else {
+    add = int64_t(double(rate_) * elapsed / 1e9);
+    if (add == 0)
+      return;
+    next = last + int64_t(double(add) * 1e9 / rate_);
+  }
+  if (!last_ns_.compare_exchange_strong(last, next,
+                                        std::memory_order_relaxed))
+    return; // another context accounted this interval
+
+  int64_t cur = tokens_.load(std::memory_order_relaxed);
+  while (cur < burst_ &&
+         !tokens_.compare_exchange_weak(cur, std::min(burst_, cur + add),
+                                        std::memory_order_relaxed))
+    ;
+}
+
+size_t TokenBucket::take(size_t want, int64_t now) noexcept {
+  refill(now);
+  int64_t cur = tokens_.load(std::memory_order_relaxed);
+  int64_t n;
+  do {
+    n = std::min<int64_t>(cur, want);
+    if (n <= 0)
+      return 0;
+  } while (!tokens_.compare_exchange_weak(cur, cur - n,
+                                          std::memory_order_relaxed));
+  return n;
+}
+
+void TokenBucket::give(size_t n) noexcept {
+  tokens_.fetch_add(n, std::memory_order_relaxed);
+}
+
+void ShapingQueue::wait(std::function<void()> resume) {
+  waiters_.push_back(std::move(resume));
+  if (waiters_.size() == 1) {
+    timer_.expires_after(kTick);
+    timer_.async_wait([this](std::error_code ec) {
+      if (!ec)
+        tick();
+    });
+  }
+}
+
+void ShapingQueue::tick() noexcept {
+  // Waiters that still find no tokens queue again, and restart the timer.
+  std::vector<std::function<void()>> waiters;
+  waiters.swap(waiters_);
+  for (auto &w : waiters)
+    w();
+}
+
+RelayShaper::RelayShaper(ShapingQueue &queue, uint64_t conn_rate,
+                         std::shared_ptr<TokenBucket> tuple,
+                         std::shared_ptr<TokenBucket> global)
+    : queue_(queue), tuple_(std::move(tuple)), global_(std::move(global)),
+      level_count_(0) {
+  if (conn_rate > 0) {
+    conn_ = std::make_unique<TokenBucket>(conn_rate);
+    levels_[level_count_++] = conn_.get();
+  }
+  if (tuple_)
+    levels_[level_count_++] = tuple_.get();
+  if (global_)
+    levels_[level_count_++] = global_.get();
+}
+
+size_t RelayShaper::take(size_t want) noexcept {
+  int64_t now = now_ns();
+  size_t n = want;
+  for (int i = 0; i < level_count_ && n > 0; i++) {
+    size_t got = levels_[i]->take(n, now);
+    // Inner levels gave more than this one allows, return the difference.
+    for (int j = 0; j < i && got < n; j++)
+      levels_[j]->give(n - got);
+    n = got;
+  }
+  return n;
+}
+
+void RelayShaper::give(size_t n) noexcept {
+  for (int i = 0; i < level_count_; i++)
+    levels_[i]->give(n);
+}
@@ -0,0 +1,87 @@
+//===- shaper.h - Relay bandwidth shaping -----------------------*- C++ -*-===//
+//
+/// \file
+/// Token buckets per connection, per tuple and global.
+//
+// Author:  zxh
+// Date:    2026/10/17 18:31:45
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <asio/io_context.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/// Bytes per second with a burst of a tenth of a second. Tuple and global
+/// buckets are taken from by every context, so the level is atomic and
+/// whoever touches the bucket first adds the tokens of the elapsed time.
+class TokenBucket {
+public:
+  explicit TokenBucket(uint64_t rate);
+
+  /// Take up to \p want tokens, return how many were taken.
+  size_t take(size_t want, int64_t now_ns) noexcept;
+
+  /// Return tokens taken but not used.
+  void give(size_t n) noexcept;
+
+  uint64_t rate() const { return rate_; }
+
+private:
+  void refill(int64_t now_ns) noexcept;
+
+  uint64_t rate_;
+  int64_t burst_;
+  std::atomic<int64_t> tokens_;
+  std::atomic<int64_t> last_ns_;
+};
+
+/// Reads of one context paused for tokens. They are retried every tick while
+/// any is waiting, the timer is idle otherwise.
+class ShapingQueue {
+public:
+  static const std::chrono::milliseconds kTick;
+
+  explicit ShapingQueue(asio::io_context &context) : timer_(context) {}
+
+  void wait(std::function<void()> resume);
+
+private:
+  void tick() noexcept;
+
+  asio::steady_timer timer_;
+  std::vector<std::function<void()>> waiters_;
+};
+
+/// Buckets one relay draws from, its own first, then the tuple's and the
+/// global one. Tokens idle in the shared buckets are used by whichever
+/// relay reads next, so a busy relay borrows what quiet ones leave.
+class RelayShaper {
+public:
+  RelayShaper(ShapingQueue &queue, uint64_t conn_rate,
+              std::shared_ptr<TokenBucket> tuple,
+              std::shared_ptr<TokenBucket> global);
+
+  /// Take up to \p want tokens from every level, return how many were
+  /// taken, 0 means wait().
+  size_t take(size_t want) noexcept;
+
+  void give(size_t n) noexcept;
+
+  void wait(std::function<void()> resume) { queue_.wait(std::move(resume)); }
+
+private:
+  ShapingQueue &queue_;
+  std::unique_ptr<TokenBucket> conn_;
+  std::shared_ptr<TokenBucket> tuple_;
+  std::shared_ptr<TokenBucket> global_;
+  TokenBucket *levels_[3];
+  int level_count_;
+};
@@ -0,0 +1,229 @@
+//===- sni.cpp - TLS SNI routing --------------------------------*- C++ -*-===//
+//
+/// \file
+/// Extract the server name from a TLS ClientHello and map it to a
+/// destination.
+//
+// Author:  zxh
+// Date:    2026/10/16 16:10:21
+//===----------------------------------------------------------------------===//
+
+#include "sni.h"
+#include "errors.h"
+
+#include <algorithm>
+
+static bool fail(std::error_code &ec, TlsErrors err) {
+  ec = std::error_code(err, tls_category());
+  return false;
+}
+
+// Bounds checked cursor over the ClientHello body.
+struct Reader {
+  const uint8_t *p;
+  const uint8_t *end;
+
+  size_t left() const { return end - p; }
+
+  bool skip(size_t n) {
+    if (left() < n)
+      return false;
+    p += n;
+    return true;
+  }
+
+  bool u8(size_t &v) {
+    if (left() < 1)
+      return false;
+    v = p[0];
+    p += 1;
+    return true;
+  }
+
+  bool u16(size_t &v) {
+    if (left() < 2)
+      return false;
+    v = (p[0] << 8) | p[1];
+    p += 2;
+    return true;
+  }
+
+  // Skip a vector with an \p width byte length prefix.
+  bool skip_vector(int width) {
+    size_t len;
+    if (!(width == 1 ? u8(len) : u16(len)))
+      return false;
+    return skip(len);
+  }
+};
+
+bool parse_tls_sni(const char *data, size_t n, std::string_view &sni,
+                   std::error_code &ec) noexcept {
+  ec = std::error_code();
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+
+  // Record header: type:8 version:16 length:16, then the handshake header
+  // type:8 length:24. Reject early so other protocols aren't kept waiting.
+  if (n >= 1 && p[0] != 0x16)
+    return fail(ec, TlsErrNotHandshake);
+  if (n >= 2 && p[1] != 0x03)
+    return fail(ec, TlsErrNotHandshake);
+  if (n >= 6 && p[5] != 0x01)
+    return fail(ec, TlsErrNotHandshake);
+  if (n < 9)
+    return fail(ec, TlsErrIncomplete);
+
+  size_t record_len = (p[3] << 8) | p[4];
+  size_t hello_len = (p[6] << 16) | (p[7] << 8) | p[8];
+  if (record_len < 4 || record_len > kTlsMaxPeekSize - 5)
+    return fail(ec, TlsErrMalformed);
+
+  // A ClientHello split over several records is looked at up to the end of
+  // the first one, the server name comes early in practice.
+  size_t body_len = std::min(hello_len, record_len - 4);
+  if (n < 9 + body_len)
+    return fail(ec, TlsErrIncomplete);
+
+  Reader r{p + 9, p + 9 + body_len};
+  size_t ext_len;
+  if (!r.skip(2 + 32) || !r.skip_vector(1) || !r.skip_vector(2) ||
+      !r.skip_vector(1))
+    return fail(ec, TlsErrMalformed);
+  if (!r.u16(ext_len))
+    return fail(ec, TlsErrNoServerName); // no extensions at all
+  if (ext_len < r.left())
+    r.end = r.p + ext_len;
+
+  while (r.left() >= 4) {
+    size_t type, len;
+    r.u16(type);
+    r.u16(len);
+    if (type != 0x0000) { // server_name
+      if (!r.skip(len))
+        break;
+      continue;
+    }
+
+    Reader ext{r.p, r.p + std::min(len, r.left())};
+    size_t list_len, name_type, name_len;
+    if (!ext.u16(list_len) || !ext.u8(name_type) || !ext.u16(name_len) ||
+        name_type != 0 || name_len == 0 || ext.left() < name_len)
+      return fail(ec, TlsErrMalformed);
+    sni = std::string_view(reinterpret_cast<const char *>(ext.p), name_len);
+    if (sni.find('\0') != std::string_view::npos)
+      return fail(ec, TlsErrMalformed);
+    return true;
+  }
+  return fail(ec, TlsErrNoServerName);
+}
+
+static char lower(char c) { return c >= 'A' && c <= 'Z' ? c + 32 : c; }
+
+// Compare a stored lower case label with a label of the queried name, bytes
+// as unsigned. Children are sorted with it too, so both orders agree.
+static int compare_label(std::string_view stored, std::string_view name) {
+  size_t n = std::min(stored.size(), name.size());
+  for (size_t i = 0; i < n; i++) {
+    unsigned char a = stored[i];
+    unsigned char b = lower(name[i]);
+    if (a != b)
+      return a < b ? -1 : 1;
+  }
+  if (stored.size() == name.size())
+    return 0;
+  return stored.size() < name.size() ? -1 : 1;
+}
+
+SniTable::SniTable() : nodes_(1) {}
+
+bool SniTable::add(const std::string &pattern, const Endpoint &dst) {
+  std::string_view name = pattern;
+  bool wildcard = name.size() > 2 && name.substr(0, 2) == "*.";
+  if (wildcard)
+    name.remove_prefix(2);
+  if (!name.empty() && name.back() == '.')
+    name.remove_suffix(1);
+  if (name.empty() || name.find('*') != std::string_view::npos)
+    return false;
+
+  uint32_t node = 0;
+  size_t end = name.size();
+  while (true) {
+    size_t dot = name.rfind('.', end - 1);
+    size_t begin = dot == std::string_view::npos ? 0 : dot + 1;
+    if (begin == end)
+      return false; // empty label
+
+    std::string label(name.substr(begin, end - begin));
+    std::transform(label.begin(), label.end(), label.begin(), lower);
+    int32_t child = find_child(node, label);
+    if (child < 0) {
+      child = nodes_.size();
+      nodes_.emplace_back();
+      nodes_.back().label = label;
+      auto &children = nodes_[node].children;
+      auto it = std::lower_bound(
+          children.begin(), children.end(), label,
+          [this](uint32_t c, const std::string &l) {
+            return compare_label(nodes_[c].label, l) < 0;
+          });
+      children.insert(it, child);
+    }
+    node = child;
+    if (begin == 0)
+      break;
+    end = dot;
+  }
+
+  int32_t &slot = wildcard ? nodes_[node].wildcard : nodes_[node].exact;
+  if (slot < 0) {
+    slot = dsts_.size();
+    dsts_.push_back(dst);
+  } else {
+    dsts_[slot] = dst;
+  }
+  routes_.emplace_back(pattern, dst);
+  return true;
+}
+
+int32_t SniTable::find_child(uint32_t node,
+                             std::string_view label) const noexcept {
+  const auto &children = nodes_[node].children;
+  size_t lo = 0, hi = children.size();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    int c = compare_label(nodes_[children[mid]].label, label);
+    if (c == 0)
+      return children[mid];
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+const SniTable::Endpoint *
+SniTable::find(std::string_view name) const noexcept {
+  if (!name.empty() && name.back() == '.')
+    name.remove_suffix(1);
+
+  uint32_t node = 0;
+  size_t end = name.size();
+  while (end > 0) {
+    size_t dot = name.rfind('.', end - 1);
+    size_t begin = dot == std::string_view::npos ? 0 : dot + 1;
+
+    // One label left, a wildcard at this depth covers it.
+    int32_t wildcard = begin == 0 ? nodes_[node].wildcard : -1;
+    int32_t child = find_child(node, name.substr(begin, end - begin));
+    if (child >= 0 && begin == 0 && nodes_[child].exact >= 0)
+      return &dsts_[nodes_[child].exact];
+    if (child < 0 || begin == 0)
+      return wildcard >= 0 ? &dsts_[wildcard] : nullptr;
+
+    node = child;
+    end = dot;
+  }
+  return nullptr;
+}
@@ -0,0 +1,67 @@
+//===- sni.h - TLS SNI routing ----------------------------------*- C++ -*-===//
+//
+/// \file
+/// Extract the server name from a TLS ClientHello and map it to a
+/// destination.
+//
+// Author:  zxh
+// Date:    2026/10/16 16:02:44
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <asio/generic/stream_protocol.hpp>
+
+// A ClientHello is expected within the first TLS record.
+const size_t kTlsMaxPeekSize = 5 + 1024 * 16;
+
+/// Parse the ClientHello record at the start of \p data and point \p sni
+/// into it. Return true on success, otherwise set \p ec, TlsErrIncomplete
+/// means more bytes are needed. Nothing is copied or allocated.
+bool parse_tls_sni(const char *data, size_t n, std::string_view &sni,
+                   std::error_code &ec) noexcept;
+
+/// Server name to destination table. Names are stored as a trie of labels
+/// from the right, so a lookup walks the name once and a binary search picks
+/// each child. "*.example.com" matches exactly one label in front of
+/// example.com, an exact name wins over a wildcard.
+class SniTable {
+public:
+  using Endpoint = asio::generic::stream_protocol::endpoint;
+
+  SniTable();
+
+  /// Add \p pattern, a host name optionally starting with "*.". Return false
+  /// if the pattern is malformed.
+  bool add(const std::string &pattern, const Endpoint &dst);
+
+  /// Destination of \p name, nullptr if nothing matches.
+  const Endpoint *find(std::string_view name) const noexcept;
+
+  bool empty() const { return dsts_.empty(); }
+
+  /// Registered (pattern, destination) pairs, in insertion order.
+  const std::vector<std::pair<std::string, Endpoint>> &routes() const {
+    return routes_;
+  }
+
+private:
+  struct Node {
+    std::string label;
+    std::vector<uint32_t> children; // sorted by label
+    int32_t exact = -1;             // index into dsts_
+    int32_t wildcard = -1;
+  };
+
+  int32_t find_child(uint32_t node, std::string_view label) const noexcept;
+
+  std::vector<Node> nodes_; // nodes_[0] is the root
+  std::vector<Endpoint> dsts_;
+  std::vector<std::pair<std::string, Endpoint>> routes_;
+};
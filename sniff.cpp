@@ -0,0 +1,91 @@
+//===- sniff.cpp - Protocol detection ---------------------------*- C++ -*-===//
+//
+/// \file
+/// Tell protocols apart by the first client bytes and map them to
+/// destinations.
+//
+// Author:  zxh
+// Date:    2026/10/17 09:34:12
+//===----------------------------------------------------------------------===//
+
+#include "sniff.h"
+
+#include <cctype>
+
+// Handshake record of TLS 1.0 and later, SSLv3 clients are long gone.
+static const char kTlsPrefix[] = {0x16, 0x03};
+
+static const char *kHttpMethods[] = {
+    "GET ",    "HEAD ",    "POST ",  "PUT ",   "DELETE ",
+    "OPTIONS ", "CONNECT ", "PATCH ", "TRACE ",
+};
+
+static bool parse_hex(const std::string &s, std::string &out) {
+  if (s.empty() || s.size() % 2 != 0)
+    return false;
+  for (size_t i = 0; i < s.size(); i += 2) {
+    if (!std::isxdigit(s[i]) || !std::isxdigit(s[i + 1]))
+      return false;
+    out.push_back(char(std::stoi(s.substr(i, 2), nullptr, 16)));
+  }
+  return true;
+}
+
+SniffTable::SniffTable() : nodes_(1), timeout_route_(-1) {}
+
+bool SniffTable::add(const std::string &proto, const Endpoint &dst) {
+  int32_t route = routes_.size();
+  bool ok = true;
+  if (proto == "tls") {
+    ok = add_pattern(std::string(kTlsPrefix, sizeof(kTlsPrefix)), route);
+  } else if (proto == "ssh") {
+    ok = add_pattern("SSH-", route);
+  } else if (proto == "http") {
+    for (const char *m : kHttpMethods)
+      ok = ok && add_pattern(m, route);
+  } else if (proto == "timeout") {
+    timeout_route_ = route;
+  } else if (proto.compare(0, 4, "hex:") == 0) {
+    std::string pattern;
+    ok = parse_hex(proto.substr(4), pattern) && add_pattern(pattern, route);
+  } else if (proto.compare(0, 4, "str:") == 0) {
+    ok = add_pattern(proto.substr(4), route);
+  } else {
+    ok = false;
+  }
+  if (ok)
+    routes_.push_back({proto, dst});
+  return ok;
+}
+
+bool SniffTable::add_pattern(const std::string &pattern, int32_t route) {
+  if (pattern.empty())
+    return false;
+
+  uint32_t node = 0;
+  for (char c : pattern) {
+    int32_t next = nodes_[node].next[uint8_t(c)];
+    if (next < 0) {
+      next = nodes_.size();
+      nodes_[node].next[uint8_t(c)] = next;
+      nodes_.emplace_back();
+    }
+    node = next;
+  }
+  if (nodes_[node].route < 0)
+    nodes_[node].route = route;
+  return true;
+}
+
+int SniffTable::feed(uint32_t &state, const char *data,
+                     size_t n) const noexcept {
+  for (size_t i = 0; i < n; i++) {
+    int32_t next = nodes_[state].next[uint8_t(data[i])];
+    if (next < 0)
+      return kSniffNone;
+    state = next;
+    if (nodes_[state].route >= 0)
+      return nodes_[state].route;
+  }
+  return kSniffMore;
+}
@@ -0,0 +1,67 @@
+//===- sniff.h - Protocol detection -----------------------------*- C++ -*-===//
+//
+/// \file
+/// Tell protocols apart by the first client bytes and map them to
+/// destinations.
+//
+// Author:  zxh
+// Date:    2026/10/17 09:20:36
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <asio/generic/stream_protocol.hpp>
+
+// Results of SniffTable::feed besides a route index.
+const int kSniffMore = -1; // every byte so far matches some prefix
+const int kSniffNone = -2; // no prefix matches
+
+/// Prefix patterns compiled into one byte-indexed automaton. A client is
+/// matched in a single pass over its bytes, however many protocols there
+/// are, and the shortest matching prefix wins.
+///
+/// Protocols: tls, ssh, http (request methods), hex:<bytes>, str:<text>,
+/// and timeout for clients that send nothing recognizable in time.
+class SniffTable {
+public:
+  using Endpoint = asio::generic::stream_protocol::endpoint;
+
+  struct Route {
+    std::string proto;
+    Endpoint dst;
+  };
+
+  SniffTable();
+
+  /// Add a route for \p proto. Return false if the protocol is unknown or
+  /// its pattern is malformed.
+  bool add(const std::string &proto, const Endpoint &dst);
+
+  /// Advance \p state, 0 before the first byte, over the next \p n bytes.
+  /// Return the matched route index, kSniffMore or kSniffNone.
+  int feed(uint32_t &state, const char *data, size_t n) const noexcept;
+
+  const std::vector<Route> &routes() const { return routes_; }
+
+  /// Route for clients still undecided at the peek deadline, -1 if none.
+  int timeout_route() const { return timeout_route_; }
+
+private:
+  struct Node {
+    Node() { next.fill(-1); }
+
+    std::array<int32_t, 256> next;
+    int32_t route = -1;
+  };
+
+  bool add_pattern(const std::string &pattern, int32_t route);
+
+  std::vector<Node> nodes_; // nodes_[0] is the start state
+  std::vector<Route> routes_;
+  int timeout_route_;
+};
@@ -0,0 +1,36 @@
+//===- tcp_info.cpp - TCP_INFO samples --------------------------*- C++ -*-===//
+//
+/// \file
+/// Kernel TCP state of a connected socket, read with TCP_INFO. The glibc
+/// struct tcp_info stops before the fields added since Linux 4.9, so this
+/// file takes the kernel's and must stay clear of <netinet/tcp.h> and asio.
+//
+// Author:  zxh
+// Date:    2026/10/17 23:43:02
+//===----------------------------------------------------------------------===//
+
+#include "tcp_info.h"
+
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+
+void read_tcp_info(int fd, TcpSample &sample, std::error_code &ec) noexcept {
+  // Older kernels fill a prefix and leave the rest zero.
+  struct tcp_info info = {};
+  socklen_t len = sizeof(info);
+  if (::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+    ec.assign(errno, std::system_category());
+    return;
+  }
+  ec.clear();
+  sample.rtt_us = info.tcpi_rtt;
+  sample.retransmits = info.tcpi_total_retrans;
+  sample.cwnd = info.tcpi_snd_cwnd;
+  sample.delivery_rate = info.tcpi_delivery_rate;
+  sample.busy_us = info.tcpi_busy_time;
+  sample.rwnd_limited_us = info.tcpi_rwnd_limited;
+  sample.sndbuf_limited_us = info.tcpi_sndbuf_limited;
+}
@@ -0,0 +1,28 @@
+//===- tcp_info.h - TCP_INFO samples ----------------------------*- C++ -*-===//
+//
+/// \file
+/// Kernel TCP state of a connected socket, read with TCP_INFO.
+//
+// Author:  zxh
+// Date:    2026/10/17 23:41:27
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstdint>
+#include <system_error>
+
+/// The TCP_INFO fields telling a slow peer from a slow network. Fields a
+/// kernel does not report stay 0.
+struct TcpSample {
+  uint32_t rtt_us = 0;            // smoothed round trip time
+  uint32_t retransmits = 0;       // segments retransmitted so far
+  uint32_t cwnd = 0;              // congestion window in segments
+  uint64_t delivery_rate = 0;     // bytes per second, recent estimate
+  uint64_t busy_us = 0;           // time with data in flight
+  uint64_t rwnd_limited_us = 0;   // of which held by the peer's window
+  uint64_t sndbuf_limited_us = 0; // of which held by our send buffer
+};
+
+/// Read the TCP_INFO of \p fd into \p sample.
+void read_tcp_info(int fd, TcpSample &sample, std::error_code &ec) noexcept;
@@ -0,0 +1,563 @@
+//===- tunnel.cpp - Stream multiplexing tunnel ------------------*- C++ -*-===//
+//
+/// \file
+/// Multiplex many client streams over one persistent TCP connection between
+/// two mux instances.
+//
+// Author:  zxh
+// Date:    2026/10/16 11:40:53
+//===----------------------------------------------------------------------===//
+
+#include "tunnel.h"
+#include "errors.h"
+#include "logrus.h"
+#include "netutil.h"
+
+#include <cstring>
+
+using asio::ip::tcp;
+
+// Bytes read from the tunnel socket at once, and the size a write batch may
+// grow to before it is sent.
+const size_t kTunnelReadSize = 1024 * 64;
+const size_t kTunnelWriteBatch = 1024 * 64;
+
+// Return flow control credit once a quarter of the window was written out,
+// the sender still has the rest so it never stalls waiting for it.
+const uint32_t kWindowUpdateThreshold = kStreamInitialWindow / 4;
+
+static uint16_t be16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+static uint32_t be32(const uint8_t *p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+         (uint32_t(p[2]) << 8) | p[3];
+}
+
+static void put_be16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xFF;
+  p[2] = (v >> 8) & 0xFF;
+  p[3] = v & 0xFF;
+}
+
+static void append_frame(std::vector<char> &out, uint32_t id,
+                         TunnelFrameType type, const void *payload,
+                         size_t len) {
+  uint8_t hdr[kFrameHeaderSize];
+  put_be32(hdr, id);
+  hdr[4] = type;
+  hdr[5] = 0;
+  put_be16(hdr + 6, len);
+  out.insert(out.end(), hdr, hdr + sizeof(hdr));
+  if (len > 0) {
+    const char *p = static_cast<const char *>(payload);
+    out.insert(out.end(), p, p + len);
+  }
+}
+
+// OPEN payload, same layout as a PROXY v2 TCP6 address block.
+const size_t kOpenPayloadSize = 36;
+
+static asio::ip::address_v6 to_v6(const asio::ip::address &addr) {
+  if (addr.is_v6())
+    return addr.to_v6();
+  return asio::ip::make_address_v6(asio::ip::v4_mapped, addr.to_v4());
+}
+
+static asio::ip::address from_v6(const asio::ip::address_v6 &addr) {
+  if (addr.is_v4_mapped())
+    return asio::ip::make_address_v4(asio::ip::v4_mapped, addr);
+  return addr;
+}
+
+static void encode_open(uint8_t *p, const tcp::endpoint &src,
+                        const tcp::endpoint &dst) {
+  auto sb = to_v6(src.address()).to_bytes();
+  auto db = to_v6(dst.address()).to_bytes();
+  std::memcpy(p, sb.data(), 16);
+  std::memcpy(p + 16, db.data(), 16);
+  put_be16(p + 32, src.port());
+  put_be16(p + 34, dst.port());
+}
+
+static void decode_open(const uint8_t *p, tcp::endpoint &src,
+                        tcp::endpoint &dst) {
+  asio::ip::address_v6::bytes_type sb, db;
+  std::memcpy(sb.data(), p, 16);
+  std::memcpy(db.data(), p + 16, 16);
+  src = tcp::endpoint(from_v6(asio::ip::address_v6(sb)), be16(p + 32));
+  dst = tcp::endpoint(from_v6(asio::ip::address_v6(db)), be16(p + 34));
+}
+
+const char *to_string(TunnelMode mode) {
+  switch (mode) {
+  case kTunnelClient:
+    return "client";
+  case kTunnelServer:
+    return "server";
+  default:
+    return "none";
+  }
+}
+
+std::atomic<size_t> TunnelStream::live_(0);
+
+TunnelStream::TunnelStream(std::shared_ptr<Tunnel> tunnel, uint32_t id,
+                           RelaySocket conn)
+    : tunnel_(std::move(tunnel)), id_(id), conn_(std::move(conn)),
+      connected_(false), closed_(false), out_size_(0),
+      send_window_(kStreamInitialWindow), reading_(false), fin_sent_(false),
+      recv_window_(kStreamInitialWindow), unacked_(0), writing_(false),
+      fin_received_(false), read_count_(0), write_count_(0) {
+  live_.fetch_add(1, std::memory_order_relaxed);
+}
+
+TunnelStream::~TunnelStream() {
+  live_.fetch_sub(1, std::memory_order_relaxed);
+  LOG_INFO("Stream done", KV("id", id_), KV("laddr", laddr_text_),
+           KV("raddr", raddr_text_), KV("in_bytes", read_count_),
+           KV("out_bytes", write_count_));
+}
+
+void TunnelStream::connect(const tcp::endpoint &from,
+                           const tcp::endpoint &via) noexcept {
+  const RelayEndpointTuple &et = tunnel_->endpoint_tuple_;
+  std::error_code ec;
+  if (is_inet(et.dst) &&
+      (et.src.port() > 0 || !et.src.address().is_unspecified())) {
+    RelayEndpoint src(et.src);
+    conn_.open(src.protocol(), ec);
+    if (!ec)
+      conn_.bind(src, ec);
+    if (ec) {
+      LOG_ERROR("Fail to bind", KV("err", ec.message()),
+                KV("src", EndpointText(et.src)));
+      tunnel_->send_control(id_, kFrameReset, nullptr, 0);
+      abort();
+      return;
+    }
+  }
+
+  auto self = shared_from_this();
+  conn_.async_connect(et.dst, [this, self, from, via](std::error_code ec) {
+    if (closed_)
+      return;
+    const RelayEndpointTuple &et = tunnel_->endpoint_tuple_;
+    if (ec) {
+      LOG_ERROR("Fail to connect", KV("error", ec.message()),
+                KV("src", EndpointText(et.src)),
+                KV("dst", EndpointText(et.dst)), KV("stream", id_));
+      tunnel_->send_control(id_, kFrameReset, nullptr, 0);
+      abort();
+      return;
+    }
+
+    laddr_text_ = EndpointText(conn_.local_endpoint(ec));
+    raddr_text_ = EndpointText(et.dst);
+    LOG_INFO("Forward stream", KV("from", EndpointText(from)),
+             KV("via", EndpointText(via)), KV("to", raddr_text_),
+             KV("stream", id_));
+    // Clients on unix sockets arrive with port 0 and no address to tell.
+    if (et.send_proxy != kProxyNone && from.port() == 0)
+      preamble_.build_unknown(et.send_proxy);
+    else if (et.send_proxy != kProxyNone)
+      preamble_.build(et.send_proxy, from, via);
+    start();
+  });
+}
+
+void TunnelStream::start() noexcept {
+  connected_ = true;
+  read();
+  write();
+}
+
+void TunnelStream::read() noexcept {
+  if (closed_ || !connected_ || reading_ || out_size_ > 0 || fin_sent_ ||
+      send_window_ == 0)
+    return;
+
+  size_t limit = std::min<size_t>(kFrameMaxPayload, send_window_);
+  if (pending_ && pending_->size() > 0) {
+    auto data = pending_->data();
+    size_t n = std::min(limit, data.size());
+    std::memcpy(out_.data(), data.data(), n);
+    pending_->consume(n);
+    read_count_ += n;
+    out_size_ = n;
+    send_window_ -= n;
+    tunnel_->schedule(shared_from_this());
+    return;
+  }
+  pending_.reset();
+
+  reading_ = true;
+  auto self = shared_from_this();
+  conn_.async_read_some(
+      asio::buffer(out_.data(), limit),
+      [this, self](std::error_code ec, size_t n) {
+        reading_ = false;
+        if (closed_)
+          return;
+        if (ec) {
+          if (ec == asio::error::eof) {
+            LOG_DEBUG("Closed by", KV("laddr", laddr_text_),
+                      KV("raddr", raddr_text_), KV("stream", id_));
+            fin_sent_ = true;
+            tunnel_->send_control(id_, kFrameFin, nullptr, 0);
+            try_finish();
+          } else {
+            LOG_DEBUG("Fail to read from", KV("error", ec.message()),
+                      KV("laddr", laddr_text_),
+                      KV("raddr", raddr_text_), KV("stream", id_));
+            tunnel_->send_control(id_, kFrameReset, nullptr, 0);
+            abort();
+          }
+          return;
+        }
+        LOG_TRACE("Read", KV("laddr", laddr_text_),
+                  KV("raddr", raddr_text_), KV("n", n));
+        read_count_ += n;
+        out_size_ = n;
+        send_window_ -= n;
+        tunnel_->schedule(self);
+      });
+}
+
+void TunnelStream::write() noexcept {
+  if (closed_ || !connected_ || writing_)
+    return;
+
+  if (in_.empty() && preamble_.empty()) {
+    if (fin_received_) {
+      std::error_code ec;
+      conn_.shutdown(asio::socket_base::shutdown_send, ec);
+      try_finish();
+    }
+    return;
+  }
+
+  size_t preamble_size = preamble_.size();
+  size_t data_size = in_.empty() ? 0 : in_.front().size();
+  std::array<asio::const_buffer, 2> bufs = {
+      asio::buffer(preamble_.data(), preamble_size),
+      in_.empty() ? asio::const_buffer() : asio::buffer(in_.front())};
+
+  writing_ = true;
+  auto self = shared_from_this();
+  asio::async_write(
+      conn_, bufs,
+      [this, self, preamble_size, data_size](std::error_code ec, size_t) {
+        writing_ = false;
+        if (closed_)
+          return;
+        if (ec) {
+          LOG_ERROR("Fail to write", KV("error", ec.message()),
+                    KV("laddr", laddr_text_),
+                    KV("raddr", raddr_text_), KV("stream", id_));
+          tunnel_->send_control(id_, kFrameReset, nullptr, 0);
+          abort();
+          return;
+        }
+        LOG_TRACE("Write", KV("laddr", laddr_text_),
+                  KV("raddr", raddr_text_), KV("n", data_size));
+        preamble_.clear();
+        if (data_size > 0)
+          in_.pop_front();
+        write_count_ += data_size;
+
+        unacked_ += data_size;
+        if (unacked_ >= kWindowUpdateThreshold) {
+          uint8_t inc[4];
+          put_be32(inc, unacked_);
+          recv_window_ += unacked_;
+          unacked_ = 0;
+          tunnel_->send_control(id_, kFrameWindow, inc, sizeof(inc));
+        }
+        write();
+      });
+}
+
+void TunnelStream::on_data(const char *data, size_t n) noexcept {
+  if (n > recv_window_) {
+    LOG_ERROR("Fail to receive stream data",
+              KV("error", std::error_code(TunnelErrWindowExceeded,
+                                          tunnel_category())
+                              .message()),
+              KV("stream", id_), KV("n", n), KV("window", recv_window_));
+    tunnel_->send_control(id_, kFrameReset, nullptr, 0);
+    abort();
+    return;
+  }
+  recv_window_ -= n;
+  in_.emplace_back(data, data + n);
+  write();
+}
+
+void TunnelStream::on_window(uint32_t increment) noexcept {
+  send_window_ += increment;
+  read();
+}
+
+void TunnelStream::on_fin() noexcept {
+  fin_received_ = true;
+  write();
+}
+
+void TunnelStream::try_finish() noexcept {
+  if (!fin_sent_ || !fin_received_ || writing_ || !in_.empty())
+    return;
+  std::error_code ec;
+  closed_ = true;
+  conn_.close(ec);
+  tunnel_->remove_stream(id_);
+}
+
+void TunnelStream::abort() noexcept {
+  if (closed_)
+    return;
+  std::error_code ec;
+  closed_ = true;
+  conn_.close(ec);
+  tunnel_->remove_stream(id_);
+}
+
+Tunnel::Tunnel(asio::io_context &context,
+               const RelayEndpointTuple &endpoint_tuple)
+    : context_(context), endpoint_tuple_(endpoint_tuple), conn_(context),
+      connected_(false), closed_(false), writing_(false), next_stream_id_(1),
+      read_buf_(kTunnelReadSize * 2) {}
+
+void Tunnel::connect() noexcept {
+  std::error_code ec;
+  if (endpoint_tuple_.src.port() > 0 ||
+      !endpoint_tuple_.src.address().is_unspecified()) {
+    conn_.open(endpoint_tuple_.src.protocol(), ec);
+    if (!ec)
+      conn_.bind(endpoint_tuple_.src, ec);
+    if (ec) {
+      LOG_ERROR("Fail to bind", KV("err", ec.message()),
+                KV("src", EndpointText(endpoint_tuple_.src)));
+      fail(ec);
+      return;
+    }
+  }
+
+  auto self = shared_from_this();
+  conn_.async_connect(to_tcp(endpoint_tuple_.dst), [this,
+                                                    self](std::error_code ec) {
+    if (ec) {
+      LOG_ERROR("Fail to connect tunnel", KV("error", ec.message()),
+                KV("src", EndpointText(endpoint_tuple_.src)),
+                KV("dst", EndpointText(endpoint_tuple_.dst)));
+      fail(ec);
+      return;
+    }
+    raddr_text_ = EndpointText(endpoint_tuple_.dst);
+    start();
+  });
+}
+
+void Tunnel::accept(tcp::socket conn) noexcept {
+  std::error_code ec;
+  conn_ = std::move(conn);
+  raddr_text_ = EndpointText(conn_.remote_endpoint(ec));
+  start();
+}
+
+void Tunnel::start() noexcept {
+  std::error_code ec;
+  conn_.set_option(tcp::no_delay(true), ec);
+  conn_.set_option(asio::socket_base::keep_alive(true), ec);
+  LOG_INFO("Tunnel up", KV("laddr", EndpointText(conn_.local_endpoint(ec))),
+           KV("raddr", raddr_text_),
+           KV("mode", to_string(endpoint_tuple_.tunnel)));
+
+  connected_ = true;
+  read_frames();
+  flush();
+}
+
+void Tunnel::open_stream(RelaySocket conn, const RelayEndpoint &laddr,
+                         const RelayEndpoint &raddr,
+                         Relay::SharedBuffer client_buf) noexcept {
+  uint32_t id = next_stream_id_++;
+  auto stream =
+      std::make_shared<TunnelStream>(shared_from_this(), id, std::move(conn));
+  stream->laddr_text_ = EndpointText(laddr);
+  stream->raddr_text_ = EndpointText(raddr);
+  stream->pending_ = std::move(client_buf);
+  streams_[id] = stream;
+
+  // The far side learns the real client addresses for its send_proxy.
+  uint8_t open[kOpenPayloadSize];
+  encode_open(open, to_tcp(raddr), to_tcp(laddr));
+  send_control(id, kFrameOpen, open, sizeof(open));
+  LOG_INFO("Forward stream", KV("from", stream->raddr_text_),
+           KV("via", stream->laddr_text_), KV("to", raddr_text_),
+           KV("stream", id));
+  stream->start();
+}
+
+void Tunnel::open_remote_stream(uint32_t id, const char *payload,
+                                size_t len) noexcept {
+  tcp::endpoint from, via;
+  if (len >= kOpenPayloadSize)
+    decode_open(reinterpret_cast<const uint8_t *>(payload), from, via);
+
+  auto stream = std::make_shared<TunnelStream>(shared_from_this(), id,
+                                               RelaySocket(context_));
+  streams_[id] = stream;
+  stream->connect(from, via);
+}
+
+void Tunnel::read_frames() noexcept {
+  auto self = shared_from_this();
+  conn_.async_read_some(
+      read_buf_.prepare(kTunnelReadSize),
+      [this, self](std::error_code ec, size_t n) {
+        if (closed_)
+          return;
+        if (ec) {
+          fail(ec);
+          return;
+        }
+        read_buf_.commit(n);
+
+        while (read_buf_.size() >= kFrameHeaderSize) {
+          const uint8_t *p =
+              static_cast<const uint8_t *>(read_buf_.data().data());
+          size_t len = be16(p + 6);
+          if (len > kFrameMaxPayload) {
+            fail(std::error_code(TunnelErrBadFrame, tunnel_category()));
+            return;
+          }
+          if (read_buf_.size() < kFrameHeaderSize + len)
+            break;
+
+          if (!handle_frame(be32(p), p[4],
+                            reinterpret_cast<const char *>(p) +
+                                kFrameHeaderSize,
+                            len)) {
+            fail(std::error_code(TunnelErrBadFrame, tunnel_category()));
+            return;
+          }
+          if (closed_)
+            return;
+          read_buf_.consume(kFrameHeaderSize + len);
+        }
+        read_frames();
+      });
+}
+
+bool Tunnel::handle_frame(uint32_t id, uint8_t type, const char *payload,
+                          size_t len) noexcept {
+  // Frames for streams we already reset are dropped.
+  std::shared_ptr<TunnelStream> stream;
+  auto it = streams_.find(id);
+  if (it != streams_.end())
+    stream = it->second;
+
+  switch (type) {
+  case kFrameOpen:
+    if (endpoint_tuple_.tunnel != kTunnelServer || stream)
+      return false;
+    open_remote_stream(id, payload, len);
+    return true;
+  case kFrameData:
+    if (stream)
+      stream->on_data(payload, len);
+    return true;
+  case kFrameWindow:
+    if (len != 4)
+      return false;
+    if (stream)
+      stream->on_window(be32(reinterpret_cast<const uint8_t *>(payload)));
+    return true;
+  case kFrameFin:
+    if (stream)
+      stream->on_fin();
+    return true;
+  case kFrameReset:
+    if (stream)
+      stream->abort();
+    return true;
+  default:
+    return false;
+  }
+}
+
+void Tunnel::send_control(uint32_t id, TunnelFrameType type,
+                          const void *payload, size_t len) noexcept {
+  if (closed_)
+    return;
+  append_frame(control_, id, type, payload, len);
+  flush();
+}
+
+void Tunnel::schedule(std::shared_ptr<TunnelStream> stream) noexcept {
+  if (closed_)
+    return;
+  ready_.push_back(std::move(stream));
+  flush();
+}
+
+void Tunnel::flush() noexcept {
+  if (!connected_ || closed_ || writing_)
+    return;
+
+  // Streams scheduled while the batch is built are picked up by this loop.
+  writing_ = true;
+  batch_.clear();
+  batch_.swap(control_);
+  while (!ready_.empty() && batch_.size() < kTunnelWriteBatch) {
+    auto stream = std::move(ready_.front());
+    ready_.pop_front();
+    if (stream->closed_ || stream->out_size_ == 0)
+      continue;
+    append_frame(batch_, stream->id_, kFrameData, stream->out_.data(),
+                 stream->out_size_);
+    stream->out_size_ = 0;
+    stream->read();
+  }
+  if (batch_.empty()) {
+    writing_ = false;
+    return;
+  }
+
+  auto self = shared_from_this();
+  asio::async_write(conn_, asio::buffer(batch_),
+                    [this, self](std::error_code ec, size_t) {
+                      writing_ = false;
+                      if (closed_)
+                        return;
+                      if (ec) {
+                        fail(ec);
+                        return;
+                      }
+                      flush();
+                    });
+}
+
+void Tunnel::remove_stream(uint32_t id) noexcept { streams_.erase(id); }
+
+void Tunnel::fail(const std::error_code &ec) noexcept {
+  if (closed_)
+    return;
+  LOG_ERROR("Tunnel down", KV("error", ec.message()),
+            KV("raddr", raddr_text_), KV("streams", streams_.size()));
+
+  std::error_code ignored;
+  closed_ = true;
+  conn_.close(ignored);
+  ready_.clear();
+  auto streams = std::move(streams_);
+  streams_.clear();
+  for (auto &p : streams)
+    p.second->abort();
+}
@@ -0,0 +1,163 @@
+//===- tunnel.h - Stream multiplexing tunnel --------------------*- C++ -*-===//
+//
+/// \file
+/// Multiplex many client streams over one persistent TCP connection between
+/// two mux instances.
+//
+// Author:  zxh
+// Date:    2026/10/16 11:02:17
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "relay.h"
+
+#include <array>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include <asio.hpp>
+
+// Frame header, network byte order:
+//   stream_id:32 type:8 reserved:8 length:16
+enum TunnelFrameType : uint8_t {
+  kFrameOpen = 0,   // payload: PROXY v2 style inet6 src/dst block
+  kFrameData = 1,   // payload: stream bytes
+  kFrameWindow = 2, // payload: window increment:32
+  kFrameFin = 3,    // sender will send no more data
+  kFrameReset = 4,  // abort the stream
+};
+
+const size_t kFrameHeaderSize = 8;
+const size_t kFrameMaxPayload = 1024 * 16;
+const uint32_t kStreamInitialWindow = 1024 * 256;
+
+const char *to_string(TunnelMode mode);
+
+class Tunnel;
+
+/// One client connection carried by a Tunnel, bridging a local socket to
+/// frames of a single stream id.
+class TunnelStream : public std::enable_shared_from_this<TunnelStream> {
+public:
+  TunnelStream(std::shared_ptr<Tunnel> tunnel, uint32_t id, RelaySocket conn);
+
+  ~TunnelStream();
+
+  /// Streams of all contexts not yet destroyed, either side of a tunnel.
+  static size_t live() { return live_.load(std::memory_order_relaxed); }
+
+private:
+  friend class Tunnel;
+
+  /// Server side, dial the tuple dst for a client that connected \p from
+  /// the far side's listener \p via.
+  void connect(const asio::ip::tcp::endpoint &from,
+               const asio::ip::tcp::endpoint &via) noexcept;
+
+  void start() noexcept;
+
+  void read() noexcept;
+
+  void write() noexcept;
+
+  void on_data(const char *data, size_t n) noexcept;
+
+  void on_window(uint32_t increment) noexcept;
+
+  void on_fin() noexcept;
+
+  void try_finish() noexcept;
+
+  void abort() noexcept;
+
+  std::shared_ptr<Tunnel> tunnel_;
+  uint32_t id_;
+  RelaySocket conn_;
+  EndpointText laddr_text_; // formatted once for every log line
+  EndpointText raddr_text_;
+  bool connected_;
+  bool closed_;
+
+  // Local socket to tunnel, one chunk in flight at a time.
+  Relay::SharedBuffer pending_; // handshake bytes, sent before reading
+  std::array<char, kFrameMaxPayload> out_;
+  size_t out_size_;
+  uint32_t send_window_;
+  bool reading_;
+  bool fin_sent_;
+
+  // Tunnel to local socket.
+  ProxyHeader preamble_; // server side send_proxy, outside flow control
+  std::deque<std::vector<char>> in_;
+  uint32_t recv_window_;
+  uint32_t unacked_;
+  bool writing_;
+  bool fin_received_;
+
+  uint64_t read_count_;
+  uint64_t write_count_;
+
+  static std::atomic<size_t> live_;
+};
+
+/// A persistent connection between two mux instances. The client side opens
+/// streams for accepted connections, the server side dials the tuple dst for
+/// every stream. Ready streams are served round robin, one frame each per
+/// turn, so a bulk stream can't starve the others.
+class Tunnel : public std::enable_shared_from_this<Tunnel> {
+public:
+  Tunnel(asio::io_context &context, const RelayEndpointTuple &endpoint_tuple);
+
+  /// Client side, dial the peer tunnel endpoint.
+  void connect() noexcept;
+
+  /// Server side, serve an accepted tunnel connection.
+  void accept(asio::ip::tcp::socket conn) noexcept;
+
+  /// Client side, carry an accepted client connection as a new stream.
+  void open_stream(RelaySocket conn, const RelayEndpoint &laddr,
+                   const RelayEndpoint &raddr,
+                   Relay::SharedBuffer client_buf) noexcept;
+
+  bool closed() const { return closed_; }
+
+private:
+  friend class TunnelStream;
+
+  void start() noexcept;
+
+  void read_frames() noexcept;
+
+  bool handle_frame(uint32_t id, uint8_t type, const char *payload,
+                    size_t len) noexcept;
+
+  void open_remote_stream(uint32_t id, const char *payload,
+                          size_t len) noexcept;
+
+  void send_control(uint32_t id, TunnelFrameType type, const void *payload,
+                    size_t len) noexcept;
+
+  void schedule(std::shared_ptr<TunnelStream> stream) noexcept;
+
+  void flush() noexcept;
+
+  void remove_stream(uint32_t id) noexcept;
+
+  void fail(const std::error_code &ec) noexcept;
+
+  asio::io_context &context_;
+  const RelayEndpointTuple &endpoint_tuple_;
+  asio::ip::tcp::socket conn_;
+  EndpointText raddr_text_;
+  bool connected_;
+  bool closed_;
+  bool writing_;
+  uint32_t next_stream_id_;
+  std::unordered_map<uint32_t, std::shared_ptr<TunnelStream>> streams_;
+  std::deque<std::shared_ptr<TunnelStream>> ready_;
+  std::vector<char> control_; // encoded control frames, sent before data
+  std::vector<char> batch_;   // frames being written
+  asio::streambuf read_buf_;
+};
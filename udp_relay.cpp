@@ -0,0 +1,330 @@
+//===- udp_relay.cpp - UDP relay --------------------------------*- C++ -*-===//
+//
+/// \file
+/// UDP datagram relay with per-client sessions and batched socket I/O.
+//
+// Author:  zxh
+// Date:    2026/10/16 14:21:48
+//===----------------------------------------------------------------------===//
+
+#include "udp_relay.h"
+#include "logrus.h"
+#include "netutil.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <cstring>
+#include <string_view>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+using asio::ip::udp;
+
+using ReusePort =
+    asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+using UdpGro = asio::detail::socket_option::boolean<SOL_UDP, UDP_GRO>;
+
+UdpBatch::UdpBatch() : buf(kUdpBatchSize * kUdpBufSize) {}
+
+int UdpBatch::recv(int fd) {
+  for (size_t i = 0; i < kUdpBatchSize; i++) {
+    iovs[i].iov_base = buf.data() + i * kUdpBufSize;
+    iovs[i].iov_len = kUdpBufSize;
+    msghdr &h = msgs[i].msg_hdr;
+    h.msg_name = &names[i];
+    h.msg_namelen = sizeof(names[i]);
+    h.msg_iov = &iovs[i];
+    h.msg_iovlen = 1;
+    h.msg_control = ctrls[i].data();
+    h.msg_controllen = ctrls[i].size();
+    h.msg_flags = 0;
+    msgs[i].msg_len = 0;
+  }
+
+  int n = ::recvmmsg(fd, msgs.data(), kUdpBatchSize, MSG_DONTWAIT, nullptr);
+  for (int i = 0; i < n; i++) {
+    gso_sizes[i] = 0;
+    msghdr &h = msgs[i].msg_hdr;
+    for (cmsghdr *c = CMSG_FIRSTHDR(&h); c; c = CMSG_NXTHDR(&h, c)) {
+      if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+        int size;
+        std::memcpy(&size, CMSG_DATA(c), sizeof(size));
+        gso_sizes[i] = size;
+      }
+    }
+  }
+  return n;
+}
+
+std::atomic<size_t> UdpSession::live_(0);
+
+size_t UdpEndpointHash::operator()(const udp::endpoint &ep) const noexcept {
+  asio::ip::address addr = ep.address();
+  if (addr.is_v4())
+    return (size_t(addr.to_v4().to_uint()) << 16) | ep.port();
+  auto b = addr.to_v6().to_bytes();
+  size_t h = std::hash<std::string_view>()(
+      std::string_view(reinterpret_cast<const char *>(b.data()), b.size()));
+  return h ^ (ep.port() * 0x9E3779B97F4A7C15ULL);
+}
+
+/// Outgoing datagrams of one sendmmsg call on one socket. Coalesced GRO
+/// trains leave as a single GSO send when \c gso is on, otherwise they are
+/// split back into datagrams.
+class UdpSendBatch {
+public:
+  UdpSendBatch(int fd, bool gso) : fd_(fd), gso_(gso), n_(0), bytes_(0) {}
+
+  void add(const char *data, size_t len, sockaddr_storage *name,
+           socklen_t namelen, uint16_t gso_size) {
+    if (gso_size > 0 && len > gso_size && !gso_) {
+      for (size_t off = 0; off < len; off += gso_size)
+        add(data + off, std::min<size_t>(gso_size, len - off), name, namelen,
+            0);
+      return;
+    }
+    if (n_ == kCapacity)
+      flush();
+
+    iovs_[n_].iov_base = const_cast<char *>(data);
+    iovs_[n_].iov_len = len;
+    msghdr &h = msgs_[n_].msg_hdr;
+    h.msg_name = name;
+    h.msg_namelen = namelen;
+    h.msg_iov = &iovs_[n_];
+    h.msg_iovlen = 1;
+    h.msg_control = nullptr;
+    h.msg_controllen = 0;
+    h.msg_flags = 0;
+    if (gso_size > 0 && len > gso_size) {
+      h.msg_control = ctrls_[n_].data();
+      h.msg_controllen = ctrls_[n_].size();
+      cmsghdr *c = CMSG_FIRSTHDR(&h);
+      c->cmsg_level = SOL_UDP;
+      c->cmsg_type = UDP_SEGMENT;
+      c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      std::memcpy(CMSG_DATA(c), &gso_size, sizeof(gso_size));
+    }
+    n_++;
+  }
+
+  /// Send what was added, datagrams the socket can't take now are dropped
+  /// like the network would. Return the bytes sent so far.
+  size_t flush() {
+    size_t off = 0;
+    while (off < n_) {
+      int r = ::sendmmsg(fd_, msgs_.data() + off, n_ - off, MSG_DONTWAIT);
+      if (r < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        off++; // e.g. ECONNREFUSED queued by ICMP, skip the datagram
+        continue;
+      }
+      for (int i = 0; i < r; i++)
+        bytes_ += msgs_[off + i].msg_len;
+      off += r;
+    }
+    if (off < n_)
+      LOG_TRACE("Drop udp datagrams", KV("fd", fd_), KV("n", n_ - off));
+    n_ = 0;
+    return bytes_;
+  }
+
+private:
+  static const size_t kCapacity = kUdpBatchSize * 4;
+
+  int fd_;
+  bool gso_;
+  size_t n_;
+  size_t bytes_;
+  std::array<mmsghdr, kCapacity> msgs_;
+  std::array<iovec, kCapacity> iovs_;
+  std::array<std::array<char, CMSG_SPACE(sizeof(uint16_t))>, kCapacity> ctrls_;
+};
+
+static udp::endpoint to_udp(const asio::ip::tcp::endpoint &ep) {
+  return udp::endpoint(ep.address(), ep.port());
+}
+
+UdpRelay::UdpRelay(asio::io_context &context,
+                   const RelayEndpointTuple &endpoint_tuple)
+    : context_(context), endpoint_tuple_(endpoint_tuple), listener_(context),
+      src_(to_udp(endpoint_tuple.src)),
+      dst_(to_udp(to_tcp(endpoint_tuple.dst))),
+      listen_text_(endpoint_tuple.listen), dst_text_(dst_) {
+  udp::endpoint listen = to_udp(to_tcp(endpoint_tuple.listen));
+  listener_.open(listen.protocol());
+  set_cloexec(listener_.native_handle());
+  listener_.set_option(udp::socket::reuse_address(true));
+  listener_.set_option(ReusePort(true));
+  if (endpoint_tuple.udp_gro) {
+    std::error_code ec;
+    listener_.set_option(UdpGro(true), ec);
+    if (ec)
+      LOG_WARN("Fail to enable udp gro", KV("error", ec.message()),
+               KV("addr", listen_text_));
+  }
+  listener_.bind(listen);
+}
+
+void UdpRelay::start() noexcept { wait_listener(); }
+
+// A zero length peek completes as soon as a datagram is queued, the batch
+// is then drained with recvmmsg outside asio.
+void UdpRelay::wait_listener() noexcept {
+  auto self = shared_from_this();
+  listener_.async_receive(
+      asio::mutable_buffer(), asio::socket_base::message_peek,
+      [this, self](std::error_code ec, size_t) {
+        if (ec == asio::error::operation_aborted)
+          return;
+
+        int n = batch_.recv(listener_.native_handle());
+        auto now = std::chrono::steady_clock::now();
+        SessionPtr session;
+        int begin = 0;
+        for (int i = 0; i < n; i++) {
+          const msghdr &h = batch_.msgs[i].msg_hdr;
+          udp::endpoint client;
+          std::memcpy(client.data(), h.msg_name, h.msg_namelen);
+          client.resize(h.msg_namelen);
+
+          // Runs of datagrams from one client go out in one sendmmsg.
+          if (session && session->client_ == client)
+            continue;
+          if (session)
+            forward(session, begin, i);
+          begin = i;
+
+          auto it = sessions_.find(client);
+          session = it != sessions_.end() ? it->second : new_session(client);
+          if (session)
+            session->last_active_ = now;
+        }
+        if (session)
+          forward(session, begin, n);
+
+        wait_listener();
+      });
+}
+
+void UdpRelay::wait_session(SessionPtr session) noexcept {
+  auto self = shared_from_this();
+  session->conn_.async_receive(
+      asio::mutable_buffer(), asio::socket_base::message_peek,
+      [this, self, session](std::error_code ec, size_t) {
+        if (ec == asio::error::operation_aborted || !session->conn_.is_open())
+          return;
+
+        int n = batch_.recv(session->conn_.native_handle());
+        if (n > 0) {
+          session->last_active_ = std::chrono::steady_clock::now();
+          backward(session, n);
+        }
+        wait_session(session);
+      });
+}
+
+void UdpRelay::forward(const SessionPtr &session, size_t begin,
+                       size_t end) noexcept {
+  if (!session)
+    return;
+  UdpSendBatch out(session->conn_.native_handle(), endpoint_tuple_.udp_gso);
+  for (size_t i = begin; i < end; i++) {
+    const char *data = static_cast<const char *>(batch_.iovs[i].iov_base);
+    size_t len = batch_.msgs[i].msg_len;
+    LOG_TRACE("Read", KV("raddr", session->client_text_), KV("n", len));
+    session->read_count_ += len;
+    out.add(data, len, nullptr, 0, batch_.gso_sizes[i]);
+  }
+  out.flush();
+}
+
+void UdpRelay::backward(const SessionPtr &session, int n) noexcept {
+  sockaddr_storage name;
+  socklen_t namelen = session->client_.size();
+  std::memcpy(&name, session->client_.data(), namelen);
+
+  UdpSendBatch out(listener_.native_handle(), endpoint_tuple_.udp_gso);
+  for (int i = 0; i < n; i++) {
+    const char *data = static_cast<const char *>(batch_.iovs[i].iov_base);
+    out.add(data, batch_.msgs[i].msg_len, &name, namelen,
+            batch_.gso_sizes[i]);
+  }
+  size_t sent = out.flush();
+  LOG_TRACE("Write", KV("raddr", session->client_text_), KV("n", sent));
+  session->write_count_ += sent;
+}
+
+UdpRelay::SessionPtr
+UdpRelay::new_session(const udp::endpoint &client) noexcept {
+  if (sessions_.size() >= endpoint_tuple_.udp_max_sessions) {
+    dropped_++;
+    if (!limit_warned_) {
+      limit_warned_ = true;
+      LOG_WARN("Udp session limit reached", KV("via", listen_text_),
+               KV("sessions", sessions_.size()));
+    }
+    return nullptr;
+  }
+  auto session = std::make_shared<UdpSession>(context_, client);
+  std::error_code ec;
+  session->conn_.open(dst_.protocol(), ec);
+  if (!ec)
+    set_cloexec(session->conn_.native_handle());
+  if (!ec && (src_.port() > 0 || !src_.address().is_unspecified()))
+    session->conn_.bind(src_, ec);
+  if (!ec && endpoint_tuple_.udp_gro)
+    session->conn_.set_option(UdpGro(true), ec);
+  if (!ec)
+    session->conn_.connect(dst_, ec);
+  if (ec) {
+    LOG_ERROR("Fail to open udp session", KV("error", ec.message()),
+              KV("from", session->client_text_),
+              KV("src", EndpointText(src_)), KV("dst", dst_text_));
+    return nullptr;
+  }
+
+  LOG_INFO("New udp session", KV("from", session->client_text_),
+           KV("via", listen_text_), KV("to", dst_text_),
+           KV("sessions", sessions_.size() + 1));
+  sessions_.emplace(client, session);
+  wait_session(session);
+  return session;
+}
+
+void UdpRelay::close_session(const SessionPtr &session) noexcept {
+  LOG_INFO("Udp session done", KV("from", session->client_text_),
+           KV("via", listen_text_), KV("to", dst_text_),
+           KV("in_bytes", session->read_count_),
+           KV("out_bytes", session->write_count_));
+  std::error_code ec;
+  session->conn_.close(ec);
+}
+
+void UdpRelay::expire(std::chrono::steady_clock::time_point now) noexcept {
+  if (dropped_ > 0) {
+    LOG_WARN("Drop udp datagrams over session limit", KV("via", listen_text_),
+             KV("count", dropped_));
+    dropped_ = 0;
+  }
+  for (auto it = sessions_.begin(); it != sessions_.end();) {
+    if (now - it->second->last_active_ < endpoint_tuple_.udp_idle) {
+      ++it;
+      continue;
+    }
+    close_session(it->second);
+    it = sessions_.erase(it);
+  }
+  if (sessions_.size() < endpoint_tuple_.udp_max_sessions)
+    limit_warned_ = false;
+}
@@ -0,0 +1,110 @@
+//===- udp_relay.h - UDP relay ----------------------------------*- C++ -*-===//
+//
+/// \file
+/// UDP datagram relay with per-client sessions and batched socket I/O.
+//
+// Author:  zxh
+// Date:    2026/10/16 14:05:31
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "relay.h"
+
+#include <sys/socket.h>
+
+#include <array>
+#include <unordered_map>
+#include <vector>
+
+#include <asio.hpp>
+
+// Datagrams moved per recvmmsg/sendmmsg call, and the room for each one,
+// large enough for a maximum sized datagram or a GRO coalesced train.
+const size_t kUdpBatchSize = 16;
+const size_t kUdpBufSize = 1024 * 64;
+
+/// Scratch space for one recvmmsg/sendmmsg round. A relay handles a batch
+/// completely before the next read, so one instance serves all its sockets.
+struct UdpBatch {
+  UdpBatch();
+
+  /// Receive up to kUdpBatchSize datagrams without blocking, GRO segment
+  /// sizes end up in \c gso_sizes. Return the count or -1 with errno set.
+  int recv(int fd);
+
+  std::vector<char> buf;
+  std::array<mmsghdr, kUdpBatchSize> msgs;
+  std::array<iovec, kUdpBatchSize> iovs;
+  std::array<sockaddr_storage, kUdpBatchSize> names;
+  std::array<std::array<char, CMSG_SPACE(sizeof(int))>, kUdpBatchSize> ctrls;
+  std::array<uint16_t, kUdpBatchSize> gso_sizes;
+};
+
+struct UdpEndpointHash {
+  size_t operator()(const asio::ip::udp::endpoint &ep) const noexcept;
+};
+
+struct UdpSession {
+  asio::ip::udp::socket conn_; // connected to dst
+  asio::ip::udp::endpoint client_;
+  EndpointText client_text_; // formatted once for every log line
+  std::chrono::steady_clock::time_point last_active_;
+  uint64_t read_count_;
+  uint64_t write_count_;
+
+  UdpSession(asio::io_context &context, const asio::ip::udp::endpoint &client)
+      : conn_(context), client_(client), client_text_(client), read_count_(0),
+        write_count_(0) {
+    live_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  ~UdpSession() { live_.fetch_sub(1, std::memory_order_relaxed); }
+
+  /// Sessions of all contexts not yet destroyed.
+  static size_t live() { return live_.load(std::memory_order_relaxed); }
+
+  static std::atomic<size_t> live_;
+};
+
+/// Relay a UDP tuple on one RelayIOContext. Every context binds the listen
+/// address with SO_REUSEPORT, so the kernel keeps a client on one context
+/// and the session table needs no locking. Sessions are expired from the
+/// context timer once idle for the tuple's udp_idle. Datagrams of new
+/// clients are dropped while the table holds udp_max_sessions.
+class UdpRelay : public std::enable_shared_from_this<UdpRelay> {
+public:
+  UdpRelay(asio::io_context &context, const RelayEndpointTuple &endpoint_tuple);
+
+  void start() noexcept;
+
+  void expire(std::chrono::steady_clock::time_point now) noexcept;
+
+private:
+  using SessionPtr = std::shared_ptr<UdpSession>;
+
+  void wait_listener() noexcept;
+
+  void wait_session(SessionPtr session) noexcept;
+
+  void forward(const SessionPtr &session, size_t begin, size_t end) noexcept;
+
+  void backward(const SessionPtr &session, int n) noexcept;
+
+  SessionPtr new_session(const asio::ip::udp::endpoint &client) noexcept;
+
+  void close_session(const SessionPtr &session) noexcept;
+
+  asio::io_context &context_;
+  const RelayEndpointTuple &endpoint_tuple_;
+  asio::ip::udp::socket listener_;
+  asio::ip::udp::endpoint src_;
+  asio::ip::udp::endpoint dst_;
+  EndpointText listen_text_; // formatted once for every log line
+  EndpointText dst_text_;
+  std::unordered_map<asio::ip::udp::endpoint, SessionPtr, UdpEndpointHash>
+      sessions_;
+  uint64_t dropped_ = 0; // datagrams over the session limit since expire
+  bool limit_warned_ = false; // until the table is below the limit again
+  UdpBatch batch_;
+};
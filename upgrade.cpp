@@ -0,0 +1,205 @@
+//===- upgrade.cpp - Binary upgrade with listener handoff -------*- C++ -*-===//
+//
+/// \file
+/// Pass listening sockets from a running mux to a new one.
+//
+// Author:  zxh
+// Date:    2026/10/17 20:25:13
+//===----------------------------------------------------------------------===//
+
+#include "upgrade.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+// The kernel passes at most this many fds in one message.
+static const size_t kMaxPassedFds = 253;
+
+static std::error_code last_error() {
+  return std::error_code(errno, std::system_category());
+}
+
+// Arguments this process was started with, from /proc so main needn't keep
+// them.
+static std::vector<std::string> self_args() {
+  std::ifstream in("/proc/self/cmdline", std::ios::binary);
+  std::string all((std::istreambuf_iterator<char>(in)),
+                  std::istreambuf_iterator<char>());
+  std::vector<std::string> args;
+  for (size_t i = 0; i < all.size();) {
+    size_t end = all.find('\0', i);
+    if (end == std::string::npos)
+      end = all.size();
+    args.push_back(all.substr(i, end - i));
+    i = end + 1;
+  }
+  return args;
+}
+
+int spawn_successor(const std::vector<int> &fds,
+                    const std::vector<std::string> &names, pid_t &pid,
+                    std::error_code &ec) {
+  ec = std::error_code();
+  if (fds.size() > kMaxPassedFds) {
+    ec = std::make_error_code(std::errc::too_many_files_open);
+    return -1;
+  }
+  std::vector<std::string> args = self_args();
+  if (args.empty()) {
+    ec = std::make_error_code(std::errc::no_such_file_or_directory);
+    return -1;
+  }
+
+  int sv[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+    ec = last_error();
+    return -1;
+  }
+
+  // Other threads may hold locks at fork, so the child only calls async
+  // signal safe functions and everything is prepared here.
+  std::vector<char *> argv;
+  for (auto &a : args)
+    argv.push_back(&a[0]);
+  argv.push_back(nullptr);
+  std::string fd_env =
+      std::string(kUpgradeFdEnv) + "=" + std::to_string(sv[1]);
+  std::vector<char *> envp;
+  for (char **e = environ; *e; e++)
+    if (std::strncmp(*e, fd_env.c_str(), sizeof(kUpgradeFdEnv)) != 0)
+      envp.push_back(*e);
+  envp.push_back(&fd_env[0]);
+  envp.push_back(nullptr);
+
+  pid = ::fork();
+  if (pid < 0) {
+    ec = last_error();
+    ::close(sv[0]);
+    ::close(sv[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    // Listeners come over the channel, any other fd inherited would keep
+    // relays, UDP reuseport members and listeners of this process alive
+    // in the successor.
+    unsigned channel = sv[1];
+    if (channel > 3)
+      ::close_range(3, channel - 1, 0);
+    ::close_range(channel + 1, ~0U, 0);
+    // argv[0] is looked up like the shell did, so a binary replaced at the
+    // same path is the one started.
+    ::fcntl(sv[1], F_SETFD, 0);
+    ::execvpe(argv[0], argv.data(), envp.data());
+    ::_exit(127);
+  }
+  ::close(sv[1]);
+
+  // Names travel newline separated in the payload, in the order of fds.
+  std::string payload;
+  for (const auto &n : names)
+    payload += n + "\n";
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+  iovec iov = {&payload[0], payload.size()};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (!fds.empty()) {
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  }
+  if (::sendmsg(sv[0], &msg, MSG_NOSIGNAL) < 0) {
+    ec = last_error();
+    ::close(sv[0]);
+    return -1;
+  }
+  return sv[0];
+}
+
+// A successor failing before ready() leaves the predecessor serving.
+InheritedListeners::~InheritedListeners() {
+  for (auto &f : fds_)
+    ::close(f.second);
+  if (channel_ >= 0)
+    ::close(channel_);
+}
+
+void InheritedListeners::receive(std::error_code &ec) {
+  ec = std::error_code();
+  const char *env = std::getenv(kUpgradeFdEnv);
+  if (!env)
+    return;
+  channel_ = std::atoi(env);
+  ::unsetenv(kUpgradeFdEnv);
+  ::fcntl(channel_, F_SETFD, FD_CLOEXEC);
+
+  std::vector<char> payload(64 * 1024);
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * kMaxPassedFds));
+  iovec iov = {payload.data(), payload.size()};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  ssize_t n = ::recvmsg(channel_, &msg, MSG_CMSG_CLOEXEC);
+  if (n < 0) {
+    ec = last_error();
+    return;
+  }
+
+  std::vector<int> fds;
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    fds.resize(count);
+    std::memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * count);
+  }
+
+  std::string names(payload.data(), n);
+  size_t i = 0;
+  for (int fd : fds) {
+    size_t end = names.find('\n', i);
+    if (end == std::string::npos) {
+      ::close(fd);
+      continue;
+    }
+    fds_[names.substr(i, end - i)] = fd;
+    i = end + 1;
+  }
+  if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+    ec = std::make_error_code(std::errc::message_size);
+}
+
+int InheritedListeners::take(const std::string &name) {
+  auto it = fds_.find(name);
+  if (it == fds_.end())
+    return -1;
+  int fd = it->second;
+  fds_.erase(it);
+  return fd;
+}
+
+void InheritedListeners::ready() {
+  for (auto &f : fds_)
+    ::close(f.second);
+  fds_.clear();
+  if (channel_ < 0)
+    return;
+  ssize_t n = ::write(channel_, &kUpgradeReady, 1);
+  (void)n;
+  ::close(channel_);
+  channel_ = -1;
+}
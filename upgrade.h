@@ -0,0 +1,56 @@
+//===- upgrade.h - Binary upgrade with listener handoff ---------*- C++ -*-===//
+//
+/// \file
+/// Pass listening sockets from a running mux to a new one.
+//
+// Author:  zxh
+// Date:    2026/10/17 20:12:40
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <sys/types.h>
+
+// Environment variable holding the channel fd in a successor.
+const char kUpgradeFdEnv[] = "MUX_UPGRADE_FD";
+
+// Byte a successor sends once it accepts on the passed sockets.
+const char kUpgradeReady = 'R';
+
+/// Start this binary again with the same arguments, hand it \p fds with
+/// SCM_RIGHTS, each named by \p names. Return our end of the channel, the
+/// successor writes kUpgradeReady to it, or -1 with \p ec set. \p pid is
+/// the successor.
+int spawn_successor(const std::vector<int> &fds,
+                    const std::vector<std::string> &names, pid_t &pid,
+                    std::error_code &ec);
+
+/// Listening sockets received from a predecessor, by listen address.
+class InheritedListeners {
+public:
+  InheritedListeners() = default;
+  InheritedListeners(const InheritedListeners &) = delete;
+  InheritedListeners &operator=(const InheritedListeners &) = delete;
+  ~InheritedListeners();
+
+  /// Receive the sockets if this process was started by spawn_successor(),
+  /// nothing otherwise.
+  void receive(std::error_code &ec);
+
+  bool upgrading() const { return channel_ >= 0; }
+
+  /// The socket listening on \p name, or -1. The caller owns it.
+  int take(const std::string &name);
+
+  /// Tell the predecessor to stop accepting, close sockets nobody took.
+  void ready();
+
+private:
+  int channel_ = -1;
+  std::map<std::string, int> fds_;
+};